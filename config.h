@@ -6,17 +6,20 @@
 
 #define CONFIG_MAX_USB_MIDI_DEVICES 8
 #define CONFIG_USB_SCAN_INTERVAL_MS 1000
-#define CONFIG_MAIN_LOOP_DELAY_MS 10
 #define CONFIG_STATUS_PRINT_INTERVAL_S 30
 
 #define CONFIG_ENABLE_DEBUG_MESSAGES 1
 #define CONFIG_ENABLE_DEVICE_HOTPLUG 1
 #define CONFIG_ENABLE_AUTO_CONNECT 1
 
-#define CONFIG_MIDI_BUFFER_SIZE 64
-#define CONFIG_VW_MESSAGE_BUFFER_SIZE 128
-#define CONFIG_MAX_VW_DEVICES 8
-#define CONFIG_MAX_VW_CONNECTIONS 16
+#define CONFIG_VW_MESSAGE_BUFFER_SIZE 256
+#define CONFIG_MAX_VW_DEVICES 16
+#define CONFIG_MAX_VW_CONNECTIONS 32
+#define CONFIG_VW_ROUTER_WORKERS 0
+
+// Cables the hub offers a USB host, each mapped to a device port as it
+// connects (0 disables the host link)
+#define CONFIG_HOST_LINK_CABLES 4
 
 #ifdef CONFIG_ENABLE_DEBUG_MESSAGES
 #define DEBUG_PRINTF(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
@@ -3,26 +3,45 @@
 #include "config.h"
 #include "midi.h"
 #include "midi_virtual_wire.h"
+#include "rtos.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
-#include <unistd.h>
 #include <stdbool.h>
 
 #define MAX_USB_MIDI_DEVICES CONFIG_MAX_USB_MIDI_DEVICES
-#define USB_SCAN_INTERVAL_MS CONFIG_USB_SCAN_INTERVAL_MS
-#define MAIN_LOOP_DELAY_MS CONFIG_MAIN_LOOP_DELAY_MS
+#define USB_SCAN_INTERVAL_NS ((uint64_t)CONFIG_USB_SCAN_INTERVAL_MS * 1000000ULL)
+#define STATUS_PRINT_INTERVAL_NS ((uint64_t)CONFIG_STATUS_PRINT_INTERVAL_S * 1000000000ULL)
 
+#define HOST_LINK_CABLES CONFIG_HOST_LINK_CABLES
+
+#define NO_CABLE 0xFF
+#define NO_PORT 0
+
+// Each cable of a device is its own virtual-wire port. A port holds at most
+// one outgoing SysEx while it waits for, or occupies, the device's stream.
+// Incoming SysEx is assembled in the router's arena chunk by chunk, so
+// dumps up to MIDI_SYSEX_ARENA_MAX_LENGTH get through.
 typedef struct {
-    uint8_t usb_device_id;
     uint8_t vw_device_id;
+    midi_message_t sysex_out;
+    bool sysex_out_pending;
+    uint32_t sysex_in_length;
+} usb_midi_port_t;
+
+typedef struct {
+    uint8_t usb_device_id;
     char device_name[64];
     bool is_connected;
     bool is_midi_device;
     uint16_t vendor_id;
     uint16_t product_id;
     midi_callbacks_t midi_callbacks;
+    midi_dev_t *midi;
+    uint8_t port_count;
+    usb_midi_port_t ports[MIDI_MAX_CABLES];
+    uint8_t sysex_out_cable;
 } usb_midi_device_t;
 
 static struct {
@@ -30,8 +49,11 @@ static struct {
     bool initialized;
     usb_midi_device_t devices[MAX_USB_MIDI_DEVICES];
     uint8_t device_count;
-    uint32_t scan_counter;
-    uint32_t loop_counter;
+    rtos_event_t wakeup;
+    uint64_t next_scan_time;
+    uint64_t next_status_time;
+    usb_midi_device_t host_link;
+    uint8_t host_cable_ports[MIDI_MAX_CABLES];
 } main_app;
 
 static volatile bool shutdown_requested = false;
@@ -42,21 +64,32 @@ static void cleanup_system(void);
 static void scan_for_usb_devices(void);
 static void handle_usb_device_connected(uint8_t usb_device_id, uint16_t vid, uint16_t pid);
 static void handle_usb_device_disconnected(uint8_t usb_device_id);
+static bool open_midi_device(usb_midi_device_t *device);
+static void close_midi_device(usb_midi_device_t *device);
+static int open_host_link(void);
+static void map_host_cables(usb_midi_device_t *device);
+static void unmap_host_cables(usb_midi_device_t *device);
 static bool is_midi_device(uint16_t vendor_id, uint16_t product_id);
+static uint8_t get_midi_cable_count(uint16_t vendor_id, uint16_t product_id);
 static void get_device_name(uint16_t vendor_id, uint16_t product_id, char *name);
-static void midi_note_on_handler(uint8_t channel, uint8_t note, uint8_t velocity);
-static void midi_note_off_handler(uint8_t channel, uint8_t note, uint8_t velocity);
-static void midi_control_change_handler(uint8_t channel, uint8_t controller, uint8_t value);
-static void midi_program_change_handler(uint8_t channel, uint8_t program);
-static void midi_pitch_bend_handler(uint8_t channel, uint16_t bend);
-static void midi_sysex_handler(uint8_t *data, uint16_t length);
+static void midi_sysex_handler(midi_dev_t *dev, uint8_t cable, uint8_t *data, uint32_t length, bool last);
+static void midi_wakeup_handler(midi_dev_t *dev);
+static void midi_thru_handler(midi_dev_t *dev, uint32_t *events, uint16_t count);
 static void vw_device_state_callback(uint8_t device_id, midi_vw_device_state_t state);
 static void vw_message_callback(uint8_t device_id, midi_message_t *message);
-static bool vw_filter_callback(uint8_t source_device_id, uint8_t dest_device_id, midi_message_t *message);
+static bool vw_event_sink(uint8_t device_id, uint32_t event, void *context);
+static void wakeup_main_loop(void);
 static void process_midi_messages(void);
+static void process_device_messages(usb_midi_device_t *device);
+static void process_midi_tx(void);
+static uint64_t get_midi_tx_deadline(void);
+static bool service_sysex_out(usb_midi_device_t *device, uint8_t cable);
+static void release_sysex_out(usb_midi_device_t *device);
 static void print_status(void);
+static void print_device_status(usb_midi_device_t *device);
 static usb_midi_device_t* find_device_by_usb_id(uint8_t usb_device_id);
 static usb_midi_device_t* find_device_by_vw_id(uint8_t vw_device_id);
+static usb_midi_device_t* find_device_by_midi(midi_dev_t *midi);
 
 int main(void)
 {
@@ -76,22 +109,41 @@ int main(void)
     printf("Press Ctrl+C to exit\n\n");
 
     main_app.running = true;
+    main_app.next_scan_time = rtos_time_now_ns() + USB_SCAN_INTERVAL_NS;
+    main_app.next_status_time = rtos_time_now_ns() + STATUS_PRINT_INTERVAL_NS;
 
     while (main_app.running && !shutdown_requested) {
-        main_app.loop_counter++;
+        uint64_t now = rtos_time_now_ns();
 
-        if (main_app.loop_counter % (USB_SCAN_INTERVAL_MS / MAIN_LOOP_DELAY_MS) == 0) {
+        if (now >= main_app.next_scan_time) {
             scan_for_usb_devices();
+            main_app.next_scan_time = now + USB_SCAN_INTERVAL_NS;
         }
 
         process_midi_messages();
         midi_vw_process_messages();
+        process_midi_tx();
 
-        if (main_app.loop_counter % (5000 / MAIN_LOOP_DELAY_MS) == 0) {
+        if (now >= main_app.next_status_time) {
             print_status();
+            main_app.next_status_time = now + STATUS_PRINT_INTERVAL_NS;
+        }
+
+        uint64_t deadline = main_app.next_scan_time;
+        if (main_app.next_status_time < deadline) {
+            deadline = main_app.next_status_time;
         }
 
-        usleep(MAIN_LOOP_DELAY_MS * 1000);
+        uint64_t delivery_time = midi_vw_get_next_delivery_time();
+        uint64_t tx_deadline = get_midi_tx_deadline();
+        if (tx_deadline < delivery_time) {
+            delivery_time = tx_deadline;
+        }
+        if (delivery_time < deadline) {
+            deadline = delivery_time;
+        }
+
+        rtos_event_wait_until(&main_app.wakeup, deadline);
     }
 
     printf("\nShutdown requested, cleaning up...\n");
@@ -111,11 +163,12 @@ static void signal_handler(int signal)
 static int initialize_system(void)
 {
     memset(&main_app, 0, sizeof(main_app));
+    rtos_event_init(&main_app.wakeup);
 
     midi_vw_callbacks_t vw_callbacks = {
         .device_callback = vw_device_state_callback,
         .message_callback = vw_message_callback,
-        .filter_callback = vw_filter_callback
+        .wakeup_callback = wakeup_main_loop
     };
 
     if (midi_vw_init(&vw_callbacks) != MIDI_VW_SUCCESS) {
@@ -129,6 +182,21 @@ static int initialize_system(void)
         return -1;
     }
 
+    if (CONFIG_VW_ROUTER_WORKERS > 0 &&
+        midi_vw_start_workers(CONFIG_VW_ROUTER_WORKERS) != MIDI_VW_SUCCESS) {
+        printf("Failed to start MIDI virtual wire router workers\n");
+        midi_vw_deinit();
+        return -1;
+    }
+
+    // The host link has to be the first MIDI device opened: the USB
+    // configuration descriptor describes that device's endpoints
+    if (HOST_LINK_CABLES > 0 && open_host_link() != 0) {
+        printf("Failed to open USB host link\n");
+        midi_vw_deinit();
+        return -1;
+    }
+
     main_app.initialized = true;
     return 0;
 }
@@ -141,13 +209,20 @@ static void cleanup_system(void)
 
     main_app.running = false;
 
-    for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (main_app.devices[i].is_connected) {
-            handle_usb_device_disconnected(main_app.devices[i].usb_device_id);
+    // Disconnecting compacts the device table, so walk it from the end
+    for (uint8_t i = main_app.device_count; i > 0; i--) {
+        if (main_app.devices[i - 1].is_connected) {
+            handle_usb_device_disconnected(main_app.devices[i - 1].usb_device_id);
         }
     }
 
+    if (main_app.host_link.is_connected) {
+        close_midi_device(&main_app.host_link);
+        main_app.host_link.is_connected = false;
+    }
+
     midi_vw_deinit();
+    rtos_event_destroy(&main_app.wakeup);
     main_app.initialized = false;
 }
 
@@ -187,42 +262,37 @@ static void handle_usb_device_connected(uint8_t usb_device_id, uint16_t vid, uin
     get_device_name(vid, pid, device->device_name);
 
     if (device->is_midi_device) {
-        device->midi_callbacks.note_on_callback = midi_note_on_handler;
-        device->midi_callbacks.note_off_callback = midi_note_off_handler;
-        device->midi_callbacks.control_change_callback = midi_control_change_handler;
-        device->midi_callbacks.program_change_callback = midi_program_change_handler;
-        device->midi_callbacks.pitch_bend_callback = midi_pitch_bend_handler;
-        device->midi_callbacks.sysex_callback = midi_sysex_handler;
-
-        if (midi_init(&device->midi_callbacks) == MIDI_SUCCESS) {
-            if (midi_start() == MIDI_SUCCESS) {
-                if (midi_vw_register_device(device->device_name, true, true, &device->vw_device_id) == MIDI_VW_SUCCESS) {
-                    printf("✓ MIDI device '%s' connected and registered (VW ID: %d)\n", 
-                           device->device_name, device->vw_device_id);
-                    
-                    for (uint8_t i = 0; i < main_app.device_count; i++) {
-                        if (i != main_app.device_count && main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
-                            uint8_t connection_id;
-                            midi_vw_create_connection(device->vw_device_id, main_app.devices[i].vw_device_id, 
-                                                    0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id);
-                            midi_vw_create_connection(main_app.devices[i].vw_device_id, device->vw_device_id, 
-                                                    0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id);
-                            printf("  ↔ Created bidirectional connection with '%s'\n", main_app.devices[i].device_name);
-                        }
+        device->port_count = get_midi_cable_count(vid, pid);
+
+        if (open_midi_device(device)) {
+            printf("✓ MIDI device '%s' connected and registered (VW ID: %d",
+                   device->device_name, device->ports[0].vw_device_id);
+            for (uint8_t c = 1; c < device->port_count; c++) {
+                printf(", %d", device->ports[c].vw_device_id);
+            }
+            printf(")\n");
+
+            // Every port is wired to every port of the other devices, but a
+            // device's own ports are left apart
+            for (uint8_t i = 0; i < main_app.device_count; i++) {
+                usb_midi_device_t *other = &main_app.devices[i];
+                if (!other->is_connected || !other->is_midi_device) {
+                    continue;
+                }
+                for (uint8_t c = 0; c < device->port_count; c++) {
+                    for (uint8_t o = 0; o < other->port_count; o++) {
+                        uint8_t connection_id;
+                        midi_vw_create_connection(device->ports[c].vw_device_id, other->ports[o].vw_device_id,
+                                                0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id);
+                        midi_vw_create_connection(other->ports[o].vw_device_id, device->ports[c].vw_device_id,
+                                                0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id);
                     }
-                    
-                    main_app.device_count++;
-                } else {
-                    printf("✗ Failed to register MIDI device in virtual wire system\n");
-                    midi_stop();
-                    midi_deinit();
                 }
-            } else {
-                printf("✗ Failed to start MIDI device\n");
-                midi_deinit();
+                printf("  ↔ Created bidirectional connection with '%s'\n", other->device_name);
             }
-        } else {
-            printf("✗ Failed to initialize MIDI device\n");
+
+            map_host_cables(device);
+            main_app.device_count++;
         }
     } else {
         printf("- Non-MIDI USB device '%s' detected (not connecting to virtual wire)\n", device->device_name);
@@ -240,9 +310,8 @@ static void handle_usb_device_disconnected(uint8_t usb_device_id)
     printf("✗ USB device '%s' disconnected\n", device->device_name);
 
     if (device->is_midi_device) {
-        midi_vw_unregister_device(device->vw_device_id);
-        midi_stop();
-        midi_deinit();
+        unmap_host_cables(device);
+        close_midi_device(device);
     }
 
     device->is_connected = false;
@@ -258,28 +327,158 @@ static void handle_usb_device_disconnected(uint8_t usb_device_id)
     }
 }
 
+// Opens the driver instance and registers one virtual-wire port per cable;
+// port_count and device_name must be set. Failures are reported here.
+static bool open_midi_device(usb_midi_device_t *device)
+{
+    device->midi_callbacks.sysex_chunk_callback = midi_sysex_handler;
+    device->midi_callbacks.rx_ready_callback = midi_wakeup_handler;
+    device->midi_callbacks.sysex_sent_callback = midi_wakeup_handler;
+    device->midi_callbacks.thru_callback = midi_thru_handler;
+    device->sysex_out_cable = NO_CABLE;
+
+    if (midi_init(&device->midi_callbacks, &device->midi) != MIDI_SUCCESS) {
+        printf("✗ Failed to initialize MIDI device\n");
+        return false;
+    }
+
+    if (midi_start(device->midi) != MIDI_SUCCESS) {
+        printf("✗ Failed to start MIDI device\n");
+        midi_deinit(device->midi);
+        return false;
+    }
+
+    uint8_t registered = 0;
+    for (; registered < device->port_count; registered++) {
+        char port_name[80];
+        if (device->port_count > 1) {
+            snprintf(port_name, sizeof(port_name), "%s Port %d", device->device_name, registered + 1);
+        } else {
+            snprintf(port_name, sizeof(port_name), "%s", device->device_name);
+        }
+        if (midi_vw_register_device(port_name, true, true,
+                                    &device->ports[registered].vw_device_id) != MIDI_VW_SUCCESS) {
+            break;
+        }
+        midi_vw_set_event_sink(device->ports[registered].vw_device_id, vw_event_sink, device->midi);
+    }
+
+    if (registered < device->port_count) {
+        printf("✗ Failed to register MIDI device in virtual wire system\n");
+        while (registered > 0) {
+            midi_vw_unregister_device(device->ports[--registered].vw_device_id);
+        }
+        midi_stop(device->midi);
+        midi_deinit(device->midi);
+        return false;
+    }
+
+    return true;
+}
+
+static void close_midi_device(usb_midi_device_t *device)
+{
+    // Stopping ends any SysEx stream first; until then a completion can
+    // still read the arena payload it was given
+    midi_stop(device->midi);
+    release_sysex_out(device);
+    for (uint8_t c = 0; c < device->port_count; c++) {
+        midi_vw_unregister_device(device->ports[c].vw_device_id);
+    }
+    midi_deinit(device->midi);
+}
+
+// The hub shows up on the USB host as one interface with a cable per hub
+// port, so a single host connection reaches every device. Host cables are
+// handed to device ports as they appear.
+static int open_host_link(void)
+{
+    usb_midi_device_t *host = &main_app.host_link;
+
+    if (midi_set_interface_cables(HOST_LINK_CABLES) != MIDI_SUCCESS) {
+        return -1;
+    }
+
+    strcpy(host->device_name, "USB Host Link");
+    host->is_midi_device = true;
+    host->port_count = HOST_LINK_CABLES;
+
+    if (!open_midi_device(host)) {
+        return -1;
+    }
+
+    host->is_connected = true;
+    printf("✓ USB host link ready with %d cables\n", host->port_count);
+    return 0;
+}
+
+static void map_host_cables(usb_midi_device_t *device)
+{
+    usb_midi_device_t *host = &main_app.host_link;
+    if (!host->is_connected) {
+        return;
+    }
+
+    uint8_t cable = 0;
+    for (uint8_t c = 0; c < device->port_count; c++) {
+        while (cable < host->port_count && main_app.host_cable_ports[cable] != NO_PORT) {
+            cable++;
+        }
+        if (cable == host->port_count) {
+            printf("  ✗ No free host cable for '%s' port %d\n", device->device_name, c + 1);
+            return;
+        }
+
+        uint8_t connection_id;
+        midi_vw_create_connection(host->ports[cable].vw_device_id, device->ports[c].vw_device_id,
+                                0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id);
+        midi_vw_create_connection(device->ports[c].vw_device_id, host->ports[cable].vw_device_id,
+                                0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id);
+        main_app.host_cable_ports[cable] = device->ports[c].vw_device_id;
+        printf("  ⇄ Host cable %d mapped to '%s' port %d\n", cable + 1, device->device_name, c + 1);
+    }
+}
+
+// The connections go away with the device's ports; only the map is freed
+static void unmap_host_cables(usb_midi_device_t *device)
+{
+    for (uint8_t cable = 0; cable < MIDI_MAX_CABLES; cable++) {
+        for (uint8_t c = 0; c < device->port_count; c++) {
+            if (main_app.host_cable_ports[cable] == device->ports[c].vw_device_id) {
+                main_app.host_cable_ports[cable] = NO_PORT;
+            }
+        }
+    }
+}
+
+static const struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint8_t cables;
+} supported_midi_devices[] = {
+    {0x1234, 0x0001, 1},
+    {0x5678, 0x0002, 2},
+    {0x9ABC, 0x0003, 1},
+    {0x0499, 0x1000, 1},
+    {0x0582, 0x0000, 1},
+    {0x06F8, 0x0000, 1}
+};
+
 static bool is_midi_device(uint16_t vendor_id, uint16_t product_id)
 {
-    static struct {
-        uint16_t vid;
-        uint16_t pid;
-    } midi_devices[] = {
-        {0x1234, 0x0001},
-        {0x5678, 0x0002}, 
-        {0x9ABC, 0x0003},
-        {0x0499, 0x1000},
-        {0x0582, 0x0000},
-        {0x06F8, 0x0000}
-    };
+    return get_midi_cable_count(vendor_id, product_id) > 0;
+}
 
-    for (size_t i = 0; i < sizeof(midi_devices) / sizeof(midi_devices[0]); i++) {
-        if ((midi_devices[i].vid == vendor_id) && 
-            (midi_devices[i].pid == 0x0000 || midi_devices[i].pid == product_id)) {
-            return true;
+static uint8_t get_midi_cable_count(uint16_t vendor_id, uint16_t product_id)
+{
+    for (size_t i = 0; i < sizeof(supported_midi_devices) / sizeof(supported_midi_devices[0]); i++) {
+        if ((supported_midi_devices[i].vid == vendor_id) && 
+            (supported_midi_devices[i].pid == 0x0000 || supported_midi_devices[i].pid == product_id)) {
+            return supported_midi_devices[i].cables;
         }
     }
 
-    return false;
+    return 0;
 }
 
 static void get_device_name(uint16_t vendor_id, uint16_t product_id, char *name)
@@ -318,96 +517,58 @@ static void get_device_name(uint16_t vendor_id, uint16_t product_id, char *name)
     }
 }
 
-static void midi_note_on_handler(uint8_t channel, uint8_t note, uint8_t velocity)
+static void midi_sysex_handler(midi_dev_t *dev, uint8_t cable, uint8_t *data, uint32_t length, bool last)
 {
-    midi_message_t message = {
-        .status = MIDI_MSG_NOTE_ON | channel,
-        .data = {note, velocity, 0},
-        .length = 3,
-        .timestamp = 0
-    };
-
-    for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
-            midi_vw_inject_message(main_app.devices[i].vw_device_id, &message);
-            break;
-        }
+    usb_midi_device_t *device = find_device_by_midi(dev);
+    if (!device || cable >= device->port_count) {
+        return;
     }
-}
 
-static void midi_note_off_handler(uint8_t channel, uint8_t note, uint8_t velocity)
-{
-    midi_message_t message = {
-        .status = MIDI_MSG_NOTE_OFF | channel,
-        .data = {note, velocity, 0},
-        .length = 3,
-        .timestamp = 0
-    };
+    usb_midi_port_t *port = &device->ports[cable];
+    port->sysex_in_length += length;
+    if (midi_vw_append_sysex(port->vw_device_id, data, length, last, 0) != MIDI_VW_SUCCESS && last) {
+        printf("SysEx dropped: %u bytes\n", (unsigned)port->sysex_in_length);
+    } else if (last) {
+        printf("SysEx received: %u bytes\n", (unsigned)port->sysex_in_length);
+    }
 
-    for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
-            midi_vw_inject_message(main_app.devices[i].vw_device_id, &message);
-            break;
-        }
+    if (last) {
+        port->sysex_in_length = 0;
     }
 }
 
-static void midi_control_change_handler(uint8_t channel, uint8_t controller, uint8_t value)
+static void midi_wakeup_handler(midi_dev_t *dev)
 {
-    midi_message_t message = {
-        .status = MIDI_MSG_CONTROL_CHANGE | channel,
-        .data = {controller, value, 0},
-        .length = 3,
-        .timestamp = 0
-    };
-
-    for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
-            midi_vw_inject_message(main_app.devices[i].vw_device_id, &message);
-            break;
-        }
-    }
+    (void)dev;
+    wakeup_main_loop();
 }
 
-static void midi_program_change_handler(uint8_t channel, uint8_t program)
+// Received events are offered to the router undecoded. Once one is turned
+// down, the rest of its cable in the packet is too, so nothing overtakes it
+// on the way through the decoder; the same goes for the whole packet while
+// decoded messages are still waiting.
+static void midi_thru_handler(midi_dev_t *dev, uint32_t *events, uint16_t count)
 {
-    midi_message_t message = {
-        .status = MIDI_MSG_PROGRAM_CHANGE | channel,
-        .data = {program, 0, 0},
-        .length = 2,
-        .timestamp = 0
-    };
-
-    for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
-            midi_vw_inject_message(main_app.devices[i].vw_device_id, &message);
-            break;
-        }
+    usb_midi_device_t *device = find_device_by_midi(dev);
+    if (!device || midi_has_pending_messages(dev)) {
+        return;
     }
-}
 
-static void midi_pitch_bend_handler(uint8_t channel, uint16_t bend)
-{
-    midi_message_t message = {
-        .status = MIDI_MSG_PITCH_BEND | channel,
-        .data = {bend & 0x7F, (bend >> 7) & 0x7F, 0},
-        .length = 3,
-        .timestamp = 0
-    };
+    uint16_t held = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        uint8_t cable = (events[i] >> 4) & 0x0F;
+        if (events[i] == 0 || cable >= device->port_count || (held & (1u << cable))) {
+            continue;
+        }
 
-    for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
-            midi_vw_inject_message(main_app.devices[i].vw_device_id, &message);
-            break;
+        if (midi_vw_forward_event(device->ports[cable].vw_device_id, events[i]) == MIDI_VW_SUCCESS) {
+            events[i] = 0;
+        } else {
+            held |= 1u << cable;
         }
     }
 }
 
-static void midi_sysex_handler(uint8_t *data, uint16_t length)
-{
-    printf("SysEx received: %d bytes\n", length);
-}
-
 static void vw_device_state_callback(uint8_t device_id, midi_vw_device_state_t state)
 {
     usb_midi_device_t *device = find_device_by_vw_id(device_id);
@@ -451,63 +612,180 @@ static void vw_message_callback(uint8_t device_id, midi_message_t *message)
     }
 }
 
-static bool vw_filter_callback(uint8_t source_device_id, uint8_t dest_device_id, midi_message_t *message)
+// Pass-through connections take the port's events straight into the
+// device's transmit packet, moved onto the port's cable. A port holding
+// SysEx back for the device's stream has its queue to keep in order.
+static bool vw_event_sink(uint8_t device_id, uint32_t event, void *context)
 {
-    (void)source_device_id;
-    (void)dest_device_id;
-    (void)message;
-    return true;
+    midi_dev_t *midi = context;
+    usb_midi_device_t *device = find_device_by_midi(midi);
+    if (!device) {
+        return false;
+    }
+
+    for (uint8_t c = 0; c < device->port_count; c++) {
+        if (device->ports[c].vw_device_id == device_id) {
+            return !device->ports[c].sysex_out_pending &&
+                   midi_send_event(midi, (event & ~0xF0u) | ((uint32_t)c << 4)) == MIDI_SUCCESS;
+        }
+    }
+
+    return false;
+}
+
+static void wakeup_main_loop(void)
+{
+    rtos_event_signal(&main_app.wakeup);
 }
 
 static void process_midi_messages(void)
 {
+    if (main_app.host_link.is_connected) {
+        process_device_messages(&main_app.host_link);
+    }
+
     for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (!main_app.devices[i].is_connected || !main_app.devices[i].is_midi_device) {
-            continue;
+        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
+            process_device_messages(&main_app.devices[i]);
         }
+    }
+}
 
-        while (midi_has_pending_messages()) {
+static void process_device_messages(usb_midi_device_t *device)
+{
+    // Packets queued by the receive interrupt are decoded here, so the
+    // routing task does the parsing and the interrupt stays short. Decoding
+    // pauses while the message queue is too full for another packet.
+    midi_status_t rx_status;
+    do {
+        rx_status = midi_process_rx(device->midi);
+
+        while (midi_has_pending_messages(device->midi)) {
             midi_message_t message;
-            if (midi_receive_message(&message) == MIDI_SUCCESS) {
-                midi_vw_inject_message(main_app.devices[i].vw_device_id, &message);
+            if (midi_receive_message(device->midi, &message) == MIDI_SUCCESS &&
+                message.cable < device->port_count) {
+                midi_vw_inject_message(device->ports[message.cable].vw_device_id, &message);
             }
         }
+    } while (rx_status == MIDI_ERROR_BUFFER_FULL);
 
-        while (midi_vw_has_pending_messages(main_app.devices[i].vw_device_id)) {
+    for (uint8_t c = 0; c < device->port_count; c++) {
+        usb_midi_port_t *port = &device->ports[c];
+
+        // A port with SysEx outstanding holds back the rest of its queue;
+        // the other ports keep flowing into the same packets
+        if (service_sysex_out(device, c)) {
+            continue;
+        }
+
+        while (midi_vw_has_pending_messages(port->vw_device_id)) {
             midi_message_t message;
-            if (midi_vw_receive_message(main_app.devices[i].vw_device_id, &message) == MIDI_VW_SUCCESS) {
-                midi_send_message(&message);
+            if (midi_vw_receive_message(port->vw_device_id, &message) != MIDI_VW_SUCCESS) {
+                continue;
+            }
+
+            if (message.status == MIDI_MSG_SYSTEM_EXCLUSIVE) {
+                port->sysex_out = message;
+                port->sysex_out_pending = true;
+                if (service_sysex_out(device, c)) {
+                    break;
+                }
+                continue;
             }
+
+            message.cable = c;
+            midi_send_message(device->midi, &message);
         }
     }
 }
 
-static void print_status(void)
+static void process_midi_tx(void)
 {
-    static uint32_t last_print = 0;
-    uint32_t current_time = main_app.loop_counter / 100;
-    
-    if (current_time - last_print < 30) {
-        return;
+    if (main_app.host_link.is_connected) {
+        midi_process_tx(main_app.host_link.midi);
     }
-    last_print = current_time;
 
+    for (uint8_t i = 0; i < main_app.device_count; i++) {
+        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
+            midi_process_tx(main_app.devices[i].midi);
+        }
+    }
+}
+
+static uint64_t get_midi_tx_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+
+    if (main_app.host_link.is_connected) {
+        deadline = midi_get_tx_deadline(main_app.host_link.midi);
+    }
+
+    for (uint8_t i = 0; i < main_app.device_count; i++) {
+        if (main_app.devices[i].is_connected && main_app.devices[i].is_midi_device) {
+            uint64_t tx_deadline = midi_get_tx_deadline(main_app.devices[i].midi);
+            if (tx_deadline < deadline) {
+                deadline = tx_deadline;
+            }
+        }
+    }
+
+    return deadline;
+}
+
+// Starts a port's held SysEx once the device's stream is free and releases
+// its payload once the stream has drained. Returns true while the port has
+// to wait.
+static bool service_sysex_out(usb_midi_device_t *device, uint8_t cable)
+{
+    usb_midi_port_t *port = &device->ports[cable];
+    if (!port->sysex_out_pending) {
+        return false;
+    }
+
+    if (device->sysex_out_cable == cable) {
+        if (midi_is_sending_sysex(device->midi)) {
+            return true;
+        }
+        device->sysex_out_cable = NO_CABLE;
+    } else if (device->sysex_out_cable != NO_CABLE) {
+        return true;
+    } else {
+        const uint8_t *data;
+        uint32_t length;
+        if (midi_vw_get_sysex(&port->sysex_out, &data, &length) == MIDI_VW_SUCCESS && length > 0 &&
+            midi_send_sysex_buffer(device->midi, cable, data, length) == MIDI_SUCCESS) {
+            device->sysex_out_cable = cable;
+            return true;
+        }
+    }
+
+    midi_vw_release_sysex(&port->sysex_out);
+    port->sysex_out_pending = false;
+    return false;
+}
+
+static void release_sysex_out(usb_midi_device_t *device)
+{
+    for (uint8_t c = 0; c < device->port_count; c++) {
+        if (device->ports[c].sysex_out_pending) {
+            midi_vw_release_sysex(&device->ports[c].sysex_out);
+            device->ports[c].sysex_out_pending = false;
+        }
+    }
+    device->sysex_out_cable = NO_CABLE;
+}
+
+static void print_status(void)
+{
     printf("\n=== MIDI Virtual Wire Hub Status ===\n");
     printf("Connected devices: %d\n", main_app.device_count);
     
+    if (main_app.host_link.is_connected) {
+        print_device_status(&main_app.host_link);
+    }
+
     for (uint8_t i = 0; i < main_app.device_count; i++) {
-        usb_midi_device_t *device = &main_app.devices[i];
-        printf("  %s %s (VID:0x%04X PID:0x%04X)", 
-               device->is_midi_device ? "🎵" : "📱", 
-               device->device_name, device->vendor_id, device->product_id);
-        
-        if (device->is_midi_device) {
-            midi_vw_device_t vw_info;
-            if (midi_vw_get_device_info(device->vw_device_id, &vw_info) == MIDI_VW_SUCCESS) {
-                printf(" - RX:%u TX:%u", vw_info.messages_received, vw_info.messages_sent);
-            }
-        }
-        printf("\n");
+        print_device_status(&main_app.devices[i]);
     }
     
     uint32_t total_messages, total_errors, total_filtered;
@@ -516,12 +794,74 @@ static void print_status(void)
                total_messages, total_errors, total_filtered);
     }
     
+    uint32_t arena_free, arena_exhausted;
+    if (midi_vw_get_sysex_statistics(&arena_free, &arena_exhausted) == MIDI_VW_SUCCESS) {
+        printf("SysEx arena: Free blocks:%u Exhausted:%u\n", arena_free, arena_exhausted);
+    }
+
     uint8_t connection_count = midi_vw_get_connection_count();
     printf("Active connections: %d\n", connection_count);
+
+    for (uint8_t i = 0; i < midi_vw_get_worker_count(); i++) {
+        midi_vw_worker_stats_t worker_stats;
+        if (midi_vw_get_worker_statistics(i, &worker_stats) == MIDI_VW_SUCCESS) {
+            printf("Router worker %d: Messages:%u Stolen:%u Utilisation:%u.%u%%\n", i,
+                   worker_stats.messages_processed, worker_stats.sources_stolen,
+                   worker_stats.utilisation_permille / 10, worker_stats.utilisation_permille % 10);
+        }
+    }
     
     printf("===================================\n\n");
 }
 
+static void print_device_status(usb_midi_device_t *device)
+{
+    printf("  %s %s (VID:0x%04X PID:0x%04X)", 
+           device->is_midi_device ? "🎵" : "📱", 
+           device->device_name, device->vendor_id, device->product_id);
+    
+    if (device->is_midi_device) {
+        for (uint8_t c = 0; c < device->port_count; c++) {
+            if (device->port_count > 1) {
+                printf("\n    Port %d", c + 1);
+            }
+
+            midi_vw_device_t vw_info;
+            if (midi_vw_get_device_info(device->ports[c].vw_device_id, &vw_info) == MIDI_VW_SUCCESS) {
+                printf(" - RX:%u TX:%u", vw_info.messages_received, vw_info.messages_sent);
+            }
+
+            midi_histogram_summary_t latency;
+            if (midi_vw_get_port_latency(device->ports[c].vw_device_id, &latency) == MIDI_VW_SUCCESS &&
+                latency.count > 0) {
+                printf(" Latency(us) p50:%llu p99:%llu p999:%llu max:%llu",
+                       (unsigned long long)(latency.p50 / 1000), (unsigned long long)(latency.p99 / 1000),
+                       (unsigned long long)(latency.p999 / 1000), (unsigned long long)(latency.max / 1000));
+            }
+
+            midi_histogram_summary_t wait;
+            if (midi_vw_get_port_wait(device->ports[c].vw_device_id, &wait) == MIDI_VW_SUCCESS &&
+                wait.count > 0) {
+                printf(" Wait(us) p99:%llu max:%llu",
+                       (unsigned long long)(wait.p99 / 1000), (unsigned long long)(wait.max / 1000));
+            }
+        }
+
+        midi_tx_stats_t tx_stats;
+        if (midi_get_tx_stats(device->midi, &tx_stats) == MIDI_SUCCESS) {
+            printf(" USB TX Queued:%u HighWater:%u Drops:%u",
+                   tx_stats.queued, tx_stats.high_water, tx_stats.drops);
+        }
+
+        midi_rx_stats_t rx_stats;
+        if (midi_get_rx_stats(device->midi, &rx_stats) == MIDI_SUCCESS) {
+            printf(" USB RX Pending:%u HighWater:%u Overruns:%u Drops:%u",
+                   rx_stats.pending, rx_stats.high_water, rx_stats.overruns, rx_stats.drops);
+        }
+    }
+    printf("\n");
+}
+
 static usb_midi_device_t* find_device_by_usb_id(uint8_t usb_device_id)
 {
     for (uint8_t i = 0; i < main_app.device_count; i++) {
@@ -535,10 +875,29 @@ static usb_midi_device_t* find_device_by_usb_id(uint8_t usb_device_id)
 static usb_midi_device_t* find_device_by_vw_id(uint8_t vw_device_id)
 {
     for (uint8_t i = 0; i < main_app.device_count; i++) {
-        if (main_app.devices[i].is_midi_device && 
-            main_app.devices[i].vw_device_id == vw_device_id) {
+        if (!main_app.devices[i].is_midi_device) {
+            continue;
+        }
+        for (uint8_t c = 0; c < main_app.devices[i].port_count; c++) {
+            if (main_app.devices[i].ports[c].vw_device_id == vw_device_id) {
+                return &main_app.devices[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+static usb_midi_device_t* find_device_by_midi(midi_dev_t *midi)
+{
+    if (main_app.host_link.is_connected && main_app.host_link.midi == midi) {
+        return &main_app.host_link;
+    }
+
+    for (uint8_t i = 0; i < main_app.device_count; i++) {
+        if (main_app.devices[i].is_midi_device &&
+            main_app.devices[i].midi == midi) {
             return &main_app.devices[i];
         }
     }
     return NULL;
-}
\ No newline at end of file
+}
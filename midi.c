@@ -1,128 +1,338 @@
 #include "midi.h"
 #include "usb.h"
+#include "midi_ring.h"
+#include "midi_time.h"
 #include <string.h>
 #include <stddef.h>
+#include <sched.h>
+
+#if defined(__SSE2__) && !defined(MIDI_DECODE_NO_SIMD)
+#include <emmintrin.h>
+#define MIDI_DECODE_SIMD 1
+#else
+#define MIDI_DECODE_SIMD 0
+#endif
 
 extern usb_device_descriptor_t midi_device_descriptor;
 extern usb_config_descriptor_t *midi_config_descriptor;
 extern char* midi_string_descriptors[];
+uint16_t midi_build_config_descriptor(uint8_t cable_count, uint8_t endpoint_out, uint8_t endpoint_in,
+                                      uint16_t max_packet_size);
 #define MIDI_NUM_STRING_DESCRIPTORS 3
 
 #define MIDI_ENDPOINT_OUT 0x01
-#define MIDI_ENDPOINT_IN 0x81
+#define MIDI_ENDPOINT_IN 0x82
+#define MIDI_EVENT_SIZE 4
+#define MIDI_SYSEX_STAGE_SIZE 48
+
+// Received messages waiting for midi_receive_message: every event of a
+// full receive queue of the largest packets fits
+#define MIDI_RX_BUFFER_SIZE \
+    MIDI_RING_ROUND_UP_POW2(USB_MAX_PACKET_SIZE / MIDI_EVENT_SIZE * MIDI_RX_QUEUE_DEPTH)
 
 typedef struct {
-    midi_message_t messages[MIDI_BUFFER_SIZE];
-    uint16_t head;
-    uint16_t tail;
-    uint16_t count;
+    midi_ring_t ring;
+    midi_message_t messages[MIDI_RX_BUFFER_SIZE];
 } midi_buffer_t;
 
-static struct {
-    bool initialized;
+typedef char midi_rx_queue_depth_check[MIDI_RING_IS_POWER_OF_TWO(MIDI_RX_QUEUE_DEPTH) &&
+                                       MIDI_RX_QUEUE_DEPTH <= USB_RX_POOL_MAX_BUFFERS ? 1 : -1];
+
+// Received events are classified by Code Index Number alone. CIN 0x5 is
+// SysEx when it ends one and a single-byte system common message otherwise.
+enum {
+    MIDI_CIN_RESERVED = 0,
+    MIDI_CIN_MESSAGE,
+    MIDI_CIN_SYSEX,
+    MIDI_CIN_SYSEX_OR_COMMON
+};
+
+static const uint8_t midi_cin_class[16] = {
+    MIDI_CIN_RESERVED, MIDI_CIN_RESERVED, MIDI_CIN_MESSAGE, MIDI_CIN_MESSAGE,
+    MIDI_CIN_SYSEX, MIDI_CIN_SYSEX_OR_COMMON, MIDI_CIN_SYSEX, MIDI_CIN_SYSEX,
+    MIDI_CIN_MESSAGE, MIDI_CIN_MESSAGE, MIDI_CIN_MESSAGE, MIDI_CIN_MESSAGE,
+    MIDI_CIN_MESSAGE, MIDI_CIN_MESSAGE, MIDI_CIN_MESSAGE, MIDI_CIN_MESSAGE
+};
+
+static const uint8_t midi_cin_length[16] = {0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1};
+
+// MIDI bytes of an event word (shifted down past the CIN/cable byte) that
+// a message of each length uses
+static const uint32_t midi_length_mask[4] = {0x000000, 0x0000FF, 0x00FFFF, 0xFFFFFF};
+
+typedef char midi_decode_batch_check[MIDI_DECODE_BATCH >= 16 ? 1 : -1];
+
+// Outgoing events are encoded straight into the pool packet being
+// assembled, taken when the first event arrives, and the packet itself is
+// queued on the IN endpoint without a copy. Full packets are handed to the
+// USB transmit queue right away; a partial
+// one keeps filling while an earlier packet is in flight and goes out on
+// its completion or when the latency bound expires. The completion callback
+// runs in interrupt context and only try-locks; if the sender holds the
+// lock it counts the completion for the sender to service on unlock.
+// packet_size is the bulk packet size for the bus speed, set whenever the
+// endpoints are configured; packet has room for the largest. spares holds
+// packets taken ahead for a message that must not be cut short, used
+// before the pool.
+typedef struct {
+    usb_packet_t *packet;
+    usb_packet_t *spares[USB_TX_QUEUE_DEPTH + 1];
+    uint8_t spare_count;
+    uint16_t packet_size;
+    uint16_t length;
+    uint8_t in_flight;
+    uint64_t first_event_time;
+    uint64_t latency_ns;
+    bool lock;
+    uint8_t completions;
+    uint32_t drops;
+    midi_sysex_source_t sysex_source;
+    void *sysex_context;
+    uint8_t sysex_cable;
+    bool sysex_started;
+    bool sysex_ended;
+    uint16_t sysex_staged_length;
+    uint16_t sysex_staged_pos;
+    uint8_t sysex_staged[MIDI_SYSEX_STAGE_SIZE];
+} midi_tx_assembler_t;
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t length;
+    uint32_t offset;
+} midi_sysex_buffer_source_t;
+
+// SysEx reassembly is kept per cable, since messages on different cables
+// may interleave event by event.
+typedef struct {
+    uint8_t *buffer;
+    uint32_t size;
+    uint32_t length;
+    bool in_sysex;
+    bool overflow;
+    uint8_t storage[256];
+} midi_sysex_rx_t;
+
+// Each open device drives its own pair of bulk endpoints on the shared USB
+// controller: instance i uses OUT MIDI_ENDPOINT_OUT + 2i and IN
+// MIDI_ENDPOINT_IN + 2i, so completions can be routed back by number.
+struct midi_dev {
+    bool in_use;
     bool started;
+    uint8_t endpoint_out;
+    uint8_t endpoint_in;
     midi_callbacks_t callbacks;
     midi_buffer_t rx_buffer;
-    midi_buffer_t tx_buffer;
-    uint8_t usb_rx_buffer[64];
-    uint8_t usb_tx_buffer[64];
-    uint8_t sysex_buffer[256];
-    uint16_t sysex_length;
-    bool in_sysex;
-} midi_device;
+    uint32_t rx_drops;
+    midi_tx_assembler_t tx;
+    midi_sysex_buffer_source_t sysex_tx_buffer;
+    midi_sysex_rx_t sysex_rx[MIDI_MAX_CABLES];
+};
+
+typedef char midi_endpoint_count_check[(MIDI_ENDPOINT_IN & 0x7F) + 2 * (MIDI_MAX_DEVICES - 1) < USB_MAX_ENDPOINTS ? 1 : -1];
+
+static struct {
+    midi_dev_t devices[MIDI_MAX_DEVICES];
+    uint8_t open_count;
+    uint8_t started_count;
+    uint8_t interface_cables;
+} midi_driver;
 
 static void midi_setup_callback(usb_setup_packet_t *setup);
 static void midi_transfer_callback(uint8_t endpoint, usb_status_t status);
 static void midi_state_callback(usb_device_state_t state);
-static void midi_process_usb_packet(uint8_t *data, uint16_t length);
-static void midi_process_midi_event(usb_midi_event_t *event);
+static midi_dev_t *midi_find_device(uint8_t endpoint);
+static void midi_configure_endpoints(midi_dev_t *dev);
+static bool midi_build_descriptor(void);
+static void midi_process_usb_packet(midi_dev_t *dev, uint8_t *data, uint16_t length);
+static void midi_offer_thru(midi_dev_t *dev, uint8_t *data, uint16_t count);
+static uint16_t midi_decode_events(midi_dev_t *dev, const uint8_t *data, uint16_t count,
+                                   uint64_t timestamp, midi_message_t *messages, uint16_t *decoded);
+#if MIDI_DECODE_SIMD
+static bool midi_decode_block_simd(const uint8_t *data, uint64_t timestamp, midi_message_t *messages);
+#endif
+static void midi_decode_word(uint32_t word, uint64_t timestamp, midi_message_t *message);
+static void midi_dispatch_batch(midi_dev_t *dev, midi_message_t *messages, uint16_t count);
+static void midi_process_sysex_event(midi_dev_t *dev, usb_midi_event_t *event);
 static uint8_t midi_get_message_length(uint8_t status);
 static uint8_t midi_get_code_index(uint8_t status);
 static midi_status_t midi_buffer_put(midi_buffer_t *buffer, midi_message_t *message);
 static midi_status_t midi_buffer_get(midi_buffer_t *buffer, midi_message_t *message);
 static bool midi_buffer_is_empty(midi_buffer_t *buffer);
-static bool midi_buffer_is_full(midi_buffer_t *buffer);
+static void midi_tx_lock(midi_dev_t *dev);
+static bool midi_tx_try_lock(midi_dev_t *dev);
+static void midi_tx_unlock(midi_dev_t *dev);
+static bool midi_tx_reserve_locked(midi_dev_t *dev);
+static bool midi_tx_take_spares_locked(midi_dev_t *dev, uint32_t count);
+static void midi_tx_return_spares_locked(midi_dev_t *dev);
+static midi_status_t midi_tx_append_locked(midi_dev_t *dev, uint32_t word);
+static midi_status_t midi_tx_kick_locked(midi_dev_t *dev, bool force, uint64_t now);
+static void midi_tx_put_word(uint8_t *packet, uint32_t word);
+static void midi_tx_pump_sysex_locked(midi_dev_t *dev, uint64_t now);
+static uint32_t midi_sysex_buffer_source(uint8_t *buffer, uint32_t max_length, void *context);
 
 void usb_handle_standard_setup(usb_setup_packet_t *setup);
 
-midi_status_t midi_init(midi_callbacks_t *callbacks)
+midi_status_t midi_init(midi_callbacks_t *callbacks, midi_dev_t **dev)
 {
-    if (midi_device.initialized) {
-        return MIDI_ERROR_NOT_INITIALIZED;
+    if (!dev) {
+        return MIDI_ERROR_INVALID_PARAM;
     }
 
-    memset(&midi_device, 0, sizeof(midi_device));
-    
-    if (callbacks) {
-        midi_device.callbacks = *callbacks;
+    uint8_t index = 0;
+    while (index < MIDI_MAX_DEVICES && midi_driver.devices[index].in_use) {
+        index++;
     }
 
-    usb_config_t usb_config = {
-        .device_descriptor = &midi_device_descriptor,
-        .config_descriptor = midi_config_descriptor,
-        .string_descriptors = midi_string_descriptors,
-        .num_string_descriptors = MIDI_NUM_STRING_DESCRIPTORS,
-        .setup_callback = midi_setup_callback,
-        .transfer_callback = midi_transfer_callback,
-        .state_callback = midi_state_callback
-    };
+    if (index == MIDI_MAX_DEVICES) {
+        return MIDI_ERROR_BUFFER_FULL;
+    }
 
-    usb_status_t status = usb_init(&usb_config);
-    if (status != USB_SUCCESS) {
-        return MIDI_ERROR_USB_ERROR;
+    // The USB controller is shared and brought up with the first device
+    if (midi_driver.open_count == 0) {
+        midi_time_init();
+
+        if (!midi_build_descriptor()) {
+            return MIDI_ERROR_INVALID_PARAM;
+        }
+
+        // usb_init keeps the pointer, so the config must outlive this call
+        static usb_config_t usb_config = {
+            .device_descriptor = &midi_device_descriptor,
+            .string_descriptors = midi_string_descriptors,
+            .num_string_descriptors = MIDI_NUM_STRING_DESCRIPTORS,
+            .setup_callback = midi_setup_callback,
+            .transfer_callback = midi_transfer_callback,
+            .state_callback = midi_state_callback
+        };
+        usb_config.config_descriptor = midi_config_descriptor;
+
+        usb_status_t status = usb_init(&usb_config);
+        if (status != USB_SUCCESS) {
+            return MIDI_ERROR_USB_ERROR;
+        }
+
+        usb_endpoint_configure(0, USB_ENDPOINT_TYPE_CONTROL, USB_DIRECTION_IN, USB_FS_MAX_PACKET_SIZE);
+        usb_endpoint_enable(0);
+    }
+
+    midi_dev_t *device = &midi_driver.devices[index];
+    memset(device, 0, sizeof(*device));
+
+    if (callbacks) {
+        device->callbacks = *callbacks;
+    }
+
+    device->endpoint_out = MIDI_ENDPOINT_OUT + 2 * index;
+    device->endpoint_in = (MIDI_ENDPOINT_IN & 0x7F) + 2 * index;
+    midi_ring_init(&device->rx_buffer.ring, MIDI_RX_BUFFER_SIZE);
+    device->tx.latency_ns = (uint64_t)MIDI_TX_LATENCY_US * 1000;
+    device->tx.packet_size = usb_get_max_packet_size(USB_ENDPOINT_TYPE_BULK);
+    for (uint8_t cable = 0; cable < MIDI_MAX_CABLES; cable++) {
+        device->sysex_rx[cable].buffer = device->sysex_rx[cable].storage;
+        device->sysex_rx[cable].size = sizeof(device->sysex_rx[cable].storage);
     }
 
-    usb_endpoint_configure(0, USB_ENDPOINT_TYPE_CONTROL, USB_DIRECTION_IN, 64);
-    usb_endpoint_enable(0);
+    device->in_use = true;
+    midi_driver.open_count++;
 
-    midi_device.initialized = true;
+    *dev = device;
     return MIDI_SUCCESS;
 }
 
-midi_status_t midi_deinit(void)
+midi_status_t midi_deinit(midi_dev_t *dev)
 {
-    if (!midi_device.initialized) {
+    if (!dev || !dev->in_use) {
         return MIDI_ERROR_NOT_INITIALIZED;
     }
 
-    midi_stop();
-    usb_deinit();
-    
-    memset(&midi_device, 0, sizeof(midi_device));
+    midi_stop(dev);
+
+    memset(dev, 0, sizeof(*dev));
+    midi_driver.open_count--;
+
+    if (midi_driver.open_count == 0) {
+        usb_deinit();
+    }
+
     return MIDI_SUCCESS;
 }
 
-midi_status_t midi_start(void)
+midi_status_t midi_set_interface_cables(uint8_t cable_count)
 {
-    if (!midi_device.initialized) {
+    if (cable_count == 0 || cable_count > MIDI_MAX_CABLES) {
+        return MIDI_ERROR_INVALID_PARAM;
+    }
+
+    if (midi_driver.open_count > 0) {
+        return MIDI_ERROR_BUSY;
+    }
+
+    midi_driver.interface_cables = cable_count;
+    return MIDI_SUCCESS;
+}
+
+midi_status_t midi_start(midi_dev_t *dev)
+{
+    if (!dev || !dev->in_use) {
         return MIDI_ERROR_NOT_INITIALIZED;
     }
 
-    if (midi_device.started) {
+    if (dev->started) {
         return MIDI_SUCCESS;
     }
 
-    usb_status_t status = usb_start();
-    if (status != USB_SUCCESS) {
-        return MIDI_ERROR_USB_ERROR;
+    if (midi_driver.started_count == 0) {
+        usb_status_t status = usb_start();
+        if (status != USB_SUCCESS) {
+            return MIDI_ERROR_USB_ERROR;
+        }
+    }
+
+    dev->started = true;
+    midi_driver.started_count++;
+
+    // A device opened after enumeration brings its endpoints up now
+    if (usb_get_state() == USB_DEVICE_STATE_CONFIGURED) {
+        midi_configure_endpoints(dev);
     }
 
-    midi_device.started = true;
     return MIDI_SUCCESS;
 }
 
-midi_status_t midi_stop(void)
+midi_status_t midi_stop(midi_dev_t *dev)
 {
-    if (!midi_device.initialized) {
+    if (!dev || !dev->in_use) {
         return MIDI_ERROR_NOT_INITIALIZED;
     }
 
-    usb_stop();
-    midi_device.started = false;
+    if (!dev->started) {
+        return MIDI_SUCCESS;
+    }
+
+    dev->started = false;
+    midi_driver.started_count--;
+
+    if (midi_driver.started_count == 0) {
+        usb_stop();
+    } else {
+        usb_endpoint_disable(dev->endpoint_out);
+        usb_endpoint_disable(dev->endpoint_in);
+    }
+
+    midi_tx_lock(dev);
+    usb_packet_unref(dev->tx.packet);
+    dev->tx.packet = NULL;
+    dev->tx.length = 0;
+    dev->tx.in_flight = 0;
+    dev->tx.completions = 0;
+    dev->tx.sysex_source = NULL;
+    midi_tx_unlock(dev);
+
     return MIDI_SUCCESS;
 }
 
-midi_status_t midi_send_note_on(uint8_t channel, uint8_t note, uint8_t velocity)
+midi_status_t midi_send_note_on(midi_dev_t *dev, uint8_t channel, uint8_t note, uint8_t velocity)
 {
     midi_message_t message = {
         .status = MIDI_MSG_NOTE_ON | (channel & 0x0F),
@@ -131,10 +341,10 @@ midi_status_t midi_send_note_on(uint8_t channel, uint8_t note, uint8_t velocity)
         .timestamp = 0
     };
     
-    return midi_send_message(&message);
+    return midi_send_message(dev, &message);
 }
 
-midi_status_t midi_send_note_off(uint8_t channel, uint8_t note, uint8_t velocity)
+midi_status_t midi_send_note_off(midi_dev_t *dev, uint8_t channel, uint8_t note, uint8_t velocity)
 {
     midi_message_t message = {
         .status = MIDI_MSG_NOTE_OFF | (channel & 0x0F),
@@ -143,10 +353,10 @@ midi_status_t midi_send_note_off(uint8_t channel, uint8_t note, uint8_t velocity
         .timestamp = 0
     };
     
-    return midi_send_message(&message);
+    return midi_send_message(dev, &message);
 }
 
-midi_status_t midi_send_control_change(uint8_t channel, uint8_t controller, uint8_t value)
+midi_status_t midi_send_control_change(midi_dev_t *dev, uint8_t channel, uint8_t controller, uint8_t value)
 {
     midi_message_t message = {
         .status = MIDI_MSG_CONTROL_CHANGE | (channel & 0x0F),
@@ -155,10 +365,10 @@ midi_status_t midi_send_control_change(uint8_t channel, uint8_t controller, uint
         .timestamp = 0
     };
     
-    return midi_send_message(&message);
+    return midi_send_message(dev, &message);
 }
 
-midi_status_t midi_send_program_change(uint8_t channel, uint8_t program)
+midi_status_t midi_send_program_change(midi_dev_t *dev, uint8_t channel, uint8_t program)
 {
     midi_message_t message = {
         .status = MIDI_MSG_PROGRAM_CHANGE | (channel & 0x0F),
@@ -167,10 +377,10 @@ midi_status_t midi_send_program_change(uint8_t channel, uint8_t program)
         .timestamp = 0
     };
     
-    return midi_send_message(&message);
+    return midi_send_message(dev, &message);
 }
 
-midi_status_t midi_send_pitch_bend(uint8_t channel, uint16_t bend)
+midi_status_t midi_send_pitch_bend(midi_dev_t *dev, uint8_t channel, uint16_t bend)
 {
     midi_message_t message = {
         .status = MIDI_MSG_PITCH_BEND | (channel & 0x0F),
@@ -179,110 +389,358 @@ midi_status_t midi_send_pitch_bend(uint8_t channel, uint16_t bend)
         .timestamp = 0
     };
     
-    return midi_send_message(&message);
+    return midi_send_message(dev, &message);
 }
 
-midi_status_t midi_send_sysex(uint8_t *data, uint16_t length)
+midi_status_t midi_send_sysex(midi_dev_t *dev, uint8_t *data, uint16_t length)
 {
     if (!data || length == 0) {
         return MIDI_ERROR_INVALID_PARAM;
     }
 
-    usb_midi_event_t events[64];
-    uint16_t event_count = 0;
-    uint16_t data_index = 0;
+    if (!dev || !dev->in_use || !dev->started) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
 
-    events[event_count].cable_number = 0;
-    events[event_count].code_index = 0x04;
-    events[event_count].midi_data[0] = MIDI_MSG_SYSTEM_EXCLUSIVE;
-    
-    if (length == 1) {
-        events[event_count].midi_data[1] = data[0];
-        events[event_count].midi_data[2] = MIDI_MSG_END_SYSEX;
-        event_count++;
+    // The stream is F0, data, F7 split into 3-byte events; the last event's
+    // code index (0x5-0x7) says how many of its bytes are used.
+    uint32_t total = (uint32_t)length + 2;
+    uint32_t event_count = (total + 2) / 3;
+    midi_status_t result = MIDI_SUCCESS;
+
+    midi_tx_lock(dev);
+
+    midi_tx_assembler_t *tx = &dev->tx;
+    if (tx->sysex_source && tx->sysex_cable == 0) {
+        midi_tx_unlock(dev);
+        return MIDI_ERROR_BUSY;
+    }
+
+    uint32_t bytes = event_count * MIDI_EVENT_SIZE;
+    uint32_t space = tx->packet_size - tx->length +
+                     (uint32_t)(USB_TX_QUEUE_DEPTH - tx->in_flight) * tx->packet_size;
+
+    // Every packet the message spills into is taken from the pool first,
+    // so it cannot run dry between F0 and F7
+    uint32_t room = tx->packet ? tx->packet_size - tx->length : 0;
+    uint32_t packets = bytes > room ? (bytes - room + tx->packet_size - 1) / tx->packet_size : 0;
+
+    if (bytes > space || !midi_tx_take_spares_locked(dev, packets)) {
+        tx->drops += event_count;
+        result = MIDI_ERROR_BUFFER_FULL;
     } else {
-        events[event_count].midi_data[1] = data[0];
-        events[event_count].midi_data[2] = data[1];
-        event_count++;
-        data_index = 2;
-
-        while (data_index < length - 1) {
-            events[event_count].cable_number = 0;
-            events[event_count].code_index = 0x04;
-            
-            uint8_t remaining = length - data_index;
-            if (remaining >= 3) {
-                events[event_count].midi_data[0] = data[data_index++];
-                events[event_count].midi_data[1] = data[data_index++];
-                events[event_count].midi_data[2] = data[data_index++];
-            } else if (remaining == 2) {
-                events[event_count].midi_data[0] = data[data_index++];
-                events[event_count].midi_data[1] = data[data_index++];
-                events[event_count].midi_data[2] = MIDI_MSG_END_SYSEX;
-            } else {
-                events[event_count].midi_data[0] = data[data_index++];
-                events[event_count].midi_data[1] = MIDI_MSG_END_SYSEX;
-                events[event_count].midi_data[2] = 0;
+        for (uint32_t e = 0; e < event_count && result == MIDI_SUCCESS; e++) {
+            uint32_t pos = e * 3;
+            uint32_t used = (total - pos < 3) ? total - pos : 3;
+            uint32_t word = (e == event_count - 1) ? 0x04 + used : 0x04;
+
+            for (uint32_t i = 0; i < used; i++) {
+                uint32_t k = pos + i;
+                uint8_t byte = (k == 0) ? MIDI_MSG_SYSTEM_EXCLUSIVE :
+                               (k == total - 1) ? MIDI_MSG_END_SYSEX : data[k - 1];
+                word |= (uint32_t)byte << (8 * (i + 1));
             }
-            event_count++;
+
+            result = midi_tx_append_locked(dev, word);
         }
 
-        if (data_index == length - 1) {
-            events[event_count].cable_number = 0;
-            events[event_count].code_index = 0x05;
-            events[event_count].midi_data[0] = data[data_index];
-            events[event_count].midi_data[1] = MIDI_MSG_END_SYSEX;
-            events[event_count].midi_data[2] = 0;
-            event_count++;
+        midi_tx_return_spares_locked(dev);
+    }
+
+    midi_tx_unlock(dev);
+    return result;
+}
+
+midi_status_t midi_send_message(midi_dev_t *dev, midi_message_t *message)
+{
+    if (!message || message->cable >= MIDI_MAX_CABLES) {
+        return MIDI_ERROR_INVALID_PARAM;
+    }
+
+    return midi_send_event(dev, midi_pack_message(message));
+}
+
+midi_status_t midi_send_event(midi_dev_t *dev, uint32_t event)
+{
+    uint8_t cable = (event >> 4) & 0x0F;
+    uint8_t status = (uint8_t)(event >> 8);
+
+    if (cable >= MIDI_MAX_CABLES) {
+        return MIDI_ERROR_INVALID_PARAM;
+    }
+
+    if (!dev || !dev->in_use || !dev->started) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    midi_tx_lock(dev);
+
+    // Only real-time bytes may appear between the events of a SysEx on the
+    // same cable; other cables share the packets freely
+    midi_status_t result = MIDI_ERROR_BUSY;
+    if (!dev->tx.sysex_source || cable != dev->tx.sysex_cable || status >= MIDI_MSG_TIMING_CLOCK) {
+        result = midi_tx_append_locked(dev, event);
+    }
+
+    midi_tx_unlock(dev);
+
+    return result;
+}
+
+midi_status_t midi_send_sysex_stream(midi_dev_t *dev, uint8_t cable, midi_sysex_source_t source, void *context)
+{
+    if (!source || cable >= MIDI_MAX_CABLES) {
+        return MIDI_ERROR_INVALID_PARAM;
+    }
+
+    if (!dev || !dev->in_use || !dev->started) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    midi_tx_lock(dev);
+
+    midi_tx_assembler_t *tx = &dev->tx;
+    if (tx->sysex_source) {
+        midi_tx_unlock(dev);
+        return MIDI_ERROR_BUSY;
+    }
+
+    tx->sysex_source = source;
+    tx->sysex_context = context;
+    tx->sysex_cable = cable;
+    tx->sysex_started = false;
+    tx->sysex_ended = false;
+    tx->sysex_staged_length = 0;
+    tx->sysex_staged_pos = 0;
+    midi_tx_pump_sysex_locked(dev, midi_time_now_ns());
+
+    midi_tx_unlock(dev);
+    return MIDI_SUCCESS;
+}
+
+midi_status_t midi_send_sysex_buffer(midi_dev_t *dev, uint8_t cable, const uint8_t *data, uint32_t length)
+{
+    if (!data || length == 0) {
+        return MIDI_ERROR_INVALID_PARAM;
+    }
+
+    if (!dev || !dev->in_use) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    if (midi_is_sending_sysex(dev)) {
+        return MIDI_ERROR_BUSY;
+    }
+
+    dev->sysex_tx_buffer.data = data;
+    dev->sysex_tx_buffer.length = length;
+    dev->sysex_tx_buffer.offset = 0;
+
+    return midi_send_sysex_stream(dev, cable, midi_sysex_buffer_source, &dev->sysex_tx_buffer);
+}
+
+bool midi_is_sending_sysex(midi_dev_t *dev)
+{
+    return __atomic_load_n(&dev->tx.sysex_source, __ATOMIC_ACQUIRE) != NULL;
+}
+
+midi_status_t midi_set_sysex_buffer(midi_dev_t *dev, uint8_t cable, uint8_t *buffer, uint32_t size)
+{
+    if ((buffer && size == 0) || cable >= MIDI_MAX_CABLES) {
+        return MIDI_ERROR_INVALID_PARAM;
+    }
+
+    if (!dev || !dev->in_use) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    midi_sysex_rx_t *rx = &dev->sysex_rx[cable];
+    rx->buffer = buffer ? buffer : rx->storage;
+    rx->size = buffer ? size : sizeof(rx->storage);
+    rx->in_sysex = false;
+
+    return MIDI_SUCCESS;
+}
+
+midi_status_t midi_set_tx_latency(midi_dev_t *dev, uint32_t latency_us)
+{
+    if (!dev || !dev->in_use) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    midi_tx_lock(dev);
+    dev->tx.latency_ns = (uint64_t)latency_us * 1000;
+    midi_tx_unlock(dev);
+
+    return MIDI_SUCCESS;
+}
+
+midi_status_t midi_flush(midi_dev_t *dev)
+{
+    if (!dev || !dev->in_use || !dev->started) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    midi_tx_lock(dev);
+    midi_status_t result = midi_tx_kick_locked(dev, true, midi_time_now_ns());
+    midi_tx_unlock(dev);
+
+    return result;
+}
+
+midi_status_t midi_process_rx(midi_dev_t *dev)
+{
+    if (!dev || !dev->in_use) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    // Each packet is decoded where the endpoint wrote it and then goes
+    // back to the pool. One is only taken while the queue has room for all
+    // of its events; the rest stay in the pool, which holds the host off
+    // once it fills, so nothing is lost to a slow reader.
+    uint32_t packet_events = usb_get_max_packet_size(USB_ENDPOINT_TYPE_BULK) / MIDI_EVENT_SIZE;
+    while (MIDI_RX_BUFFER_SIZE - midi_ring_count(&dev->rx_buffer.ring) >= packet_events) {
+        usb_packet_t *packet;
+        if (usb_receive_acquire(dev->endpoint_out, &packet) != USB_SUCCESS) {
+            return MIDI_SUCCESS;
         }
+
+        midi_process_usb_packet(dev, packet->data, packet->length);
+        usb_packet_unref(packet);
+    }
+
+    usb_rx_stats_t usb_stats;
+    if (usb_get_rx_stats(dev->endpoint_out, &usb_stats) == USB_SUCCESS && usb_stats.filled > 0) {
+        return MIDI_ERROR_BUFFER_FULL;
     }
 
-    usb_status_t status = usb_transmit(MIDI_ENDPOINT_IN, (uint8_t*)events, event_count * 4);
-    return (status == USB_SUCCESS) ? MIDI_SUCCESS : MIDI_ERROR_USB_ERROR;
+    return MIDI_SUCCESS;
 }
 
-midi_status_t midi_send_message(midi_message_t *message)
+midi_status_t midi_get_rx_stats(midi_dev_t *dev, midi_rx_stats_t *stats)
 {
-    if (!message) {
+    if (!dev || !dev->in_use) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!stats) {
         return MIDI_ERROR_INVALID_PARAM;
     }
 
-    if (!midi_device.initialized || !midi_device.started) {
+    usb_rx_stats_t usb_stats;
+    if (usb_get_rx_stats(dev->endpoint_out, &usb_stats) != USB_SUCCESS) {
+        return MIDI_ERROR_USB_ERROR;
+    }
+
+    stats->pending = usb_stats.filled;
+    stats->high_water = usb_stats.high_water;
+    stats->overruns = usb_stats.overruns;
+    stats->drops = __atomic_load_n(&dev->rx_drops, __ATOMIC_RELAXED);
+    return MIDI_SUCCESS;
+}
+
+midi_status_t midi_process_tx(midi_dev_t *dev)
+{
+    if (!dev || !dev->in_use || !dev->started) {
         return MIDI_ERROR_NOT_INITIALIZED;
     }
 
-    usb_midi_event_t event;
-    event.cable_number = 0;
-    event.code_index = midi_get_code_index(message->status);
-    event.midi_data[0] = message->status;
-    event.midi_data[1] = (message->length > 1) ? message->data[0] : 0;
-    event.midi_data[2] = (message->length > 2) ? message->data[1] : 0;
+    midi_tx_lock(dev);
+    uint64_t now = midi_time_now_ns();
+    midi_tx_pump_sysex_locked(dev, now);
+    midi_status_t result = midi_tx_kick_locked(dev, false, now);
+    midi_tx_unlock(dev);
+
+    return result;
+}
+
+uint64_t midi_get_tx_deadline(midi_dev_t *dev)
+{
+    if (!dev || !dev->in_use || !dev->started) {
+        return UINT64_MAX;
+    }
+
+    uint64_t deadline = UINT64_MAX;
 
-    usb_status_t status = usb_transmit(MIDI_ENDPOINT_IN, (uint8_t*)&event, 4);
-    return (status == USB_SUCCESS) ? MIDI_SUCCESS : MIDI_ERROR_USB_ERROR;
+    midi_tx_lock(dev);
+    midi_tx_assembler_t *tx = &dev->tx;
+    if (tx->length > 0 && tx->in_flight == 0) {
+        deadline = tx->first_event_time + tx->latency_ns;
+    }
+    midi_tx_unlock(dev);
+
+    return deadline;
 }
 
-midi_status_t midi_receive_message(midi_message_t *message)
+midi_status_t midi_receive_message(midi_dev_t *dev, midi_message_t *message)
 {
     if (!message) {
         return MIDI_ERROR_INVALID_PARAM;
     }
 
-    if (!midi_device.initialized) {
+    if (!dev || !dev->in_use) {
+        return MIDI_ERROR_NOT_INITIALIZED;
+    }
+
+    return midi_buffer_get(&dev->rx_buffer, message);
+}
+
+midi_status_t midi_get_tx_stats(midi_dev_t *dev, midi_tx_stats_t *stats)
+{
+    if (!stats) {
+        return MIDI_ERROR_INVALID_PARAM;
+    }
+
+    if (!dev || !dev->in_use) {
         return MIDI_ERROR_NOT_INITIALIZED;
     }
 
-    return midi_buffer_get(&midi_device.rx_buffer, message);
+    usb_tx_stats_t usb_stats;
+    if (usb_get_tx_stats(dev->endpoint_in, &usb_stats) != USB_SUCCESS) {
+        return MIDI_ERROR_USB_ERROR;
+    }
+
+    stats->queued = usb_stats.queued;
+    stats->high_water = usb_stats.high_water;
+    stats->drops = __atomic_load_n(&dev->tx.drops, __ATOMIC_RELAXED);
+
+    return MIDI_SUCCESS;
+}
+
+bool midi_has_pending_messages(midi_dev_t *dev)
+{
+    return !midi_buffer_is_empty(&dev->rx_buffer);
+}
+
+uint16_t midi_get_pending_count(midi_dev_t *dev)
+{
+    return midi_ring_count(&dev->rx_buffer.ring);
 }
 
-bool midi_has_pending_messages(void)
+uint32_t midi_pack_message(const midi_message_t *message)
 {
-    return !midi_buffer_is_empty(&midi_device.rx_buffer);
+    uint8_t length = midi_get_message_length(message->status);
+    uint32_t word = midi_get_code_index(message->status) | ((uint32_t)(message->cable & 0x0F) << 4) |
+                    ((uint32_t)message->status << 8);
+
+    if (length > 1) {
+        word |= (uint32_t)message->data[0] << 16;
+    }
+    if (length > 2) {
+        word |= (uint32_t)message->data[1] << 24;
+    }
+
+    return word;
 }
 
-uint16_t midi_get_pending_count(void)
+void midi_unpack_message(uint32_t word, midi_message_t *message)
 {
-    return midi_device.rx_buffer.count;
+    message->status = (uint8_t)(word >> 8);
+    message->data[0] = (uint8_t)(word >> 16);
+    message->data[1] = (uint8_t)(word >> 24);
+    message->data[2] = 0;
+    message->length = midi_get_message_length(message->status);
+    message->cable = (uint8_t)(word >> 4) & 0x0F;
 }
 
 static void midi_setup_callback(usb_setup_packet_t *setup)
@@ -296,106 +754,351 @@ static void midi_setup_callback(usb_setup_packet_t *setup)
 
 static void midi_transfer_callback(uint8_t endpoint, usb_status_t status)
 {
-    if (status != USB_SUCCESS) {
+    midi_dev_t *dev = midi_find_device(endpoint);
+    if (!dev) {
+        return;
+    }
+
+    // The IN packet is done with either way; flush what queued up behind it
+    if (endpoint == dev->endpoint_in) {
+        __atomic_fetch_add(&dev->tx.completions, 1, __ATOMIC_RELEASE);
+        if (midi_tx_try_lock(dev)) {
+            midi_tx_unlock(dev);
+        }
         return;
     }
 
-    if (endpoint == MIDI_ENDPOINT_OUT) {
-        usb_receive(MIDI_ENDPOINT_OUT, midi_device.usb_rx_buffer, sizeof(midi_device.usb_rx_buffer));
+    // The USB layer has already armed the next buffer; decoding waits for
+    // midi_process_rx
+    usb_rx_stats_t rx_stats;
+    if (status == USB_SUCCESS && dev->callbacks.rx_ready_callback &&
+        usb_get_rx_stats(endpoint, &rx_stats) == USB_SUCCESS && rx_stats.filled == 1) {
+        dev->callbacks.rx_ready_callback(dev);
     }
 }
 
 static void midi_state_callback(usb_device_state_t state)
 {
+    // The host reads the configuration after the reset that fixed the speed
+    if (state == USB_DEVICE_STATE_DEFAULT) {
+        midi_build_descriptor();
+    }
+
     if (state == USB_DEVICE_STATE_CONFIGURED) {
-        usb_endpoint_configure(MIDI_ENDPOINT_OUT, USB_ENDPOINT_TYPE_BULK, USB_DIRECTION_OUT, 64);
-        usb_endpoint_enable(MIDI_ENDPOINT_OUT);
-        usb_endpoint_configure(MIDI_ENDPOINT_IN & 0x7F, USB_ENDPOINT_TYPE_BULK, USB_DIRECTION_IN, 64);
-        usb_endpoint_enable(MIDI_ENDPOINT_IN & 0x7F);
-        
-        usb_receive(MIDI_ENDPOINT_OUT, midi_device.usb_rx_buffer, sizeof(midi_device.usb_rx_buffer));
+        for (uint8_t i = 0; i < MIDI_MAX_DEVICES; i++) {
+            if (midi_driver.devices[i].in_use && midi_driver.devices[i].started) {
+                midi_configure_endpoints(&midi_driver.devices[i]);
+            }
+        }
     }
 }
 
-static void midi_process_usb_packet(uint8_t *data, uint16_t length)
+static midi_dev_t *midi_find_device(uint8_t endpoint)
 {
-    for (uint16_t i = 0; i < length; i += 4) {
-        usb_midi_event_t *event = (usb_midi_event_t*)(data + i);
-        midi_process_midi_event(event);
+    if (endpoint < MIDI_ENDPOINT_OUT) {
+        return NULL;
     }
+
+    uint8_t index = (endpoint - MIDI_ENDPOINT_OUT) / 2;
+    if (index >= MIDI_MAX_DEVICES) {
+        return NULL;
+    }
+
+    midi_dev_t *dev = &midi_driver.devices[index];
+    return (dev->in_use && dev->started) ? dev : NULL;
 }
 
-static void midi_process_midi_event(usb_midi_event_t *event)
+static void midi_configure_endpoints(midi_dev_t *dev)
 {
-    if (event->code_index == 0 || event->code_index > 15) {
+    uint16_t packet_size = usb_get_max_packet_size(USB_ENDPOINT_TYPE_BULK);
+
+    // This can run in interrupt context, so the assembler is not locked; a
+    // partial packet left larger than a slower bus allows is refused by
+    // usb_transmit and dropped
+    dev->tx.packet_size = packet_size;
+
+    usb_endpoint_configure(dev->endpoint_out, USB_ENDPOINT_TYPE_BULK, USB_DIRECTION_OUT, packet_size);
+    usb_endpoint_enable(dev->endpoint_out);
+    usb_endpoint_configure(dev->endpoint_in, USB_ENDPOINT_TYPE_BULK, USB_DIRECTION_IN, packet_size);
+    usb_endpoint_enable(dev->endpoint_in);
+
+    usb_receive_pool(dev->endpoint_out, MIDI_RX_QUEUE_DEPTH);
+}
+
+static bool midi_build_descriptor(void)
+{
+    uint8_t cables = midi_driver.interface_cables ? midi_driver.interface_cables : 1;
+
+    return midi_build_config_descriptor(cables, MIDI_ENDPOINT_OUT, MIDI_ENDPOINT_IN,
+                                        usb_get_max_packet_size(USB_ENDPOINT_TYPE_BULK)) != 0;
+}
+
+// A packet is decoded in batches of up to MIDI_DECODE_BATCH messages that
+// share one timestamp and one dispatch. Blocks of 16 plain events take the
+// SIMD path when available.
+static void midi_process_usb_packet(midi_dev_t *dev, uint8_t *data, uint16_t length)
+{
+    midi_message_t messages[MIDI_DECODE_BATCH];
+    uint64_t timestamp = midi_time_now_ns();
+    uint16_t count = length / MIDI_EVENT_SIZE;
+    uint16_t i = 0;
+
+    if (dev->callbacks.thru_callback && count > 0) {
+        midi_offer_thru(dev, data, count);
+    }
+
+    while (i < count) {
+        uint16_t decoded = 0;
+
+#if MIDI_DECODE_SIMD
+        if (count - i >= 16 && midi_decode_block_simd(data + i * MIDI_EVENT_SIZE, timestamp, messages)) {
+            i += 16;
+            decoded = 16;
+        } else
+#endif
+        {
+            i += midi_decode_events(dev, data + i * MIDI_EVENT_SIZE, count - i, timestamp, messages, &decoded);
+        }
+
+        midi_dispatch_batch(dev, messages, decoded);
+    }
+}
+
+// Events the thru callback takes are zeroed in the packet, and CIN 0 is
+// skipped by both decoders
+static void midi_offer_thru(midi_dev_t *dev, uint8_t *data, uint16_t count)
+{
+    uint32_t events[USB_MAX_PACKET_SIZE / MIDI_EVENT_SIZE];
+
+    for (uint16_t i = 0; i < count; i++) {
+        const uint8_t *event = data + i * MIDI_EVENT_SIZE;
+        events[i] = (uint32_t)event[0] | ((uint32_t)event[1] << 8) |
+                    ((uint32_t)event[2] << 16) | ((uint32_t)event[3] << 24);
+    }
+
+    dev->callbacks.thru_callback(dev, events, count);
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (events[i] == 0) {
+            memset(data + i * MIDI_EVENT_SIZE, 0, MIDI_EVENT_SIZE);
+        }
+    }
+}
+
+// Decodes events until the batch is full or a SysEx event is reached. A
+// SysEx event is handled after the messages before it are dispatched, so
+// callbacks see events in packet order. Returns the events consumed.
+static uint16_t midi_decode_events(midi_dev_t *dev, const uint8_t *data, uint16_t count,
+                                   uint64_t timestamp, midi_message_t *messages, uint16_t *decoded)
+{
+    uint16_t n = 0;
+    uint16_t i = 0;
+
+    for (; i < count && n < MIDI_DECODE_BATCH; i++, data += MIDI_EVENT_SIZE) {
+        uint32_t word = (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                        ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+        uint8_t cin = word & 0x0F;
+        uint8_t cable = (word >> 4) & 0x0F;
+        uint8_t cin_class = midi_cin_class[cin];
+
+        if (cin_class == MIDI_CIN_RESERVED || cable >= MIDI_MAX_CABLES) {
+            continue;
+        }
+
+        if (cin_class == MIDI_CIN_SYSEX ||
+            (cin_class == MIDI_CIN_SYSEX_OR_COMMON &&
+             (dev->sysex_rx[cable].in_sysex || data[1] == MIDI_MSG_END_SYSEX))) {
+            midi_dispatch_batch(dev, messages, n);
+            n = 0;
+
+            usb_midi_event_t event = {
+                .code_index = cin,
+                .cable_number = cable,
+                .midi_data = {data[1], data[2], data[3]}
+            };
+            midi_process_sysex_event(dev, &event);
+            continue;
+        }
+
+        midi_decode_word(word, timestamp, &messages[n++]);
+    }
+
+    *decoded = n;
+    return i;
+}
+
+#if MIDI_DECODE_SIMD
+// Decodes 16 events at once when all are messages with CIN 0x8-0xF, which
+// covers channel voice and real-time traffic; anything else, or a cable
+// beyond MIDI_MAX_CABLES, leaves the block to the scalar decoder.
+static bool midi_decode_block_simd(const uint8_t *data, uint64_t timestamp, midi_message_t *messages)
+{
+    const __m128i nibble = _mm_set1_epi32(0x0F);
+    uint32_t payloads[16];
+    uint32_t lengths[16];
+    uint32_t cables[16];
+
+    for (int v = 0; v < 4; v++) {
+        __m128i words = _mm_loadu_si128((const __m128i *)(data + v * 16));
+        __m128i cin = _mm_and_si128(words, nibble);
+        __m128i cable = _mm_and_si128(_mm_srli_epi32(words, 4), nibble);
+        __m128i plain = _mm_cmpgt_epi32(cin, _mm_set1_epi32(0x07));
+#if MIDI_MAX_CABLES < 16
+        plain = _mm_and_si128(plain, _mm_cmplt_epi32(cable, _mm_set1_epi32(MIDI_MAX_CABLES)));
+#endif
+        if (_mm_movemask_epi8(plain) != 0xFFFF) {
+            return false;
+        }
+
+        // Lengths are 3, less one for CIN 0xC/0xD and two for CIN 0xF;
+        // the comparisons yield -1 per matching lane
+        __m128i two_bytes = _mm_or_si128(_mm_cmpeq_epi32(cin, _mm_set1_epi32(0x0C)),
+                                         _mm_cmpeq_epi32(cin, _mm_set1_epi32(0x0D)));
+        __m128i one_byte = _mm_cmpeq_epi32(cin, _mm_set1_epi32(0x0F));
+        __m128i length = _mm_add_epi32(_mm_set1_epi32(3),
+                                       _mm_add_epi32(two_bytes, _mm_add_epi32(one_byte, one_byte)));
+
+        __m128i mask = _mm_andnot_si128(_mm_and_si128(two_bytes, _mm_set1_epi32(0xFF0000)),
+                                        _mm_set1_epi32(0xFFFFFF));
+        mask = _mm_andnot_si128(_mm_and_si128(one_byte, _mm_set1_epi32(0xFFFF00)), mask);
+
+        _mm_storeu_si128((__m128i *)&payloads[v * 4], _mm_and_si128(_mm_srli_epi32(words, 8), mask));
+        _mm_storeu_si128((__m128i *)&lengths[v * 4], length);
+        _mm_storeu_si128((__m128i *)&cables[v * 4], cable);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        messages[i].status = (uint8_t)payloads[i];
+        messages[i].data[0] = (uint8_t)(payloads[i] >> 8);
+        messages[i].data[1] = (uint8_t)(payloads[i] >> 16);
+        messages[i].data[2] = 0;
+        messages[i].length = (uint8_t)lengths[i];
+        messages[i].cable = (uint8_t)cables[i];
+        messages[i].timestamp = timestamp;
+    }
+
+    return true;
+}
+#endif
+
+static void midi_decode_word(uint32_t word, uint64_t timestamp, midi_message_t *message)
+{
+    uint8_t length = midi_cin_length[word & 0x0F];
+    uint32_t payload = (word >> 8) & midi_length_mask[length];
+
+    message->status = (uint8_t)payload;
+    message->data[0] = (uint8_t)(payload >> 8);
+    message->data[1] = (uint8_t)(payload >> 16);
+    message->data[2] = 0;
+    message->length = length;
+    message->cable = (word >> 4) & 0x0F;
+    message->timestamp = timestamp;
+}
+
+static void midi_dispatch_batch(midi_dev_t *dev, midi_message_t *messages, uint16_t count)
+{
+    if (count == 0) {
         return;
     }
 
-    uint8_t status = event->midi_data[0];
-    uint8_t channel = status & 0x0F;
-    uint8_t message_type = status & 0xF0;
+    bool was_empty = midi_buffer_is_empty(&dev->rx_buffer);
+    uint16_t queued = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        queued += midi_buffer_put(&dev->rx_buffer, &messages[i]) == MIDI_SUCCESS;
+    }
 
-    midi_message_t message = {
-        .status = status,
-        .length = midi_get_message_length(status),
-        .timestamp = 0
-    };
+    if (queued < count) {
+        __atomic_fetch_add(&dev->rx_drops, count - queued, __ATOMIC_RELAXED);
+    }
+
+    if (was_empty && queued && dev->callbacks.rx_ready_callback) {
+        dev->callbacks.rx_ready_callback(dev);
+    }
 
-    if (message.length > 1) message.data[0] = event->midi_data[1];
-    if (message.length > 2) message.data[1] = event->midi_data[2];
+    if (dev->callbacks.batch_callback) {
+        dev->callbacks.batch_callback(dev, messages, count);
+        return;
+    }
 
-    midi_buffer_put(&midi_device.rx_buffer, &message);
+    for (uint16_t i = 0; i < count; i++) {
+        midi_message_t *message = &messages[i];
+        uint8_t channel = message->status & 0x0F;
 
-    switch (message_type) {
-        case MIDI_MSG_NOTE_ON:
-            if (midi_device.callbacks.note_on_callback) {
-                midi_device.callbacks.note_on_callback(channel, event->midi_data[1], event->midi_data[2]);
-            }
-            break;
-            
-        case MIDI_MSG_NOTE_OFF:
-            if (midi_device.callbacks.note_off_callback) {
-                midi_device.callbacks.note_off_callback(channel, event->midi_data[1], event->midi_data[2]);
-            }
-            break;
-            
-        case MIDI_MSG_CONTROL_CHANGE:
-            if (midi_device.callbacks.control_change_callback) {
-                midi_device.callbacks.control_change_callback(channel, event->midi_data[1], event->midi_data[2]);
-            }
-            break;
-            
-        case MIDI_MSG_PROGRAM_CHANGE:
-            if (midi_device.callbacks.program_change_callback) {
-                midi_device.callbacks.program_change_callback(channel, event->midi_data[1]);
-            }
-            break;
-            
-        case MIDI_MSG_PITCH_BEND:
-            if (midi_device.callbacks.pitch_bend_callback) {
-                uint16_t bend = event->midi_data[1] | (event->midi_data[2] << 7);
-                midi_device.callbacks.pitch_bend_callback(channel, bend);
-            }
-            break;
-            
-        case MIDI_MSG_SYSTEM_EXCLUSIVE:
-            if (!midi_device.in_sysex) {
-                midi_device.in_sysex = true;
-                midi_device.sysex_length = 0;
-            }
-            
-            for (int i = 0; i < 3; i++) {
-                if (event->midi_data[i] == MIDI_MSG_END_SYSEX) {
-                    midi_device.in_sysex = false;
-                    if (midi_device.callbacks.sysex_callback) {
-                        midi_device.callbacks.sysex_callback(midi_device.sysex_buffer, midi_device.sysex_length);
-                    }
-                    break;
-                } else if (midi_device.sysex_length < sizeof(midi_device.sysex_buffer)) {
-                    midi_device.sysex_buffer[midi_device.sysex_length++] = event->midi_data[i];
+        switch (message->status & 0xF0) {
+            case MIDI_MSG_NOTE_ON:
+                if (dev->callbacks.note_on_callback) {
+                    dev->callbacks.note_on_callback(dev, message->cable, channel, message->data[0], message->data[1]);
+                }
+                break;
+
+            case MIDI_MSG_NOTE_OFF:
+                if (dev->callbacks.note_off_callback) {
+                    dev->callbacks.note_off_callback(dev, message->cable, channel, message->data[0], message->data[1]);
                 }
+                break;
+
+            case MIDI_MSG_CONTROL_CHANGE:
+                if (dev->callbacks.control_change_callback) {
+                    dev->callbacks.control_change_callback(dev, message->cable, channel, message->data[0], message->data[1]);
+                }
+                break;
+
+            case MIDI_MSG_PROGRAM_CHANGE:
+                if (dev->callbacks.program_change_callback) {
+                    dev->callbacks.program_change_callback(dev, message->cable, channel, message->data[0]);
+                }
+                break;
+
+            case MIDI_MSG_PITCH_BEND:
+                if (dev->callbacks.pitch_bend_callback) {
+                    uint16_t bend = message->data[0] | (message->data[1] << 7);
+                    dev->callbacks.pitch_bend_callback(dev, message->cable, channel, bend);
+                }
+                break;
+        }
+    }
+}
+
+static void midi_process_sysex_event(midi_dev_t *dev, usb_midi_event_t *event)
+{
+    uint8_t cable = event->cable_number;
+    midi_sysex_rx_t *rx = &dev->sysex_rx[cable];
+    uint8_t count = (event->code_index == 0x04) ? 3 : event->code_index - 0x04;
+
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t byte = event->midi_data[i];
+
+        if (byte == MIDI_MSG_SYSTEM_EXCLUSIVE) {
+            rx->in_sysex = true;
+            rx->overflow = false;
+            rx->length = 0;
+            continue;
+        }
+
+        if (!rx->in_sysex) {
+            continue;
+        }
+
+        if (byte == MIDI_MSG_END_SYSEX) {
+            rx->in_sysex = false;
+            if (dev->callbacks.sysex_chunk_callback) {
+                dev->callbacks.sysex_chunk_callback(dev, cable, rx->buffer, rx->length, true);
+            } else if (!rx->overflow && rx->length <= UINT16_MAX && dev->callbacks.sysex_callback) {
+                dev->callbacks.sysex_callback(dev, cable, rx->buffer, (uint16_t)rx->length);
+            }
+            continue;
+        }
+
+        if (rx->length == rx->size) {
+            if (!dev->callbacks.sysex_chunk_callback) {
+                rx->overflow = true;
+                continue;
             }
-            break;
+            dev->callbacks.sysex_chunk_callback(dev, cable, rx->buffer, rx->length, false);
+            rx->length = 0;
+        }
+
+        rx->buffer[rx->length++] = byte;
     }
 }
 
@@ -453,36 +1156,241 @@ static uint8_t midi_get_code_index(uint8_t status)
 
 static midi_status_t midi_buffer_put(midi_buffer_t *buffer, midi_message_t *message)
 {
-    if (midi_buffer_is_full(buffer)) {
+    uint32_t index;
+    if (!midi_ring_write_index(&buffer->ring, &index)) {
         return MIDI_ERROR_BUFFER_FULL;
     }
 
-    buffer->messages[buffer->head] = *message;
-    buffer->head = (buffer->head + 1) % MIDI_BUFFER_SIZE;
-    buffer->count++;
+    buffer->messages[index] = *message;
+    midi_ring_write_commit(&buffer->ring);
     
     return MIDI_SUCCESS;
 }
 
 static midi_status_t midi_buffer_get(midi_buffer_t *buffer, midi_message_t *message)
 {
-    if (midi_buffer_is_empty(buffer)) {
+    uint32_t index;
+    if (!midi_ring_read_index(&buffer->ring, &index)) {
         return MIDI_ERROR_NO_DATA;
     }
 
-    *message = buffer->messages[buffer->tail];
-    buffer->tail = (buffer->tail + 1) % MIDI_BUFFER_SIZE;
-    buffer->count--;
+    *message = buffer->messages[index];
+    midi_ring_read_commit(&buffer->ring);
     
     return MIDI_SUCCESS;
 }
 
 static bool midi_buffer_is_empty(midi_buffer_t *buffer)
 {
-    return buffer->count == 0;
+    return midi_ring_is_empty(&buffer->ring);
+}
+
+// Only tasks wait here; the completion interrupt try-locks and leaves its
+// work to the holder. Yielding lets a preempted lower-priority holder run.
+static void midi_tx_lock(midi_dev_t *dev)
+{
+    while (!midi_tx_try_lock(dev)) {
+        sched_yield();
+    }
+}
+
+static bool midi_tx_try_lock(midi_dev_t *dev)
+{
+    return !__atomic_test_and_set(&dev->tx.lock, __ATOMIC_ACQUIRE);
+}
+
+static void midi_tx_unlock(midi_dev_t *dev)
+{
+    // Completions that found the lock taken are picked up here, unless
+    // someone else grabs the lock first, in which case they will.
+    midi_tx_assembler_t *tx = &dev->tx;
+
+    for (;;) {
+        __atomic_clear(&tx->lock, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n(&tx->completions, __ATOMIC_ACQUIRE) == 0 || !midi_tx_try_lock(dev)) {
+            return;
+        }
+
+        uint8_t completed = __atomic_exchange_n(&tx->completions, 0, __ATOMIC_ACQ_REL);
+        tx->in_flight = (completed < tx->in_flight) ? tx->in_flight - completed : 0;
+
+        uint64_t now = midi_time_now_ns();
+        midi_tx_pump_sysex_locked(dev, now);
+        midi_tx_kick_locked(dev, tx->in_flight == 0, now);
+    }
+}
+
+static midi_status_t midi_tx_append_locked(midi_dev_t *dev, uint32_t word)
+{
+    midi_tx_assembler_t *tx = &dev->tx;
+    uint64_t now = midi_time_now_ns();
+
+    if (tx->length >= tx->packet_size) {
+        midi_tx_kick_locked(dev, true, now);
+        if (tx->length >= tx->packet_size) {
+            tx->drops++;
+            return MIDI_ERROR_BUFFER_FULL;
+        }
+    }
+
+    if (!midi_tx_reserve_locked(dev)) {
+        tx->drops++;
+        return MIDI_ERROR_BUFFER_FULL;
+    }
+
+    if (tx->length == 0) {
+        tx->first_event_time = now;
+    }
+
+    midi_tx_put_word(&tx->packet->data[tx->length], word);
+    tx->length += MIDI_EVENT_SIZE;
+
+    return midi_tx_kick_locked(dev, false, now);
+}
+
+static midi_status_t midi_tx_kick_locked(midi_dev_t *dev, bool force, uint64_t now)
+{
+    midi_tx_assembler_t *tx = &dev->tx;
+
+    if (tx->length == 0 || tx->in_flight >= USB_TX_QUEUE_DEPTH) {
+        return MIDI_SUCCESS;
+    }
+
+    // A partial packet waits behind one in flight to pick up company
+    if (!force && tx->length < tx->packet_size &&
+        (tx->in_flight > 0 || now - tx->first_event_time < tx->latency_ns)) {
+        return MIDI_SUCCESS;
+    }
+
+    tx->packet->length = tx->length;
+    usb_status_t status = usb_transmit_packet(dev->endpoint_in, tx->packet);
+    if (status == USB_ERROR_BUSY) {
+        return MIDI_SUCCESS;
+    }
+
+    // The transmit queue holds its own reference until the packet is sent
+    usb_packet_unref(tx->packet);
+    tx->packet = NULL;
+    tx->length = 0;
+
+    if (status != USB_SUCCESS) {
+        return MIDI_ERROR_USB_ERROR;
+    }
+
+    tx->in_flight++;
+    return MIDI_SUCCESS;
+}
+
+// The next packet is taken from the USB pool only when an event needs it
+static bool midi_tx_reserve_locked(midi_dev_t *dev)
+{
+    if (dev->tx.packet == NULL) {
+        dev->tx.packet = dev->tx.spare_count > 0 ? dev->tx.spares[--dev->tx.spare_count] : usb_packet_alloc();
+    }
+
+    return dev->tx.packet != NULL;
+}
+
+// All or nothing: on failure the pool gets back what was taken
+static bool midi_tx_take_spares_locked(midi_dev_t *dev, uint32_t count)
+{
+    midi_tx_assembler_t *tx = &dev->tx;
+
+    if (count > sizeof(tx->spares) / sizeof(tx->spares[0])) {
+        return false;
+    }
+
+    while (tx->spare_count < count) {
+        usb_packet_t *packet = usb_packet_alloc();
+        if (packet == NULL) {
+            midi_tx_return_spares_locked(dev);
+            return false;
+        }
+        tx->spares[tx->spare_count++] = packet;
+    }
+
+    return true;
+}
+
+static void midi_tx_return_spares_locked(midi_dev_t *dev)
+{
+    while (dev->tx.spare_count > 0) {
+        usb_packet_unref(dev->tx.spares[--dev->tx.spare_count]);
+    }
+}
+
+static void midi_tx_put_word(uint8_t *packet, uint32_t word)
+{
+    packet[0] = (uint8_t)word;
+    packet[1] = (uint8_t)(word >> 8);
+    packet[2] = (uint8_t)(word >> 16);
+    packet[3] = (uint8_t)(word >> 24);
+}
+
+static void midi_tx_pump_sysex_locked(midi_dev_t *dev, uint64_t now)
+{
+    midi_tx_assembler_t *tx = &dev->tx;
+
+    while (tx->sysex_source) {
+        if (tx->length >= tx->packet_size) {
+            midi_tx_kick_locked(dev, true, now);
+            if (tx->length >= tx->packet_size) {
+                return;
+            }
+        }
+
+        // With the pool empty the stream waits, like with the queue full
+        if (!midi_tx_reserve_locked(dev)) {
+            return;
+        }
+
+        // The event holding F7 is the last, so nothing needs to be held
+        // back to pick its code index
+        uint8_t bytes[3] = {0, 0, 0};
+        uint32_t count = 0;
+        bool last = false;
+
+        while (count < 3 && !last) {
+            if (!tx->sysex_started) {
+                bytes[count++] = MIDI_MSG_SYSTEM_EXCLUSIVE;
+                tx->sysex_started = true;
+            } else if (tx->sysex_staged_pos < tx->sysex_staged_length) {
+                bytes[count++] = tx->sysex_staged[tx->sysex_staged_pos++];
+            } else if (!tx->sysex_ended) {
+                uint32_t produced = tx->sysex_source(tx->sysex_staged, sizeof(tx->sysex_staged), tx->sysex_context);
+                tx->sysex_staged_length = (uint16_t)(produced < sizeof(tx->sysex_staged) ? produced : sizeof(tx->sysex_staged));
+                tx->sysex_staged_pos = 0;
+                tx->sysex_ended = (produced == 0);
+            } else {
+                bytes[count++] = MIDI_MSG_END_SYSEX;
+                last = true;
+            }
+        }
+
+        uint32_t word = (last ? 0x04 + count : 0x04) | ((uint32_t)tx->sysex_cable << 4) | ((uint32_t)bytes[0] << 8) |
+                        ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 24);
+        midi_tx_append_locked(dev, word);
+
+        if (last) {
+            __atomic_store_n(&tx->sysex_source, NULL, __ATOMIC_RELEASE);
+            midi_tx_kick_locked(dev, true, now);
+
+            if (dev->callbacks.sysex_sent_callback) {
+                dev->callbacks.sysex_sent_callback(dev);
+            }
+        }
+    }
 }
 
-static bool midi_buffer_is_full(midi_buffer_t *buffer)
+static uint32_t midi_sysex_buffer_source(uint8_t *buffer, uint32_t max_length, void *context)
 {
-    return buffer->count >= MIDI_BUFFER_SIZE;
-}
\ No newline at end of file
+    midi_sysex_buffer_source_t *source = (midi_sysex_buffer_source_t*)context;
+    uint32_t remaining = source->length - source->offset;
+    uint32_t length = remaining < max_length ? remaining : max_length;
+
+    memcpy(buffer, source->data + source->offset, length);
+    source->offset += length;
+
+    return length;
+}
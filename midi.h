@@ -5,7 +5,35 @@
 #include <stdbool.h>
 
 #define MIDI_MAX_DATA_SIZE 3
-#define MIDI_BUFFER_SIZE 64
+
+// USB MIDI devices that can be open at once; each takes a pair of endpoints
+#ifndef MIDI_MAX_DEVICES
+#define MIDI_MAX_DEVICES 4
+#endif
+
+// Virtual cables (ports) handled per device; events on higher cable
+// numbers are dropped. USB-MIDI allows up to 16.
+#ifndef MIDI_MAX_CABLES
+#define MIDI_MAX_CABLES 16
+#endif
+
+// Receive buffers rotated on each device's OUT endpoint, so received
+// packets can wait for midi_process_rx; with all of them waiting the
+// endpoint NAKs. A power of two up to USB_RX_POOL_MAX_BUFFERS.
+#ifndef MIDI_RX_QUEUE_DEPTH
+#define MIDI_RX_QUEUE_DEPTH 4
+#endif
+
+// Events decoded per batch; 16 fills one full-speed packet
+#ifndef MIDI_DECODE_BATCH
+#define MIDI_DECODE_BATCH 16
+#endif
+
+// How long an outgoing event may wait in a partly filled USB packet for
+// company while the IN endpoint is idle. 0 sends as soon as it is idle.
+#ifndef MIDI_TX_LATENCY_US
+#define MIDI_TX_LATENCY_US 0
+#endif
 
 typedef enum {
     MIDI_SUCCESS = 0,
@@ -13,7 +41,8 @@ typedef enum {
     MIDI_ERROR_NOT_INITIALIZED,
     MIDI_ERROR_BUFFER_FULL,
     MIDI_ERROR_NO_DATA,
-    MIDI_ERROR_USB_ERROR
+    MIDI_ERROR_USB_ERROR,
+    MIDI_ERROR_BUSY
 } midi_status_t;
 
 typedef enum {
@@ -42,7 +71,8 @@ typedef struct {
     uint8_t status;
     uint8_t data[MIDI_MAX_DATA_SIZE];
     uint8_t length;
-    uint32_t timestamp;
+    uint8_t cable;
+    uint64_t timestamp;
 } midi_message_t;
 
 typedef struct {
@@ -51,12 +81,32 @@ typedef struct {
     uint8_t midi_data[3];
 } usb_midi_event_t;
 
-typedef void (*midi_note_on_callback_t)(uint8_t channel, uint8_t note, uint8_t velocity);
-typedef void (*midi_note_off_callback_t)(uint8_t channel, uint8_t note, uint8_t velocity);
-typedef void (*midi_control_change_callback_t)(uint8_t channel, uint8_t controller, uint8_t value);
-typedef void (*midi_program_change_callback_t)(uint8_t channel, uint8_t program);
-typedef void (*midi_pitch_bend_callback_t)(uint8_t channel, uint16_t bend);
-typedef void (*midi_sysex_callback_t)(uint8_t *data, uint16_t length);
+typedef struct midi_dev midi_dev_t;
+
+typedef struct {
+    uint8_t queued;
+    uint8_t high_water;
+    uint32_t drops;
+} midi_tx_stats_t;
+
+typedef struct {
+    uint8_t pending;
+    uint8_t high_water;
+    uint32_t overruns;
+    uint32_t drops;
+} midi_rx_stats_t;
+
+typedef void (*midi_note_on_callback_t)(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity);
+typedef void (*midi_note_off_callback_t)(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity);
+typedef void (*midi_control_change_callback_t)(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t controller, uint8_t value);
+typedef void (*midi_program_change_callback_t)(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t program);
+typedef void (*midi_pitch_bend_callback_t)(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint16_t bend);
+typedef void (*midi_sysex_callback_t)(midi_dev_t *dev, uint8_t cable, uint8_t *data, uint16_t length);
+typedef void (*midi_sysex_chunk_callback_t)(midi_dev_t *dev, uint8_t cable, uint8_t *data, uint32_t length, bool last);
+typedef void (*midi_rx_ready_callback_t)(midi_dev_t *dev);
+typedef void (*midi_sysex_sent_callback_t)(midi_dev_t *dev);
+typedef void (*midi_batch_callback_t)(midi_dev_t *dev, const midi_message_t *messages, uint16_t count);
+typedef void (*midi_thru_callback_t)(midi_dev_t *dev, uint32_t *events, uint16_t count);
 
 typedef struct {
     midi_note_on_callback_t note_on_callback;
@@ -65,24 +115,113 @@ typedef struct {
     midi_program_change_callback_t program_change_callback;
     midi_pitch_bend_callback_t pitch_bend_callback;
     midi_sysex_callback_t sysex_callback;
+    midi_sysex_chunk_callback_t sysex_chunk_callback;
+    midi_rx_ready_callback_t rx_ready_callback;
+    midi_sysex_sent_callback_t sysex_sent_callback;
+    midi_batch_callback_t batch_callback;
+    midi_thru_callback_t thru_callback;
 } midi_callbacks_t;
 
-midi_status_t midi_init(midi_callbacks_t *callbacks);
-midi_status_t midi_deinit(void);
-midi_status_t midi_start(void);
-midi_status_t midi_stop(void);
+// Opens one of MIDI_MAX_DEVICES driver instances, each with its own buffers,
+// SysEx state and endpoints; the shared USB controller comes up with the
+// first and goes down with the last. Callbacks are told which device and
+// cable an event arrived on; a whole received packet is demultiplexed by
+// cable in one pass. Received events are decoded in batches of up to
+// MIDI_DECODE_BATCH; with batch_callback set, each batch is handed over in
+// one call instead of the per-type callbacks. SysEx still goes to the
+// SysEx callbacks, and ends the batch before it so order is kept.
+// thru_callback sees each received packet first, as event words in
+// midi_pack_message layout; events it clears to 0 have been forwarded
+// elsewhere and are not decoded.
+midi_status_t midi_init(midi_callbacks_t *callbacks, midi_dev_t **dev);
+midi_status_t midi_deinit(midi_dev_t *dev);
+midi_status_t midi_start(midi_dev_t *dev);
+midi_status_t midi_stop(midi_dev_t *dev);
+
+// Cables the USB configuration advertises to the host on the first
+// device's endpoints, as embedded/external jack pairs (1 by default). The
+// descriptor is built when the controller comes up, so this may only be
+// called while no device is open.
+midi_status_t midi_set_interface_cables(uint8_t cable_count);
+
+midi_status_t midi_send_note_on(midi_dev_t *dev, uint8_t channel, uint8_t note, uint8_t velocity);
+midi_status_t midi_send_note_off(midi_dev_t *dev, uint8_t channel, uint8_t note, uint8_t velocity);
+midi_status_t midi_send_control_change(midi_dev_t *dev, uint8_t channel, uint8_t controller, uint8_t value);
+midi_status_t midi_send_program_change(midi_dev_t *dev, uint8_t channel, uint8_t program);
+midi_status_t midi_send_pitch_bend(midi_dev_t *dev, uint8_t channel, uint16_t bend);
+midi_status_t midi_send_sysex(midi_dev_t *dev, uint8_t *data, uint16_t length);
+// The helpers above send on cable 0; midi_send_message uses message->cable,
+// and events for different cables are packed into the same USB packets.
+// midi_send_sysex queues the whole message or, with MIDI_ERROR_BUFFER_FULL,
+// none of it.
+
+// Fills buffer with up to max_length more SysEx payload bytes and returns
+// how many it wrote; 0 ends the message. Called from midi_process_tx and
+// from the USB transfer-completion path as packets drain.
+typedef uint32_t (*midi_sysex_source_t)(uint8_t *buffer, uint32_t max_length, void *context);
+
+// Streaming SysEx: the payload (F0/F7 are added) is pulled from source into
+// whole packets as the transmit queue drains, so memory use does not grow
+// with the message. One stream runs per device; while it does, only
+// real-time messages may be sent on its cable, others there get
+// MIDI_ERROR_BUSY, and other cables are unaffected.
+// midi_send_sysex_buffer streams from data, which must stay valid until
+// midi_is_sending_sysex returns false; sysex_sent_callback fires at that
+// point, from the same contexts as the source, and must not call back
+// into this API.
+midi_status_t midi_send_sysex_stream(midi_dev_t *dev, uint8_t cable, midi_sysex_source_t source, void *context);
+midi_status_t midi_send_sysex_buffer(midi_dev_t *dev, uint8_t cable, const uint8_t *data, uint32_t length);
+bool midi_is_sending_sysex(midi_dev_t *dev);
+
+// Incoming SysEx payload for a cable collects in buffer (256 bytes
+// internally by default, NULL restores it). With sysex_chunk_callback set,
+// each full buffer is handed over and reused, so messages of any length
+// stream through; otherwise sysex_callback gets whole messages and ones
+// that do not fit are dropped.
+midi_status_t midi_set_sysex_buffer(midi_dev_t *dev, uint8_t cable, uint8_t *buffer, uint32_t size);
+
+midi_status_t midi_send_message(midi_dev_t *dev, midi_message_t *message);
+// Sends a packed event word as it is, cable bits included, under the same
+// rules as midi_send_message; for passing on received events undecoded.
+midi_status_t midi_send_event(midi_dev_t *dev, uint32_t event);
+midi_status_t midi_receive_message(midi_dev_t *dev, midi_message_t *message);
+
+// The receive interrupt only moves the endpoint on to the next receive
+// buffer, calling rx_ready_callback when the first one fills.
+// midi_process_rx decodes the filled buffers in place, in batches, from the
+// calling task; the event, batch and SysEx callbacks run there. It stops
+// while the midi_receive_message queue lacks room for a whole packet, and
+// returns MIDI_ERROR_BUFFER_FULL if packets were left waiting; call it
+// again once the queue is drained. The stats
+// give packets waiting, their high-water mark, overruns: how often all
+// buffers were full and the host was held off, and drops: messages lost
+// because the midi_receive_message queue was full.
+midi_status_t midi_process_rx(midi_dev_t *dev);
+midi_status_t midi_get_rx_stats(midi_dev_t *dev, midi_rx_stats_t *stats);
+
+// Sends are packed into the current USB packet, which is queued for
+// transmission when it is full, when the previous IN transfer completes,
+// or once its oldest event is older than the latency bound.
+// midi_process_tx applies the bound and midi_get_tx_deadline reports when
+// it next needs to (midi_time clock, UINT64_MAX if nothing is waiting).
+// midi_flush queues the partial packet now.
+midi_status_t midi_set_tx_latency(midi_dev_t *dev, uint32_t latency_us);
+midi_status_t midi_flush(midi_dev_t *dev);
+midi_status_t midi_process_tx(midi_dev_t *dev);
+uint64_t midi_get_tx_deadline(midi_dev_t *dev);
 
-midi_status_t midi_send_note_on(uint8_t channel, uint8_t note, uint8_t velocity);
-midi_status_t midi_send_note_off(uint8_t channel, uint8_t note, uint8_t velocity);
-midi_status_t midi_send_control_change(uint8_t channel, uint8_t controller, uint8_t value);
-midi_status_t midi_send_program_change(uint8_t channel, uint8_t program);
-midi_status_t midi_send_pitch_bend(uint8_t channel, uint16_t bend);
-midi_status_t midi_send_sysex(uint8_t *data, uint16_t length);
+// USB packets queued on the IN endpoint and their high-water mark; drops
+// counts events refused because the assembly packet and queue were full.
+midi_status_t midi_get_tx_stats(midi_dev_t *dev, midi_tx_stats_t *stats);
 
-midi_status_t midi_send_message(midi_message_t *message);
-midi_status_t midi_receive_message(midi_message_t *message);
+bool midi_has_pending_messages(midi_dev_t *dev);
+uint16_t midi_get_pending_count(midi_dev_t *dev);
 
-bool midi_has_pending_messages(void);
-uint16_t midi_get_pending_count(void);
+// Packed form of a short message, laid out like a USB-MIDI event packet
+// read as a little-endian word: code index in bits 0-3, cable in bits 4-7,
+// then status and the two data bytes. Unused data bytes are zero, and
+// unpacking derives length from the status byte.
+uint32_t midi_pack_message(const midi_message_t *message);
+void midi_unpack_message(uint32_t word, midi_message_t *message);
 
 #endif
\ No newline at end of file
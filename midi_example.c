@@ -1,20 +1,27 @@
 #include "midi.h"
 #include <stdio.h>
 
-static void on_note_on(uint8_t channel, uint8_t note, uint8_t velocity)
+static midi_dev_t *example_dev;
+
+static void on_note_on(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity)
 {
+    (void)cable;
     printf("MIDI Note ON: Channel %d, Note %d, Velocity %d\n", channel, note, velocity);
     
-    midi_send_note_off(channel, note, velocity);
+    midi_send_note_off(dev, channel, note, velocity);
 }
 
-static void on_note_off(uint8_t channel, uint8_t note, uint8_t velocity)
+static void on_note_off(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity)
 {
+    (void)dev;
+    (void)cable;
     printf("MIDI Note OFF: Channel %d, Note %d, Velocity %d\n", channel, note, velocity);
 }
 
-static void on_control_change(uint8_t channel, uint8_t controller, uint8_t value)
+static void on_control_change(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t controller, uint8_t value)
 {
+    (void)dev;
+    (void)cable;
     printf("MIDI Control Change: Channel %d, Controller %d, Value %d\n", channel, controller, value);
     
     if (controller == 7) {
@@ -24,18 +31,24 @@ static void on_control_change(uint8_t channel, uint8_t controller, uint8_t value
     }
 }
 
-static void on_program_change(uint8_t channel, uint8_t program)
+static void on_program_change(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint8_t program)
 {
+    (void)dev;
+    (void)cable;
     printf("MIDI Program Change: Channel %d, Program %d\n", channel, program);
 }
 
-static void on_pitch_bend(uint8_t channel, uint16_t bend)
+static void on_pitch_bend(midi_dev_t *dev, uint8_t cable, uint8_t channel, uint16_t bend)
 {
+    (void)dev;
+    (void)cable;
     printf("MIDI Pitch Bend: Channel %d, Bend %d\n", channel, bend);
 }
 
-static void on_sysex(uint8_t *data, uint16_t length)
+static void on_sysex(midi_dev_t *dev, uint8_t cable, uint8_t *data, uint16_t length)
 {
+    (void)dev;
+    (void)cable;
     printf("MIDI SysEx received, length: %d bytes\n", length);
     printf("Data: ");
     for (uint16_t i = 0; i < length && i < 16; i++) {
@@ -51,26 +64,26 @@ static void midi_send_test_sequence(void)
 {
     printf("Sending MIDI test sequence...\n");
     
-    midi_send_note_on(0, 60, 127);
+    midi_send_note_on(example_dev, 0, 60, 127);
     
-    midi_send_control_change(0, 7, 100);
+    midi_send_control_change(example_dev, 0, 7, 100);
     
-    midi_send_program_change(0, 42);
+    midi_send_program_change(example_dev, 0, 42);
     
-    midi_send_pitch_bend(0, 8192);
+    midi_send_pitch_bend(example_dev, 0, 8192);
     
     uint8_t sysex_data[] = {0x43, 0x12, 0x00, 0x01, 0x02, 0x03};
-    midi_send_sysex(sysex_data, sizeof(sysex_data));
+    midi_send_sysex(example_dev, sysex_data, sizeof(sysex_data));
     
-    midi_send_note_off(0, 60, 0);
+    midi_send_note_off(example_dev, 0, 60, 0);
 }
 
 static void midi_process_pending_messages(void)
 {
     midi_message_t message;
     
-    while (midi_has_pending_messages()) {
-        if (midi_receive_message(&message) == MIDI_SUCCESS) {
+    while (midi_has_pending_messages(example_dev)) {
+        if (midi_receive_message(example_dev, &message) == MIDI_SUCCESS) {
             printf("Processing MIDI message: Status=0x%02X, Length=%d\n", 
                    message.status, message.length);
         }
@@ -90,16 +103,16 @@ int midi_example_init(void)
         .sysex_callback = on_sysex
     };
 
-    midi_status_t status = midi_init(&callbacks);
+    midi_status_t status = midi_init(&callbacks, &example_dev);
     if (status != MIDI_SUCCESS) {
         printf("MIDI initialization failed: %d\n", status);
         return -1;
     }
 
-    status = midi_start();
+    status = midi_start(example_dev);
     if (status != MIDI_SUCCESS) {
         printf("MIDI start failed: %d\n", status);
-        midi_deinit();
+        midi_deinit(example_dev);
         return -1;
     }
 
@@ -111,7 +124,7 @@ int midi_example_init(void)
 
 void midi_example_deinit(void)
 {
-    midi_deinit();
+    midi_deinit(example_dev);
     printf("MIDI device deinitialized\n");
 }
 
@@ -135,11 +148,11 @@ void midi_example_note_test(void)
     uint8_t num_notes = sizeof(notes) / sizeof(notes[0]);
     
     for (uint8_t i = 0; i < num_notes; i++) {
-        midi_send_note_on(0, notes[i], 127);
+        midi_send_note_on(example_dev, 0, notes[i], 127);
         
         for (volatile int delay = 0; delay < 100000; delay++);
         
-        midi_send_note_off(0, notes[i], 0);
+        midi_send_note_off(example_dev, 0, notes[i], 0);
         
         for (volatile int delay = 0; delay < 50000; delay++);
     }
@@ -150,7 +163,7 @@ void midi_example_control_test(void)
     printf("Testing MIDI control changes...\n");
     
     for (uint8_t value = 0; value <= 127; value += 16) {
-        midi_send_control_change(0, 7, value);
+        midi_send_control_change(example_dev, 0, 7, value);
         printf("Sent volume control: %d\n", value);
         
         for (volatile int delay = 0; delay < 50000; delay++);
@@ -162,10 +175,10 @@ void midi_example_sysex_test(void)
     printf("Testing MIDI System Exclusive...\n");
     
     uint8_t device_inquiry[] = {0x7E, 0x00, 0x06, 0x01};
-    midi_send_sysex(device_inquiry, sizeof(device_inquiry));
+    midi_send_sysex(example_dev, device_inquiry, sizeof(device_inquiry));
     printf("Sent device inquiry SysEx\n");
     
     uint8_t manufacturer_data[] = {0x43, 0x12, 0x00, 0x41, 0x10, 0x32, 0x40};
-    midi_send_sysex(manufacturer_data, sizeof(manufacturer_data));
+    midi_send_sysex(example_dev, manufacturer_data, sizeof(manufacturer_data));
     printf("Sent manufacturer-specific SysEx\n");
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "midi_histogram.h"
+#include <string.h>
+
+static uint32_t midi_histogram_bucket_index(uint64_t value);
+static uint64_t midi_histogram_bucket_upper(uint32_t index);
+static uint64_t midi_histogram_value_at_rank(const midi_histogram_t *histogram, uint32_t rank);
+
+void midi_histogram_reset(midi_histogram_t *histogram)
+{
+    memset(histogram, 0, sizeof(midi_histogram_t));
+}
+
+void midi_histogram_record(midi_histogram_t *histogram, uint64_t value)
+{
+    histogram->counts[midi_histogram_bucket_index(value)]++;
+    histogram->total++;
+
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+uint64_t midi_histogram_percentile(const midi_histogram_t *histogram, uint32_t per_mille)
+{
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = ((uint64_t)histogram->total * per_mille + 999) / 1000;
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    return midi_histogram_value_at_rank(histogram, (uint32_t)rank);
+}
+
+void midi_histogram_summarize(const midi_histogram_t *histogram, midi_histogram_summary_t *summary)
+{
+    summary->count = histogram->total;
+    summary->p50 = midi_histogram_percentile(histogram, 500);
+    summary->p99 = midi_histogram_percentile(histogram, 990);
+    summary->p999 = midi_histogram_percentile(histogram, 999);
+    summary->max = histogram->max;
+}
+
+static uint32_t midi_histogram_bucket_index(uint64_t value)
+{
+    if (value < MIDI_HISTOGRAM_SUB_BUCKETS) {
+        return (uint32_t)value;
+    }
+
+    uint32_t exponent = 63 - (uint32_t)__builtin_clzll(value);
+    if (exponent > MIDI_HISTOGRAM_MAX_EXPONENT) {
+        return MIDI_HISTOGRAM_BUCKETS - 1;
+    }
+
+    uint32_t shift = exponent - MIDI_HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift + 1) * MIDI_HISTOGRAM_SUB_BUCKETS +
+           (uint32_t)((value >> shift) & (MIDI_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static uint64_t midi_histogram_bucket_upper(uint32_t index)
+{
+    if (index < MIDI_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    uint32_t shift = index / MIDI_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(MIDI_HISTOGRAM_SUB_BUCKETS + index % MIDI_HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + (1ULL << shift) - 1;
+}
+
+static uint64_t midi_histogram_value_at_rank(const midi_histogram_t *histogram, uint32_t rank)
+{
+    uint32_t seen = 0;
+
+    for (uint32_t i = 0; i < MIDI_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t upper = midi_histogram_bucket_upper(i);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
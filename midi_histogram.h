@@ -0,0 +1,37 @@
+#ifndef MIDI_HISTOGRAM_H
+#define MIDI_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define MIDI_HISTOGRAM_SUB_BUCKET_BITS 3
+#define MIDI_HISTOGRAM_SUB_BUCKETS (1 << MIDI_HISTOGRAM_SUB_BUCKET_BITS)
+#define MIDI_HISTOGRAM_MAX_EXPONENT 36
+#define MIDI_HISTOGRAM_BUCKETS \
+    ((MIDI_HISTOGRAM_MAX_EXPONENT - MIDI_HISTOGRAM_SUB_BUCKET_BITS + 2) * MIDI_HISTOGRAM_SUB_BUCKETS)
+
+// Log-linear histogram: values below MIDI_HISTOGRAM_SUB_BUCKETS get exact
+// buckets, and every power of two above that is split into
+// MIDI_HISTOGRAM_SUB_BUCKETS linear buckets, giving a relative error of at
+// most 1/MIDI_HISTOGRAM_SUB_BUCKETS. Values of 2^(MAX_EXPONENT + 1) and above
+// land in the last bucket. Recording does not allocate or lock; concurrent
+// records into one histogram need external serialisation.
+typedef struct {
+    uint32_t counts[MIDI_HISTOGRAM_BUCKETS];
+    uint32_t total;
+    uint64_t max;
+} midi_histogram_t;
+
+typedef struct {
+    uint32_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} midi_histogram_summary_t;
+
+void midi_histogram_reset(midi_histogram_t *histogram);
+void midi_histogram_record(midi_histogram_t *histogram, uint64_t value);
+uint64_t midi_histogram_percentile(const midi_histogram_t *histogram, uint32_t per_mille);
+void midi_histogram_summarize(const midi_histogram_t *histogram, midi_histogram_summary_t *summary);
+
+#endif
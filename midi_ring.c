@@ -0,0 +1,71 @@
+#include "midi_ring.h"
+
+void midi_ring_init(midi_ring_t *ring, uint32_t capacity)
+{
+    ring->mask = capacity - 1;
+    midi_ring_reset(ring);
+}
+
+void midi_ring_reset(midi_ring_t *ring)
+{
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, 0, __ATOMIC_RELEASE);
+}
+
+bool midi_ring_write_index(midi_ring_t *ring, uint32_t *index)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail > ring->mask) {
+        return false;
+    }
+
+    *index = head & ring->mask;
+    return true;
+}
+
+void midi_ring_write_commit(midi_ring_t *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool midi_ring_read_index(midi_ring_t *ring, uint32_t *index)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return false;
+    }
+
+    *index = tail & ring->mask;
+    return true;
+}
+
+void midi_ring_read_commit(midi_ring_t *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t midi_ring_count(midi_ring_t *ring)
+{
+    // Full fence so a producer checking the count after a commit and a
+    // consumer checking it before sleeping cannot both miss each other.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+bool midi_ring_is_empty(midi_ring_t *ring)
+{
+    return midi_ring_count(ring) == 0;
+}
+
+bool midi_ring_is_full(midi_ring_t *ring)
+{
+    return midi_ring_count(ring) > ring->mask;
+}
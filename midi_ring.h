@@ -0,0 +1,44 @@
+#ifndef MIDI_RING_H
+#define MIDI_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MIDI_RING_CACHE_LINE_SIZE 64
+
+#define MIDI_RING_IS_POWER_OF_TWO(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+
+#define MIDI_RING_SMEAR(x, s) ((x) | ((x) >> (s)))
+#define MIDI_RING_ROUND_UP_POW2(n) \
+    (MIDI_RING_SMEAR(MIDI_RING_SMEAR(MIDI_RING_SMEAR(MIDI_RING_SMEAR(MIDI_RING_SMEAR( \
+        (uint32_t)(n) - 1, 1), 2), 4), 8), 16) + 1)
+
+#if defined(__GNUC__)
+#define MIDI_RING_CACHE_ALIGNED __attribute__((aligned(MIDI_RING_CACHE_LINE_SIZE)))
+#else
+#define MIDI_RING_CACHE_ALIGNED
+#endif
+
+// Single-producer/single-consumer ring index pair. The ring only manages
+// indices; callers own the slot storage and copy into or out of
+// slots[index] between the *_index and *_commit calls. head is written only
+// by the producer and tail only by the consumer, each on its own cache line.
+typedef struct {
+    uint32_t mask;
+    MIDI_RING_CACHE_ALIGNED uint32_t head;
+    MIDI_RING_CACHE_ALIGNED uint32_t tail;
+} midi_ring_t;
+
+void midi_ring_init(midi_ring_t *ring, uint32_t capacity);
+void midi_ring_reset(midi_ring_t *ring);
+
+bool midi_ring_write_index(midi_ring_t *ring, uint32_t *index);
+void midi_ring_write_commit(midi_ring_t *ring);
+bool midi_ring_read_index(midi_ring_t *ring, uint32_t *index);
+void midi_ring_read_commit(midi_ring_t *ring);
+
+uint32_t midi_ring_count(midi_ring_t *ring);
+bool midi_ring_is_empty(midi_ring_t *ring);
+bool midi_ring_is_full(midi_ring_t *ring);
+
+#endif
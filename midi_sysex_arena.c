@@ -0,0 +1,166 @@
+#include "midi_sysex_arena.h"
+#include <string.h>
+
+static bool midi_sysex_arena_claim(midi_sysex_arena_t *arena, uint32_t blocks, uint16_t *first);
+static bool midi_sysex_arena_claim_at(midi_sysex_arena_t *arena, uint16_t first, uint32_t blocks);
+static uint32_t midi_sysex_arena_block_count(uint32_t length);
+static uint64_t midi_sysex_arena_run_mask(uint16_t first, uint32_t blocks);
+
+void midi_sysex_arena_init(midi_sysex_arena_t *arena)
+{
+    arena->used = 0;
+    arena->exhausted = 0;
+    memset(arena->refs, 0, sizeof(arena->refs));
+    memset(arena->lengths, 0, sizeof(arena->lengths));
+}
+
+bool midi_sysex_arena_alloc(midi_sysex_arena_t *arena, const uint8_t *data, uint32_t length, uint16_t *handle)
+{
+    uint16_t first;
+    if (!midi_sysex_arena_claim(arena, midi_sysex_arena_block_count(length), &first)) {
+        __atomic_fetch_add(&arena->exhausted, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if (length > 0) {
+        memcpy(arena->data[first], data, length);
+    }
+    arena->lengths[first] = length;
+    __atomic_store_n(&arena->refs[first], 1, __ATOMIC_RELEASE);
+
+    *handle = first;
+    return true;
+}
+
+// The run grows in place when the blocks after it are free; otherwise the
+// payload moves to a new run and the handle changes.
+bool midi_sysex_arena_append(midi_sysex_arena_t *arena, uint16_t *handle, const uint8_t *data, uint32_t length)
+{
+    uint16_t first = *handle;
+    if (first >= MIDI_SYSEX_ARENA_BLOCKS) {
+        return false;
+    }
+
+    uint32_t old_length = arena->lengths[first];
+    uint32_t old_blocks = midi_sysex_arena_block_count(old_length);
+    uint32_t new_blocks = midi_sysex_arena_block_count(old_length + length);
+
+    if (new_blocks > old_blocks && !midi_sysex_arena_claim_at(arena, first + old_blocks, new_blocks - old_blocks)) {
+        uint16_t moved;
+        if (!midi_sysex_arena_claim(arena, new_blocks, &moved)) {
+            __atomic_fetch_add(&arena->exhausted, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        memcpy(arena->data[moved], arena->data[first], old_length);
+        arena->lengths[moved] = old_length;
+        __atomic_store_n(&arena->refs[moved], 1, __ATOMIC_RELEASE);
+        midi_sysex_arena_release(arena, first);
+        first = moved;
+        *handle = moved;
+    }
+
+    if (length > 0) {
+        memcpy(arena->data[first] + old_length, data, length);
+    }
+    arena->lengths[first] = old_length + length;
+
+    return true;
+}
+
+void midi_sysex_arena_retain(midi_sysex_arena_t *arena, uint16_t handle)
+{
+    if (handle < MIDI_SYSEX_ARENA_BLOCKS) {
+        __atomic_fetch_add(&arena->refs[handle], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void midi_sysex_arena_release(midi_sysex_arena_t *arena, uint16_t handle)
+{
+    if (handle >= MIDI_SYSEX_ARENA_BLOCKS) {
+        return;
+    }
+
+    if (__atomic_sub_fetch(&arena->refs[handle], 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    uint32_t blocks = midi_sysex_arena_block_count(arena->lengths[handle]);
+    __atomic_fetch_and(&arena->used, ~midi_sysex_arena_run_mask(handle, blocks), __ATOMIC_RELEASE);
+}
+
+const uint8_t *midi_sysex_arena_data(midi_sysex_arena_t *arena, uint16_t handle, uint32_t *length)
+{
+    if (handle >= MIDI_SYSEX_ARENA_BLOCKS || __atomic_load_n(&arena->refs[handle], __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+
+    *length = arena->lengths[handle];
+    return arena->data[handle];
+}
+
+uint32_t midi_sysex_arena_free_blocks(midi_sysex_arena_t *arena)
+{
+    return MIDI_SYSEX_ARENA_BLOCKS - (uint32_t)__builtin_popcountll(__atomic_load_n(&arena->used, __ATOMIC_ACQUIRE));
+}
+
+static bool midi_sysex_arena_claim(midi_sysex_arena_t *arena, uint32_t blocks, uint16_t *first)
+{
+    if (blocks > MIDI_SYSEX_ARENA_BLOCKS) {
+        return false;
+    }
+
+    uint64_t used = __atomic_load_n(&arena->used, __ATOMIC_ACQUIRE);
+
+    for (uint16_t start = 0; start + blocks <= MIDI_SYSEX_ARENA_BLOCKS; ) {
+        uint64_t mask = midi_sysex_arena_run_mask(start, blocks);
+
+        if (used & mask) {
+            // Skip past the highest taken block in the window
+            uint64_t taken = used & mask;
+            start = (uint16_t)(63 - __builtin_clzll(taken) + 1);
+            continue;
+        }
+
+        // A failed swap reloads used; retry the same window against it
+        if (__atomic_compare_exchange_n(&arena->used, &used, used | mask, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *first = start;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool midi_sysex_arena_claim_at(midi_sysex_arena_t *arena, uint16_t first, uint32_t blocks)
+{
+    if (first + blocks > MIDI_SYSEX_ARENA_BLOCKS) {
+        return false;
+    }
+
+    uint64_t mask = midi_sysex_arena_run_mask(first, blocks);
+    uint64_t used = __atomic_load_n(&arena->used, __ATOMIC_ACQUIRE);
+
+    while (!(used & mask)) {
+        if (__atomic_compare_exchange_n(&arena->used, &used, used | mask, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// An empty payload still takes a block, to carry its reference count
+static uint32_t midi_sysex_arena_block_count(uint32_t length)
+{
+    uint32_t blocks = (length + MIDI_SYSEX_ARENA_BLOCK_SIZE - 1) / MIDI_SYSEX_ARENA_BLOCK_SIZE;
+    return blocks == 0 ? 1 : blocks;
+}
+
+static uint64_t midi_sysex_arena_run_mask(uint16_t first, uint32_t blocks)
+{
+    uint64_t run = (blocks >= 64) ? UINT64_MAX : ((1ULL << blocks) - 1);
+    return run << first;
+}
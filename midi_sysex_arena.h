@@ -0,0 +1,38 @@
+#ifndef MIDI_SYSEX_ARENA_H
+#define MIDI_SYSEX_ARENA_H
+
+#include "midi_ring.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MIDI_SYSEX_ARENA_BLOCKS 64
+#define MIDI_SYSEX_ARENA_BLOCK_SIZE 256
+#define MIDI_SYSEX_ARENA_MAX_LENGTH (MIDI_SYSEX_ARENA_BLOCKS * MIDI_SYSEX_ARENA_BLOCK_SIZE)
+
+// Reference-counted SysEx payloads in a fixed pool of blocks. A payload
+// takes a contiguous run of blocks, claimed with a compare-and-swap on the
+// used bitmap, and is named by the index of its first block. Retain and
+// release may be called from any thread; the blocks go back to the pool
+// when the last reference is released.
+typedef struct {
+    uint64_t used;
+    uint32_t refs[MIDI_SYSEX_ARENA_BLOCKS];
+    uint32_t lengths[MIDI_SYSEX_ARENA_BLOCKS];
+    uint32_t exhausted;
+    MIDI_RING_CACHE_ALIGNED uint8_t data[MIDI_SYSEX_ARENA_BLOCKS][MIDI_SYSEX_ARENA_BLOCK_SIZE];
+} midi_sysex_arena_t;
+
+void midi_sysex_arena_init(midi_sysex_arena_t *arena);
+// Copies the payload in with one reference held by the caller. Fails when no
+// run of free blocks is long enough, which is counted in exhausted.
+bool midi_sysex_arena_alloc(midi_sysex_arena_t *arena, const uint8_t *data, uint32_t length, uint16_t *handle);
+// Adds to a payload not yet shared (one reference, held by the caller), for
+// assembling one as it arrives. The handle may change. On failure the
+// payload is left as it was and exhausted is counted.
+bool midi_sysex_arena_append(midi_sysex_arena_t *arena, uint16_t *handle, const uint8_t *data, uint32_t length);
+void midi_sysex_arena_retain(midi_sysex_arena_t *arena, uint16_t handle);
+void midi_sysex_arena_release(midi_sysex_arena_t *arena, uint16_t handle);
+const uint8_t *midi_sysex_arena_data(midi_sysex_arena_t *arena, uint16_t handle, uint32_t *length);
+uint32_t midi_sysex_arena_free_blocks(midi_sysex_arena_t *arena);
+
+#endif
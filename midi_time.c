@@ -0,0 +1,111 @@
+#include "midi_time.h"
+#include <time.h>
+
+static uint64_t midi_time_default_source(void);
+
+static midi_time_source_t midi_time_source = midi_time_default_source;
+
+void midi_time_set_source(midi_time_source_t source)
+{
+    if (source == NULL) {
+        source = midi_time_default_source;
+    }
+
+    __atomic_store_n(&midi_time_source, source, __ATOMIC_RELEASE);
+}
+
+uint64_t midi_time_now_ns(void)
+{
+    midi_time_source_t source = __atomic_load_n(&midi_time_source, __ATOMIC_ACQUIRE);
+    return source();
+}
+
+#if defined(CLOCK_MONOTONIC)
+
+static uint64_t midi_time_default_source(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void midi_time_init(void)
+{
+}
+
+#else
+
+static uint64_t midi_time_read_cycles(void);
+static uint64_t midi_time_cycles_per_second(void);
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define MIDI_TIME_DEMCR (*(volatile uint32_t *)0xE000EDFC)
+#define MIDI_TIME_DWT_CTRL (*(volatile uint32_t *)0xE0001000)
+#define MIDI_TIME_DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define MIDI_TIME_DEMCR_TRCENA (1u << 24)
+#define MIDI_TIME_DWT_CYCCNTENA (1u << 0)
+#endif
+
+// The DWT cycle counter is off after reset
+void midi_time_init(void)
+{
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+    MIDI_TIME_DEMCR |= MIDI_TIME_DEMCR_TRCENA;
+    MIDI_TIME_DWT_CTRL |= MIDI_TIME_DWT_CYCCNTENA;
+#endif
+}
+
+static uint64_t midi_time_read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(cycles) : : "memory");
+    return cycles;
+#elif defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+    // CYCCNT is 32 bits wide; extend it assuming it is read at least once
+    // per wrap period. Readers in interrupts and tasks share the extension,
+    // so it is updated with interrupts masked.
+    static uint32_t last;
+    static uint64_t high;
+    uint32_t primask;
+    __asm__ volatile("mrs %0, primask\n\tcpsid i" : "=r"(primask) : : "memory");
+    uint32_t now = MIDI_TIME_DWT_CYCCNT;
+    if (now < last) {
+        high += 1ULL << 32;
+    }
+    last = now;
+    uint64_t cycles = high | now;
+    __asm__ volatile("msr primask, %0" : : "r"(primask) : "memory");
+    return cycles;
+#else
+#error "midi_time: no cycle counter for this target"
+#endif
+}
+
+// The aarch64 generic timer runs at its own rate, given by CNTFRQ_EL0,
+// rather than the CPU clock
+static uint64_t midi_time_cycles_per_second(void)
+{
+#if defined(__aarch64__)
+    static uint64_t frequency;
+    uint64_t cached = __atomic_load_n(&frequency, __ATOMIC_RELAXED);
+    if (cached == 0) {
+        __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(cached));
+        __atomic_store_n(&frequency, cached, __ATOMIC_RELAXED);
+    }
+    return cached;
+#else
+    return (uint64_t)MIDI_TIME_CYCLES_PER_US * 1000000ULL;
+#endif
+}
+
+static uint64_t midi_time_default_source(void)
+{
+    uint64_t cycles = midi_time_read_cycles();
+    uint64_t frequency = midi_time_cycles_per_second();
+    return (cycles / frequency) * 1000000000ULL + (cycles % frequency) * 1000000000ULL / frequency;
+}
+
+#endif
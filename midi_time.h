@@ -0,0 +1,22 @@
+#ifndef MIDI_TIME_H
+#define MIDI_TIME_H
+
+#include <stdint.h>
+
+#ifndef MIDI_TIME_CYCLES_PER_US
+#define MIDI_TIME_CYCLES_PER_US 1000
+#endif
+
+typedef uint64_t (*midi_time_source_t)(void);
+
+// Message timestamps are nanoseconds from an arbitrary monotonic epoch. The
+// default source is CLOCK_MONOTONIC where the platform has it, the generic
+// timer at CNTFRQ_EL0 on aarch64, and elsewhere the CPU cycle counter
+// scaled by MIDI_TIME_CYCLES_PER_US. midi_time_init starts the counter
+// where it needs starting (the DWT on Cortex-M) and may be called more
+// than once. Passing NULL to midi_time_set_source restores the default.
+void midi_time_init(void);
+void midi_time_set_source(midi_time_source_t source);
+uint64_t midi_time_now_ns(void);
+
+#endif
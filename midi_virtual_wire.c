@@ -1,6 +1,42 @@
 #include "midi_virtual_wire.h"
+#include "midi_time.h"
+#include "rtos.h"
 #include <string.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct {
+    midi_vw_connection_t *connection;
+    midi_vw_port_t *dest_port;
+    midi_histogram_t *latency;
+    uint8_t dest_channel;
+    bool cut_through;
+} midi_vw_route_t;
+
+typedef struct {
+    pthread_t thread;
+    rtos_event_t wakeup;
+    uint8_t index;
+    midi_vw_worker_stats_t stats;
+} midi_vw_worker_t;
+
+typedef struct {
+    uint64_t payload;
+    uint64_t delivery_time;
+} midi_vw_scheduled_t;
+
+typedef struct {
+    midi_vw_scheduled_t entries[MIDI_WHEEL_CAPACITY];
+    uint16_t count;
+} midi_vw_release_batch_t;
+
+#define MIDI_VW_SYSEX_CODE_INDEX 0x01
+// Passed to midi_vw_route_message when there is no raw word to cut through
+#define MIDI_VW_NO_EVENT 0
+
+typedef char midi_vw_buffer_size_check[MIDI_RING_IS_POWER_OF_TWO(MIDI_VW_MESSAGE_BUFFER_SIZE) ? 1 : -1];
+typedef char midi_vw_delay_line_size_check[MIDI_VW_DELAY_LINE_SIZE <= MIDI_VW_MESSAGE_BUFFER_SIZE ? 1 : -1];
 
 static struct {
     bool initialized;
@@ -8,6 +44,27 @@ static struct {
     midi_vw_callbacks_t callbacks;
     midi_vw_port_t ports[MIDI_VW_MAX_DEVICES];
     midi_vw_connection_t connections[MIDI_VW_MAX_CONNECTIONS];
+    midi_vw_route_t routes[MIDI_VW_MAX_CONNECTIONS];
+    uint8_t route_offsets[MIDI_VW_MAX_DEVICES + 1];
+    midi_histogram_t connection_latency[MIDI_VW_MAX_CONNECTIONS];
+    midi_histogram_t port_latency[MIDI_VW_MAX_DEVICES];
+    midi_histogram_t port_wait[MIDI_VW_MAX_DEVICES];
+    uint8_t device_slots[256];
+    uint8_t connection_slots[256];
+    uint8_t free_ports[MIDI_VW_MAX_DEVICES];
+    uint8_t free_connections[MIDI_VW_MAX_CONNECTIONS];
+    uint8_t free_port_count;
+    uint8_t free_connection_count;
+    bool source_claims[MIDI_VW_MAX_DEVICES];
+    bool tx_locks[MIDI_VW_MAX_DEVICES];
+    midi_wheel_t scheduler;
+    midi_sysex_arena_t sysex_arena;
+    bool scheduler_lock;
+    uint64_t scheduler_wake_time;
+    midi_vw_worker_t workers[MIDI_VW_MAX_WORKERS];
+    uint8_t worker_count;
+    bool workers_running;
+    bool workers_stopping;
     uint8_t device_count;
     uint8_t connection_count;
     uint8_t next_device_id;
@@ -15,18 +72,48 @@ static struct {
     uint32_t total_messages;
     uint32_t total_errors;
     uint32_t total_filtered;
-    uint32_t system_time;
 } midi_vw_system;
 
-static midi_vw_status_t midi_vw_buffer_put(midi_vw_message_buffer_t *buffer, midi_message_t *message);
+static midi_vw_status_t midi_vw_buffer_put(midi_vw_message_buffer_t *buffer, midi_message_t *message,
+                                           uint32_t *backlog);
 static midi_vw_status_t midi_vw_buffer_get(midi_vw_message_buffer_t *buffer, midi_message_t *message);
+static midi_vw_status_t midi_vw_buffer_get_due(midi_vw_message_buffer_t *buffer, uint64_t now,
+                                               midi_message_t *message);
+static bool midi_vw_buffer_next_time(midi_vw_message_buffer_t *buffer, uint64_t *time);
 static bool midi_vw_buffer_is_empty(midi_vw_message_buffer_t *buffer);
-static bool midi_vw_buffer_is_full(midi_vw_message_buffer_t *buffer);
+static void midi_vw_buffer_discard(midi_vw_message_buffer_t *buffer);
+static uint32_t midi_vw_pack_message(const midi_message_t *message);
+static bool midi_vw_is_sysex(const midi_message_t *message);
+static uint16_t midi_vw_sysex_handle(const midi_message_t *message);
 static uint8_t midi_vw_find_device(uint8_t device_id);
 static uint8_t midi_vw_find_connection(uint8_t connection_id);
+static uint8_t midi_vw_allocate_id(uint8_t *next_id, const uint8_t *slots, uint8_t invalid_slot);
+static void midi_vw_reset_connections(void);
+static void midi_vw_release_connection(uint8_t slot);
+static void midi_vw_build_filter_mask(midi_vw_connection_t *connection);
 static bool midi_vw_should_filter_message(midi_vw_connection_t *connection, midi_message_t *message);
-static void midi_vw_route_message(uint8_t source_device_id, midi_message_t *message);
-static uint32_t midi_vw_get_time(void);
+static void midi_vw_rebuild_routes(void);
+static midi_vw_status_t midi_vw_port_send(midi_vw_port_t *port, midi_message_t *message);
+static bool midi_vw_port_forward(midi_vw_port_t *port, uint32_t event, uint64_t timestamp);
+static void midi_vw_route_message(uint8_t source_slot, midi_message_t *message, uint32_t event);
+static midi_vw_status_t midi_vw_route_sysex(uint8_t slot, uint16_t handle, uint64_t timestamp);
+static uint32_t midi_vw_drain_source(uint8_t slot, uint32_t budget);
+static bool midi_vw_source_try_claim(uint8_t slot);
+static void midi_vw_source_claim(uint8_t slot);
+static void midi_vw_source_release(uint8_t slot);
+static void midi_vw_lock(bool *lock);
+static void midi_vw_unlock(bool *lock);
+static void midi_vw_tx_lock(uint8_t slot);
+static void midi_vw_tx_unlock(uint8_t slot);
+static void midi_vw_collect_scheduled(uint64_t payload, uint64_t delivery_time, void *context);
+static void midi_vw_release_scheduled(void);
+static void midi_vw_release_delayed(void);
+static void midi_vw_pause_routing(void);
+static void midi_vw_resume_routing(void);
+static void midi_vw_stat_add(uint32_t *counter, uint32_t value);
+static void *midi_vw_worker_main(void *arg);
+static void midi_vw_wake_worker(uint8_t slot, uint32_t backlog);
+static uint64_t midi_vw_get_time(void);
 
 midi_vw_status_t midi_vw_init(midi_vw_callbacks_t *callbacks)
 {
@@ -35,11 +122,22 @@ midi_vw_status_t midi_vw_init(midi_vw_callbacks_t *callbacks)
     }
 
     memset(&midi_vw_system, 0, sizeof(midi_vw_system));
+    midi_time_init();
     
     if (callbacks) {
         midi_vw_system.callbacks = *callbacks;
     }
 
+    memset(midi_vw_system.device_slots, MIDI_VW_MAX_DEVICES, sizeof(midi_vw_system.device_slots));
+    for (uint8_t i = 0; i < MIDI_VW_MAX_DEVICES; i++) {
+        midi_vw_system.free_ports[i] = MIDI_VW_MAX_DEVICES - 1 - i;
+    }
+    midi_vw_system.free_port_count = MIDI_VW_MAX_DEVICES;
+    midi_vw_reset_connections();
+    midi_wheel_init(&midi_vw_system.scheduler, midi_vw_get_time());
+    midi_vw_system.scheduler_wake_time = UINT64_MAX;
+    midi_sysex_arena_init(&midi_vw_system.sysex_arena);
+
     midi_vw_system.next_device_id = 1;
     midi_vw_system.next_connection_id = 1;
     midi_vw_system.initialized = true;
@@ -54,6 +152,7 @@ midi_vw_status_t midi_vw_deinit(void)
     }
 
     midi_vw_stop();
+    midi_vw_stop_workers();
     memset(&midi_vw_system, 0, sizeof(midi_vw_system));
     
     return MIDI_VW_SUCCESS;
@@ -66,8 +165,6 @@ midi_vw_status_t midi_vw_start(void)
     }
 
     midi_vw_system.running = true;
-    midi_vw_system.system_time = 0;
-    
     return MIDI_VW_SUCCESS;
 }
 
@@ -88,25 +185,41 @@ midi_vw_status_t midi_vw_register_device(const char *name, bool is_input, bool i
         return MIDI_VW_ERROR_INVALID_PARAM;
     }
 
-    if (midi_vw_system.device_count >= MIDI_VW_MAX_DEVICES) {
+    if (midi_vw_system.free_port_count == 0) {
+        return MIDI_VW_ERROR_MAX_DEVICES_REACHED;
+    }
+
+    uint8_t id = midi_vw_allocate_id(&midi_vw_system.next_device_id, midi_vw_system.device_slots,
+                                     MIDI_VW_MAX_DEVICES);
+    if (id == 0) {
         return MIDI_VW_ERROR_MAX_DEVICES_REACHED;
     }
 
-    uint8_t slot = midi_vw_system.device_count;
+    uint8_t slot = midi_vw_system.free_ports[--midi_vw_system.free_port_count];
     midi_vw_port_t *port = &midi_vw_system.ports[slot];
     
     memset(port, 0, sizeof(midi_vw_port_t));
     
-    port->device.device_id = midi_vw_system.next_device_id++;
+    port->device.device_id = id;
     strncpy(port->device.name, name, MIDI_VW_DEVICE_NAME_LENGTH - 1);
     port->device.name[MIDI_VW_DEVICE_NAME_LENGTH - 1] = '\0';
     port->device.state = MIDI_VW_DEVICE_STATE_CONNECTED;
     port->device.is_input = is_input;
     port->device.is_output = is_output;
     port->device.last_activity = midi_vw_get_time();
-    port->active = true;
+    midi_histogram_reset(&midi_vw_system.port_latency[slot]);
+    midi_histogram_reset(&midi_vw_system.port_wait[slot]);
+    midi_ring_init(&port->rx_buffer.ring, MIDI_VW_MESSAGE_BUFFER_SIZE);
+    midi_ring_init(&port->tx_buffer.ring, MIDI_VW_MESSAGE_BUFFER_SIZE);
+    midi_ring_init(&port->delay_buffer.ring, MIDI_VW_DELAY_LINE_SIZE);
+    port->rx_buffer.write_time = port->rx_buffer.read_time = port->device.last_activity;
+    port->tx_buffer.write_time = port->tx_buffer.read_time = port->device.last_activity;
+    port->delay_buffer.write_time = port->delay_buffer.read_time = port->device.last_activity;
+    port->tx_buffer.enqueue_times = port->tx_enqueue_times;
+    __atomic_store_n(&port->active, true, __ATOMIC_RELEASE);
     
     *device_id = port->device.device_id;
+    midi_vw_system.device_slots[id] = slot;
     midi_vw_system.device_count++;
 
     if (midi_vw_system.callbacks.device_callback) {
@@ -127,25 +240,40 @@ midi_vw_status_t midi_vw_unregister_device(uint8_t device_id)
         return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
     }
 
-    midi_vw_port_t *port = &midi_vw_system.ports[slot];
-    
-    for (uint8_t i = 0; i < midi_vw_system.connection_count; i++) {
-        if (midi_vw_system.connections[i].source_device_id == device_id ||
-            midi_vw_system.connections[i].dest_device_id == device_id) {
-            midi_vw_remove_connection(midi_vw_system.connections[i].connection_id);
+    midi_vw_pause_routing();
+
+    for (uint8_t i = 0; i < MIDI_VW_MAX_CONNECTIONS; i++) {
+        midi_vw_connection_t *connection = &midi_vw_system.connections[i];
+        if (connection->connection_id != 0 &&
+            (connection->source_device_id == device_id || connection->dest_device_id == device_id)) {
+            midi_vw_release_connection(i);
         }
     }
 
+    midi_vw_rebuild_routes();
+    midi_vw_resume_routing();
+
     if (midi_vw_system.callbacks.device_callback) {
         midi_vw_system.callbacks.device_callback(device_id, MIDI_VW_DEVICE_STATE_DISCONNECTED);
     }
 
-    for (uint8_t i = slot; i < midi_vw_system.device_count - 1; i++) {
-        midi_vw_system.ports[i] = midi_vw_system.ports[i + 1];
+    midi_vw_port_t *port = &midi_vw_system.ports[slot];
+
+    midi_vw_source_claim(slot);
+    __atomic_store_n(&port->active, false, __ATOMIC_RELEASE);
+    midi_vw_system.device_slots[device_id] = MIDI_VW_MAX_DEVICES;
+    midi_vw_buffer_discard(&port->rx_buffer);
+    midi_vw_tx_lock(slot);
+    midi_vw_buffer_discard(&port->delay_buffer);
+    midi_vw_buffer_discard(&port->tx_buffer);
+    midi_vw_tx_unlock(slot);
+    if (port->sysex_in_open) {
+        midi_sysex_arena_release(&midi_vw_system.sysex_arena, port->sysex_in_handle);
+        port->sysex_in_open = false;
     }
-    
+    midi_vw_system.free_ports[midi_vw_system.free_port_count++] = slot;
     midi_vw_system.device_count--;
-    memset(&midi_vw_system.ports[midi_vw_system.device_count], 0, sizeof(midi_vw_port_t));
+    midi_vw_source_release(slot);
 
     return MIDI_VW_SUCCESS;
 }
@@ -186,6 +314,28 @@ midi_vw_status_t midi_vw_set_device_state(uint8_t device_id, midi_vw_device_stat
     return MIDI_VW_SUCCESS;
 }
 
+midi_vw_status_t midi_vw_set_output_delay(uint8_t device_id, uint32_t delay_us)
+{
+    if (!midi_vw_system.initialized) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
+    }
+
+    if (delay_us > MIDI_VW_MAX_OUTPUT_DELAY_US) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    uint8_t slot = midi_vw_find_device(device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
+
+    midi_vw_tx_lock(slot);
+    midi_vw_system.ports[slot].device.output_delay_us = delay_us;
+    midi_vw_tx_unlock(slot);
+
+    return MIDI_VW_SUCCESS;
+}
+
 midi_vw_status_t midi_vw_create_connection(uint8_t source_device_id, uint8_t dest_device_id, 
                                           uint8_t source_channel, uint8_t dest_channel,
                                           midi_vw_filter_t filter, uint8_t *connection_id)
@@ -194,7 +344,7 @@ midi_vw_status_t midi_vw_create_connection(uint8_t source_device_id, uint8_t des
         return MIDI_VW_ERROR_INVALID_PARAM;
     }
 
-    if (midi_vw_system.connection_count >= MIDI_VW_MAX_CONNECTIONS) {
+    if (midi_vw_system.free_connection_count == 0) {
         return MIDI_VW_ERROR_MAX_CONNECTIONS_REACHED;
     }
 
@@ -203,8 +353,9 @@ midi_vw_status_t midi_vw_create_connection(uint8_t source_device_id, uint8_t des
         return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
     }
 
-    for (uint8_t i = 0; i < midi_vw_system.connection_count; i++) {
-        if (midi_vw_system.connections[i].source_device_id == source_device_id &&
+    for (uint8_t i = 0; i < MIDI_VW_MAX_CONNECTIONS; i++) {
+        if (midi_vw_system.connections[i].connection_id != 0 &&
+            midi_vw_system.connections[i].source_device_id == source_device_id &&
             midi_vw_system.connections[i].dest_device_id == dest_device_id &&
             midi_vw_system.connections[i].source_channel == source_channel &&
             midi_vw_system.connections[i].dest_channel == dest_channel) {
@@ -212,20 +363,36 @@ midi_vw_status_t midi_vw_create_connection(uint8_t source_device_id, uint8_t des
         }
     }
 
-    midi_vw_connection_t *connection = &midi_vw_system.connections[midi_vw_system.connection_count];
+    uint8_t id = midi_vw_allocate_id(&midi_vw_system.next_connection_id, midi_vw_system.connection_slots,
+                                     MIDI_VW_MAX_CONNECTIONS);
+    if (id == 0) {
+        return MIDI_VW_ERROR_MAX_CONNECTIONS_REACHED;
+    }
+
+    uint8_t slot = midi_vw_system.free_connections[--midi_vw_system.free_connection_count];
+    midi_vw_connection_t *connection = &midi_vw_system.connections[slot];
     memset(connection, 0, sizeof(midi_vw_connection_t));
+    midi_histogram_reset(&midi_vw_system.connection_latency[slot]);
     
-    connection->connection_id = midi_vw_system.next_connection_id++;
+    connection->connection_id = id;
     connection->source_device_id = source_device_id;
     connection->dest_device_id = dest_device_id;
     connection->source_channel = source_channel;
     connection->dest_channel = dest_channel;
     connection->filter = filter;
     connection->enabled = true;
+    connection->cut_through = filter == MIDI_VW_FILTER_NONE && source_channel == 0xFF && dest_channel == 0xFF &&
+                              !midi_vw_system.callbacks.filter_callback;
+    midi_vw_build_filter_mask(connection);
 
     *connection_id = connection->connection_id;
+    midi_vw_system.connection_slots[id] = slot;
     midi_vw_system.connection_count++;
 
+    midi_vw_pause_routing();
+    midi_vw_rebuild_routes();
+    midi_vw_resume_routing();
+
     return MIDI_VW_SUCCESS;
 }
 
@@ -240,12 +407,10 @@ midi_vw_status_t midi_vw_remove_connection(uint8_t connection_id)
         return MIDI_VW_ERROR_CONNECTION_NOT_FOUND;
     }
 
-    for (uint8_t i = slot; i < midi_vw_system.connection_count - 1; i++) {
-        midi_vw_system.connections[i] = midi_vw_system.connections[i + 1];
-    }
-    
-    midi_vw_system.connection_count--;
-    memset(&midi_vw_system.connections[midi_vw_system.connection_count], 0, sizeof(midi_vw_connection_t));
+    midi_vw_pause_routing();
+    midi_vw_release_connection(slot);
+    midi_vw_rebuild_routes();
+    midi_vw_resume_routing();
 
     return MIDI_VW_SUCCESS;
 }
@@ -261,7 +426,10 @@ midi_vw_status_t midi_vw_enable_connection(uint8_t connection_id, bool enabled)
         return MIDI_VW_ERROR_CONNECTION_NOT_FOUND;
     }
 
+    midi_vw_pause_routing();
     midi_vw_system.connections[slot].enabled = enabled;
+    midi_vw_rebuild_routes();
+    midi_vw_resume_routing();
     return MIDI_VW_SUCCESS;
 }
 
@@ -286,9 +454,9 @@ midi_vw_status_t midi_vw_connect_all_to_all(void)
         return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    for (uint8_t i = 0; i < midi_vw_system.device_count; i++) {
-        for (uint8_t j = 0; j < midi_vw_system.device_count; j++) {
-            if (i != j) {
+    for (uint8_t i = 0; i < MIDI_VW_MAX_DEVICES; i++) {
+        for (uint8_t j = 0; j < MIDI_VW_MAX_DEVICES; j++) {
+            if (i != j && midi_vw_system.ports[i].active && midi_vw_system.ports[j].active) {
                 uint8_t source_id = midi_vw_system.ports[i].device.device_id;
                 uint8_t dest_id = midi_vw_system.ports[j].device.device_id;
                 
@@ -311,8 +479,10 @@ midi_vw_status_t midi_vw_disconnect_all(void)
         return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    midi_vw_system.connection_count = 0;
-    memset(midi_vw_system.connections, 0, sizeof(midi_vw_system.connections));
+    midi_vw_pause_routing();
+    midi_vw_reset_connections();
+    midi_vw_rebuild_routes();
+    midi_vw_resume_routing();
 
     return MIDI_VW_SUCCESS;
 }
@@ -329,17 +499,11 @@ midi_vw_status_t midi_vw_send_message(uint8_t device_id, midi_message_t *message
     }
 
     midi_vw_port_t *port = &midi_vw_system.ports[slot];
-    if (!port->device.is_output) {
+    if (!port->device.is_output || midi_vw_is_sysex(message)) {
         return MIDI_VW_ERROR_INVALID_PARAM;
     }
 
-    midi_vw_status_t status = midi_vw_buffer_put(&port->tx_buffer, message);
-    if (status == MIDI_VW_SUCCESS) {
-        port->device.messages_sent++;
-        port->device.last_activity = midi_vw_get_time();
-    }
-
-    return status;
+    return midi_vw_port_send(port, message);
 }
 
 midi_vw_status_t midi_vw_receive_message(uint8_t device_id, midi_message_t *message)
@@ -353,12 +517,23 @@ midi_vw_status_t midi_vw_receive_message(uint8_t device_id, midi_message_t *mess
         return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
     }
 
-    return midi_vw_buffer_get(&midi_vw_system.ports[slot].rx_buffer, message);
+    midi_vw_message_buffer_t *tx_buffer = &midi_vw_system.ports[slot].tx_buffer;
+    midi_vw_status_t status = midi_vw_buffer_get(tx_buffer, message);
+    if (status == MIDI_VW_SUCCESS) {
+        // Cut-through egress records from the routing side, under this lock
+        uint64_t now = midi_vw_get_time();
+        midi_vw_tx_lock(slot);
+        midi_histogram_record(&midi_vw_system.port_latency[slot], now - message->timestamp);
+        midi_histogram_record(&midi_vw_system.port_wait[slot], now - tx_buffer->read_enqueue_time);
+        midi_vw_tx_unlock(slot);
+    }
+
+    return status;
 }
 
 midi_vw_status_t midi_vw_inject_message(uint8_t source_device_id, midi_message_t *message)
 {
-    if (!midi_vw_system.initialized || !message) {
+    if (!midi_vw_system.initialized || !message || midi_vw_is_sysex(message)) {
         return MIDI_VW_ERROR_INVALID_PARAM;
     }
 
@@ -366,286 +541,1240 @@ midi_vw_status_t midi_vw_inject_message(uint8_t source_device_id, midi_message_t
         return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    message->timestamp = midi_vw_get_time();
-    midi_vw_route_message(source_device_id, message);
+    uint8_t slot = midi_vw_find_device(source_device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
 
-    return MIDI_VW_SUCCESS;
-}
+    if (message->timestamp == 0) {
+        message->timestamp = midi_vw_get_time();
+    }
 
-bool midi_vw_has_pending_messages(uint8_t device_id)
-{
-    uint8_t slot = midi_vw_find_device(device_id);
-    if (slot >= MIDI_VW_MAX_DEVICES) {
-        return false;
+    if (__atomic_load_n(&midi_vw_system.workers_running, __ATOMIC_ACQUIRE)) {
+        midi_vw_message_buffer_t *rx_buffer = &midi_vw_system.ports[slot].rx_buffer;
+        uint32_t backlog;
+        midi_vw_status_t status = midi_vw_buffer_put(rx_buffer, message, &backlog);
+        if (status == MIDI_VW_SUCCESS) {
+            midi_vw_wake_worker(slot, backlog);
+        }
+        return status;
     }
 
-    return !midi_vw_buffer_is_empty(&midi_vw_system.ports[slot].rx_buffer);
+    midi_vw_route_message(slot, message, MIDI_VW_NO_EVENT);
+
+    return MIDI_VW_SUCCESS;
 }
 
-uint16_t midi_vw_get_pending_count(uint8_t device_id)
+midi_vw_status_t midi_vw_set_event_sink(uint8_t device_id, midi_vw_event_sink_t sink, void *context)
 {
+    if (!midi_vw_system.initialized) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
+    }
+
     uint8_t slot = midi_vw_find_device(device_id);
     if (slot >= MIDI_VW_MAX_DEVICES) {
-        return 0;
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
     }
 
-    return midi_vw_system.ports[slot].rx_buffer.count;
+    midi_vw_port_t *port = &midi_vw_system.ports[slot];
+    midi_vw_tx_lock(slot);
+    port->event_sink = sink;
+    port->event_sink_context = context;
+    midi_vw_tx_unlock(slot);
+
+    return MIDI_VW_SUCCESS;
 }
 
-midi_vw_status_t midi_vw_process_messages(void)
+midi_vw_status_t midi_vw_forward_event(uint8_t source_device_id, uint32_t event)
 {
-    if (!midi_vw_system.initialized || !midi_vw_system.running) {
+    midi_message_t message;
+    midi_unpack_message(event, &message);
+
+    if (!midi_vw_system.initialized || message.status < 0x80 ||
+        message.status == MIDI_MSG_SYSTEM_EXCLUSIVE || message.status == MIDI_MSG_END_SYSEX) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    if (!midi_vw_system.running) {
         return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    midi_vw_system.system_time++;
+    uint8_t slot = midi_vw_find_device(source_device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
 
-    for (uint8_t i = 0; i < midi_vw_system.device_count; i++) {
-        midi_vw_port_t *port = &midi_vw_system.ports[i];
-        
-        if (!port->active || !port->device.is_input) {
-            continue;
+    message.timestamp = midi_vw_get_time();
+
+    // With workers running, the event may only be routed here while none of
+    // the source's earlier input is still queued for them
+    midi_vw_message_buffer_t *rx_buffer = &midi_vw_system.ports[slot].rx_buffer;
+    bool workers = __atomic_load_n(&midi_vw_system.workers_running, __ATOMIC_ACQUIRE);
+    if (workers && (!midi_vw_buffer_is_empty(rx_buffer) || !midi_vw_source_try_claim(slot))) {
+        uint32_t backlog;
+        midi_vw_status_t status = midi_vw_buffer_put(rx_buffer, &message, &backlog);
+        if (status == MIDI_VW_SUCCESS) {
+            midi_vw_wake_worker(slot, backlog);
         }
+        return status;
+    }
 
-        midi_message_t message;
-        while (midi_vw_buffer_get(&port->rx_buffer, &message) == MIDI_VW_SUCCESS) {
-            port->device.messages_received++;
-            port->device.last_activity = midi_vw_get_time();
-            
-            if (midi_vw_system.callbacks.message_callback) {
-                midi_vw_system.callbacks.message_callback(port->device.device_id, &message);
-            }
+    midi_vw_route_message(slot, &message, event);
 
-            midi_vw_route_message(port->device.device_id, &message);
-        }
+    if (workers) {
+        midi_vw_source_release(slot);
     }
 
     return MIDI_VW_SUCCESS;
 }
 
-uint8_t midi_vw_get_device_count(void)
+midi_vw_status_t midi_vw_inject_sysex(uint8_t source_device_id, const uint8_t *data, uint32_t length,
+                                      uint64_t timestamp)
 {
-    return midi_vw_system.device_count;
-}
+    if (!midi_vw_system.initialized || (!data && length > 0)) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
 
-uint8_t midi_vw_get_connection_count(void)
-{
-    return midi_vw_system.connection_count;
+    if (!midi_vw_system.running) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
+    }
+
+    uint8_t slot = midi_vw_find_device(source_device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
+
+    uint16_t handle;
+    if (!midi_sysex_arena_alloc(&midi_vw_system.sysex_arena, data, length, &handle)) {
+        return MIDI_VW_ERROR_BUFFER_FULL;
+    }
+
+    return midi_vw_route_sysex(slot, handle, timestamp);
 }
 
-midi_vw_status_t midi_vw_list_devices(uint8_t *device_ids, uint8_t max_devices, uint8_t *count)
+midi_vw_status_t midi_vw_append_sysex(uint8_t source_device_id, const uint8_t *data, uint32_t length, bool last,
+                                      uint64_t timestamp)
 {
-    if (!midi_vw_system.initialized || !device_ids || !count) {
+    if (!midi_vw_system.initialized || (!data && length > 0)) {
         return MIDI_VW_ERROR_INVALID_PARAM;
     }
 
-    *count = 0;
-    for (uint8_t i = 0; i < midi_vw_system.device_count && *count < max_devices; i++) {
-        device_ids[*count] = midi_vw_system.ports[i].device.device_id;
-        (*count)++;
+    if (!midi_vw_system.running) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    return MIDI_VW_SUCCESS;
+    uint8_t slot = midi_vw_find_device(source_device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
+
+    midi_vw_port_t *port = &midi_vw_system.ports[slot];
+    midi_vw_status_t status = MIDI_VW_SUCCESS;
+
+    if (port->sysex_in_dropped) {
+        status = MIDI_VW_ERROR_BUFFER_FULL;
+    } else if (!port->sysex_in_open) {
+        if (midi_sysex_arena_alloc(&midi_vw_system.sysex_arena, data, length, &port->sysex_in_handle)) {
+            port->sysex_in_open = true;
+        } else {
+            status = MIDI_VW_ERROR_BUFFER_FULL;
+        }
+    } else if (!midi_sysex_arena_append(&midi_vw_system.sysex_arena, &port->sysex_in_handle, data, length)) {
+        midi_sysex_arena_release(&midi_vw_system.sysex_arena, port->sysex_in_handle);
+        port->sysex_in_open = false;
+        status = MIDI_VW_ERROR_BUFFER_FULL;
+    }
+
+    if (last) {
+        port->sysex_in_dropped = false;
+        if (port->sysex_in_open) {
+            port->sysex_in_open = false;
+            return midi_vw_route_sysex(slot, port->sysex_in_handle, timestamp);
+        }
+    } else if (status != MIDI_VW_SUCCESS) {
+        port->sysex_in_dropped = true;
+    }
+
+    return status;
 }
 
-midi_vw_status_t midi_vw_list_connections(uint8_t *connection_ids, uint8_t max_connections, uint8_t *count)
+midi_vw_status_t midi_vw_get_sysex(const midi_message_t *message, const uint8_t **data, uint32_t *length)
 {
-    if (!midi_vw_system.initialized || !connection_ids || !count) {
+    if (!midi_vw_system.initialized || !message || !data || !length || !midi_vw_is_sysex(message)) {
         return MIDI_VW_ERROR_INVALID_PARAM;
     }
 
-    *count = 0;
-    for (uint8_t i = 0; i < midi_vw_system.connection_count && *count < max_connections; i++) {
-        connection_ids[*count] = midi_vw_system.connections[i].connection_id;
-        (*count)++;
+    *data = midi_sysex_arena_data(&midi_vw_system.sysex_arena, midi_vw_sysex_handle(message), length);
+    return *data ? MIDI_VW_SUCCESS : MIDI_VW_ERROR_NO_DATA;
+}
+
+midi_vw_status_t midi_vw_release_sysex(midi_message_t *message)
+{
+    if (!midi_vw_system.initialized || !message || !midi_vw_is_sysex(message)) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
     }
 
+    midi_sysex_arena_release(&midi_vw_system.sysex_arena, midi_vw_sysex_handle(message));
+    message->status = 0;
     return MIDI_VW_SUCCESS;
 }
 
-midi_vw_status_t midi_vw_get_statistics(uint32_t *total_messages, uint32_t *total_errors, uint32_t *total_filtered)
+midi_vw_status_t midi_vw_get_sysex_statistics(uint32_t *free_blocks, uint32_t *exhausted)
 {
     if (!midi_vw_system.initialized) {
         return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    if (total_messages) *total_messages = midi_vw_system.total_messages;
-    if (total_errors) *total_errors = midi_vw_system.total_errors;
-    if (total_filtered) *total_filtered = midi_vw_system.total_filtered;
+    if (free_blocks) {
+        *free_blocks = midi_sysex_arena_free_blocks(&midi_vw_system.sysex_arena);
+    }
+    if (exhausted) {
+        *exhausted = __atomic_load_n(&midi_vw_system.sysex_arena.exhausted, __ATOMIC_RELAXED);
+    }
 
     return MIDI_VW_SUCCESS;
 }
 
-midi_vw_status_t midi_vw_reset_statistics(void)
+midi_vw_status_t midi_vw_schedule_message(uint8_t source_device_id, midi_message_t *message,
+                                          uint64_t delivery_time)
 {
-    if (!midi_vw_system.initialized) {
+    if (!midi_vw_system.initialized || !message || midi_vw_is_sysex(message)) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    if (!midi_vw_system.running) {
         return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    midi_vw_system.total_messages = 0;
-    midi_vw_system.total_errors = 0;
-    midi_vw_system.total_filtered = 0;
+    uint8_t slot = midi_vw_find_device(source_device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
 
-    for (uint8_t i = 0; i < midi_vw_system.device_count; i++) {
-        midi_vw_system.ports[i].device.messages_received = 0;
-        midi_vw_system.ports[i].device.messages_sent = 0;
-        midi_vw_system.ports[i].device.errors = 0;
-        midi_vw_system.ports[i].rx_buffer.overruns = 0;
-        midi_vw_system.ports[i].tx_buffer.overruns = 0;
+    uint64_t payload = midi_pack_message(message) | ((uint64_t)slot << 32) |
+                       ((uint64_t)source_device_id << 40);
+    bool wake = false;
+
+    midi_vw_lock(&midi_vw_system.scheduler_lock);
+    bool queued = midi_wheel_insert(&midi_vw_system.scheduler, delivery_time, payload);
+    if (queued && delivery_time < midi_vw_system.scheduler_wake_time) {
+        midi_vw_system.scheduler_wake_time = delivery_time;
+        wake = true;
     }
+    midi_vw_unlock(&midi_vw_system.scheduler_lock);
 
-    for (uint8_t i = 0; i < midi_vw_system.connection_count; i++) {
-        midi_vw_system.connections[i].messages_routed = 0;
-        midi_vw_system.connections[i].messages_filtered = 0;
+    if (!queued) {
+        return MIDI_VW_ERROR_BUFFER_FULL;
+    }
+
+    if (wake && midi_vw_system.callbacks.wakeup_callback) {
+        midi_vw_system.callbacks.wakeup_callback();
     }
 
     return MIDI_VW_SUCCESS;
 }
 
-static midi_vw_status_t midi_vw_buffer_put(midi_vw_message_buffer_t *buffer, midi_message_t *message)
+uint64_t midi_vw_get_next_delivery_time(void)
 {
-    if (midi_vw_buffer_is_full(buffer)) {
-        buffer->overruns++;
-        return MIDI_VW_ERROR_BUFFER_FULL;
+    if (!midi_vw_system.initialized) {
+        return UINT64_MAX;
     }
 
-    buffer->messages[buffer->head] = *message;
-    buffer->head = (buffer->head + 1) % MIDI_VW_MESSAGE_BUFFER_SIZE;
-    buffer->count++;
-    
-    return MIDI_VW_SUCCESS;
-}
+    midi_vw_lock(&midi_vw_system.scheduler_lock);
+    uint64_t next = midi_wheel_next_deadline(&midi_vw_system.scheduler);
+    midi_vw_system.scheduler_wake_time = next;
+    midi_vw_unlock(&midi_vw_system.scheduler_lock);
 
-static midi_vw_status_t midi_vw_buffer_get(midi_vw_message_buffer_t *buffer, midi_message_t *message)
-{
-    if (midi_vw_buffer_is_empty(buffer)) {
-        return MIDI_VW_ERROR_NO_DATA;
+    for (uint8_t slot = 0; slot < MIDI_VW_MAX_DEVICES; slot++) {
+        midi_vw_port_t *port = &midi_vw_system.ports[slot];
+        if (!__atomic_load_n(&port->active, __ATOMIC_ACQUIRE) || midi_vw_buffer_is_empty(&port->delay_buffer)) {
+            continue;
+        }
+
+        uint64_t release_time;
+        midi_vw_tx_lock(slot);
+        if (midi_vw_buffer_next_time(&port->delay_buffer, &release_time) && release_time < next) {
+            next = release_time;
+        }
+        midi_vw_tx_unlock(slot);
     }
 
-    *message = buffer->messages[buffer->tail];
-    buffer->tail = (buffer->tail + 1) % MIDI_VW_MESSAGE_BUFFER_SIZE;
-    buffer->count--;
-    
-    return MIDI_VW_SUCCESS;
+    return next;
 }
 
-static bool midi_vw_buffer_is_empty(midi_vw_message_buffer_t *buffer)
+bool midi_vw_has_pending_messages(uint8_t device_id)
 {
-    return buffer->count == 0;
+    uint8_t slot = midi_vw_find_device(device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return false;
+    }
+
+    return !midi_vw_buffer_is_empty(&midi_vw_system.ports[slot].tx_buffer);
 }
 
-static bool midi_vw_buffer_is_full(midi_vw_message_buffer_t *buffer)
+uint16_t midi_vw_get_pending_count(uint8_t device_id)
 {
-    return buffer->count >= MIDI_VW_MESSAGE_BUFFER_SIZE;
+    uint8_t slot = midi_vw_find_device(device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return 0;
+    }
+
+    return midi_ring_count(&midi_vw_system.ports[slot].tx_buffer.ring);
 }
 
-static uint8_t midi_vw_find_device(uint8_t device_id)
+midi_vw_status_t midi_vw_process_messages(void)
 {
-    for (uint8_t i = 0; i < midi_vw_system.device_count; i++) {
-        if (midi_vw_system.ports[i].device.device_id == device_id) {
-            return i;
-        }
+    if (!midi_vw_system.initialized || !midi_vw_system.running) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
+    }
+
+    midi_vw_release_scheduled();
+    midi_vw_release_delayed();
+
+    if (__atomic_load_n(&midi_vw_system.workers_running, __ATOMIC_ACQUIRE)) {
+        return MIDI_VW_SUCCESS;
+    }
+
+    for (uint8_t i = 0; i < MIDI_VW_MAX_DEVICES; i++) {
+        midi_vw_drain_source(i, UINT32_MAX);
     }
-    return MIDI_VW_MAX_DEVICES;
+
+    return MIDI_VW_SUCCESS;
 }
 
-static uint8_t midi_vw_find_connection(uint8_t connection_id)
+midi_vw_status_t midi_vw_start_workers(uint8_t worker_count)
 {
-    for (uint8_t i = 0; i < midi_vw_system.connection_count; i++) {
-        if (midi_vw_system.connections[i].connection_id == connection_id) {
-            return i;
+    if (!midi_vw_system.initialized) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
+    }
+
+    if (worker_count == 0 || worker_count > MIDI_VW_MAX_WORKERS) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    if (__atomic_load_n(&midi_vw_system.worker_count, __ATOMIC_ACQUIRE) > 0) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    // Workers idle until workers_running is published, which happens only
+    // once all of them exist and worker_count covers every shard
+    __atomic_store_n(&midi_vw_system.workers_stopping, false, __ATOMIC_RELAXED);
+
+    uint8_t created = 0;
+    for (; created < worker_count; created++) {
+        midi_vw_worker_t *worker = &midi_vw_system.workers[created];
+        memset(&worker->stats, 0, sizeof(worker->stats));
+        worker->index = created;
+        rtos_event_init(&worker->wakeup);
+
+        if (pthread_create(&worker->thread, NULL, midi_vw_worker_main, worker) != 0) {
+            rtos_event_destroy(&worker->wakeup);
+            break;
         }
     }
-    return MIDI_VW_MAX_CONNECTIONS;
+
+    __atomic_store_n(&midi_vw_system.worker_count, created, __ATOMIC_RELEASE);
+
+    if (created < worker_count) {
+        midi_vw_stop_workers();
+        return MIDI_VW_ERROR_WORKER_FAILED;
+    }
+
+    __atomic_store_n(&midi_vw_system.workers_running, true, __ATOMIC_RELEASE);
+
+    for (uint8_t i = 0; i < worker_count; i++) {
+        rtos_event_signal(&midi_vw_system.workers[i].wakeup);
+    }
+
+    return MIDI_VW_SUCCESS;
 }
 
-static bool midi_vw_should_filter_message(midi_vw_connection_t *connection, midi_message_t *message)
+midi_vw_status_t midi_vw_stop_workers(void)
 {
-    if (connection->filter == MIDI_VW_FILTER_NONE) {
-        return false;
+    if (!midi_vw_system.initialized) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
     }
 
-    uint8_t message_type = message->status & 0xF0;
-    uint8_t channel = message->status & 0x0F;
+    __atomic_store_n(&midi_vw_system.workers_running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&midi_vw_system.workers_stopping, true, __ATOMIC_RELEASE);
 
-    if (connection->source_channel != 0xFF && channel != connection->source_channel) {
-        return true;
+    uint8_t worker_count = __atomic_load_n(&midi_vw_system.worker_count, __ATOMIC_ACQUIRE);
+    for (uint8_t i = 0; i < worker_count; i++) {
+        rtos_event_signal(&midi_vw_system.workers[i].wakeup);
     }
 
-    switch (message_type) {
-        case MIDI_MSG_NOTE_OFF:
-        case MIDI_MSG_NOTE_ON:
-            return (connection->filter & MIDI_VW_FILTER_NOTE) != 0;
-        case MIDI_MSG_CONTROL_CHANGE:
-            return (connection->filter & MIDI_VW_FILTER_CONTROL) != 0;
-        case MIDI_MSG_PROGRAM_CHANGE:
-            return (connection->filter & MIDI_VW_FILTER_PROGRAM) != 0;
-        case MIDI_MSG_PITCH_BEND:
-            return (connection->filter & MIDI_VW_FILTER_PITCH_BEND) != 0;
-        case MIDI_MSG_SYSTEM_EXCLUSIVE:
-            return (connection->filter & MIDI_VW_FILTER_SYSEX) != 0;
-        default:
-            if (message->status >= 0xF8) {
-                return (connection->filter & MIDI_VW_FILTER_REALTIME) != 0;
-            }
-            return false;
+    for (uint8_t i = 0; i < worker_count; i++) {
+        pthread_join(midi_vw_system.workers[i].thread, NULL);
+        rtos_event_destroy(&midi_vw_system.workers[i].wakeup);
     }
+    __atomic_store_n(&midi_vw_system.worker_count, 0, __ATOMIC_RELEASE);
+
+    return MIDI_VW_SUCCESS;
 }
 
-static void midi_vw_route_message(uint8_t source_device_id, midi_message_t *message)
+uint8_t midi_vw_get_worker_count(void)
 {
-    midi_vw_system.total_messages++;
+    return __atomic_load_n(&midi_vw_system.worker_count, __ATOMIC_ACQUIRE);
+}
 
-    for (uint8_t i = 0; i < midi_vw_system.connection_count; i++) {
-        midi_vw_connection_t *connection = &midi_vw_system.connections[i];
-        
-        if (!connection->enabled || connection->source_device_id != source_device_id) {
-            continue;
-        }
+midi_vw_status_t midi_vw_get_worker_statistics(uint8_t worker_index, midi_vw_worker_stats_t *stats)
+{
+    if (!midi_vw_system.initialized || !stats) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
 
-        if (midi_vw_should_filter_message(connection, message)) {
-            connection->messages_filtered++;
-            midi_vw_system.total_filtered++;
-            continue;
-        }
+    if (worker_index >= __atomic_load_n(&midi_vw_system.worker_count, __ATOMIC_ACQUIRE)) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
 
-        if (midi_vw_system.callbacks.filter_callback) {
-            if (!midi_vw_system.callbacks.filter_callback(source_device_id, 
-                                                         connection->dest_device_id, message)) {
-                connection->messages_filtered++;
-                midi_vw_system.total_filtered++;
+    midi_vw_worker_stats_t *worker_stats = &midi_vw_system.workers[worker_index].stats;
+    stats->messages_processed = __atomic_load_n(&worker_stats->messages_processed, __ATOMIC_RELAXED);
+    stats->sources_stolen = __atomic_load_n(&worker_stats->sources_stolen, __ATOMIC_RELAXED);
+    stats->busy_ns = __atomic_load_n(&worker_stats->busy_ns, __ATOMIC_RELAXED);
+    stats->idle_ns = __atomic_load_n(&worker_stats->idle_ns, __ATOMIC_RELAXED);
+
+    uint64_t total_ns = stats->busy_ns + stats->idle_ns;
+    stats->utilisation_permille = total_ns ? (uint16_t)((stats->busy_ns * 1000) / total_ns) : 0;
+
+    return MIDI_VW_SUCCESS;
+}
+
+uint8_t midi_vw_get_device_count(void)
+{
+    return midi_vw_system.device_count;
+}
+
+uint8_t midi_vw_get_connection_count(void)
+{
+    return midi_vw_system.connection_count;
+}
+
+midi_vw_status_t midi_vw_list_devices(uint8_t *device_ids, uint8_t max_devices, uint8_t *count)
+{
+    if (!midi_vw_system.initialized || !device_ids || !count) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    *count = 0;
+    for (uint8_t i = 0; i < MIDI_VW_MAX_DEVICES && *count < max_devices; i++) {
+        if (midi_vw_system.ports[i].active) {
+            device_ids[*count] = midi_vw_system.ports[i].device.device_id;
+            (*count)++;
+        }
+    }
+
+    return MIDI_VW_SUCCESS;
+}
+
+midi_vw_status_t midi_vw_list_connections(uint8_t *connection_ids, uint8_t max_connections, uint8_t *count)
+{
+    if (!midi_vw_system.initialized || !connection_ids || !count) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    *count = 0;
+    for (uint8_t i = 0; i < MIDI_VW_MAX_CONNECTIONS && *count < max_connections; i++) {
+        if (midi_vw_system.connections[i].connection_id != 0) {
+            connection_ids[*count] = midi_vw_system.connections[i].connection_id;
+            (*count)++;
+        }
+    }
+
+    return MIDI_VW_SUCCESS;
+}
+
+midi_vw_status_t midi_vw_get_statistics(uint32_t *total_messages, uint32_t *total_errors, uint32_t *total_filtered)
+{
+    if (!midi_vw_system.initialized) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
+    }
+
+    if (total_messages) *total_messages = midi_vw_system.total_messages;
+    if (total_errors) *total_errors = midi_vw_system.total_errors;
+    if (total_filtered) *total_filtered = midi_vw_system.total_filtered;
+
+    return MIDI_VW_SUCCESS;
+}
+
+midi_vw_status_t midi_vw_reset_statistics(void)
+{
+    if (!midi_vw_system.initialized) {
+        return MIDI_VW_ERROR_NOT_INITIALIZED;
+    }
+
+    midi_vw_system.total_messages = 0;
+    midi_vw_system.total_errors = 0;
+    midi_vw_system.total_filtered = 0;
+
+    for (uint8_t i = 0; i < MIDI_VW_MAX_DEVICES; i++) {
+        midi_vw_system.ports[i].device.messages_received = 0;
+        midi_vw_system.ports[i].device.messages_sent = 0;
+        midi_vw_system.ports[i].device.errors = 0;
+        midi_vw_system.ports[i].rx_buffer.overruns = 0;
+        midi_vw_system.ports[i].tx_buffer.overruns = 0;
+        midi_vw_system.ports[i].delay_buffer.overruns = 0;
+        midi_histogram_reset(&midi_vw_system.port_latency[i]);
+        midi_histogram_reset(&midi_vw_system.port_wait[i]);
+    }
+
+    uint8_t worker_count = __atomic_load_n(&midi_vw_system.worker_count, __ATOMIC_ACQUIRE);
+    for (uint8_t i = 0; i < worker_count; i++) {
+        memset(&midi_vw_system.workers[i].stats, 0, sizeof(midi_vw_system.workers[i].stats));
+    }
+
+    for (uint8_t i = 0; i < MIDI_VW_MAX_CONNECTIONS; i++) {
+        midi_vw_system.connections[i].messages_routed = 0;
+        midi_vw_system.connections[i].messages_filtered = 0;
+        midi_histogram_reset(&midi_vw_system.connection_latency[i]);
+    }
+
+    return MIDI_VW_SUCCESS;
+}
+
+midi_vw_status_t midi_vw_get_connection_latency(uint8_t connection_id, midi_histogram_summary_t *summary)
+{
+    if (!midi_vw_system.initialized || !summary) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    uint8_t slot = midi_vw_find_connection(connection_id);
+    if (slot >= MIDI_VW_MAX_CONNECTIONS) {
+        return MIDI_VW_ERROR_CONNECTION_NOT_FOUND;
+    }
+
+    midi_histogram_summarize(&midi_vw_system.connection_latency[slot], summary);
+    return MIDI_VW_SUCCESS;
+}
+
+midi_vw_status_t midi_vw_get_port_latency(uint8_t device_id, midi_histogram_summary_t *summary)
+{
+    if (!midi_vw_system.initialized || !summary) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    uint8_t slot = midi_vw_find_device(device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
+
+    midi_histogram_summarize(&midi_vw_system.port_latency[slot], summary);
+    return MIDI_VW_SUCCESS;
+}
+
+midi_vw_status_t midi_vw_get_port_wait(uint8_t device_id, midi_histogram_summary_t *summary)
+{
+    if (!midi_vw_system.initialized || !summary) {
+        return MIDI_VW_ERROR_INVALID_PARAM;
+    }
+
+    uint8_t slot = midi_vw_find_device(device_id);
+    if (slot >= MIDI_VW_MAX_DEVICES) {
+        return MIDI_VW_ERROR_DEVICE_NOT_FOUND;
+    }
+
+    midi_histogram_summarize(&midi_vw_system.port_wait[slot], summary);
+    return MIDI_VW_SUCCESS;
+}
+
+// backlog is the ring occupancy after the put, not counting a time marker
+// written by this call, so a value of 1 means the ring was empty.
+static midi_vw_status_t midi_vw_buffer_put(midi_vw_message_buffer_t *buffer, midi_message_t *message,
+                                           uint32_t *backlog)
+{
+    uint32_t index;
+    uint64_t delta = message->timestamp - buffer->write_time;
+    uint32_t markers = 0;
+
+    if (delta > UINT32_MAX) {
+        if (!midi_ring_write_index(&buffer->ring, &index)) {
+            buffer->overruns++;
+            return MIDI_VW_ERROR_BUFFER_FULL;
+        }
+
+        buffer->words[index] = (uint32_t)(delta >> 32) << 8;
+        buffer->time_deltas[index] = (uint32_t)delta;
+        midi_ring_write_commit(&buffer->ring);
+        buffer->write_time = message->timestamp;
+        delta = 0;
+        markers = 1;
+    }
+
+    if (!midi_ring_write_index(&buffer->ring, &index)) {
+        buffer->overruns++;
+        return MIDI_VW_ERROR_BUFFER_FULL;
+    }
+
+    buffer->words[index] = midi_vw_pack_message(message);
+    buffer->time_deltas[index] = (uint32_t)delta;
+    if (buffer->enqueue_times) {
+        buffer->enqueue_times[index] = midi_vw_get_time();
+    }
+    midi_ring_write_commit(&buffer->ring);
+    buffer->write_time = message->timestamp;
+
+    *backlog = midi_ring_count(&buffer->ring) - markers;
+    return MIDI_VW_SUCCESS;
+}
+
+static midi_vw_status_t midi_vw_buffer_get(midi_vw_message_buffer_t *buffer, midi_message_t *message)
+{
+    return midi_vw_buffer_get_due(buffer, UINT64_MAX, message);
+}
+
+// Returns the head message only if its timestamp is not after now. Time
+// markers ahead of it are consumed either way.
+static midi_vw_status_t midi_vw_buffer_get_due(midi_vw_message_buffer_t *buffer, uint64_t now,
+                                               midi_message_t *message)
+{
+    uint64_t time;
+    if (!midi_vw_buffer_next_time(buffer, &time) || time > now) {
+        return MIDI_VW_ERROR_NO_DATA;
+    }
+
+    uint32_t index;
+    midi_ring_read_index(&buffer->ring, &index);
+    midi_unpack_message(buffer->words[index], message);
+    if (buffer->enqueue_times) {
+        buffer->read_enqueue_time = buffer->enqueue_times[index];
+    }
+    midi_ring_read_commit(&buffer->ring);
+
+    buffer->read_time = time;
+    message->timestamp = time;
+    return MIDI_VW_SUCCESS;
+}
+
+static bool midi_vw_buffer_next_time(midi_vw_message_buffer_t *buffer, uint64_t *time)
+{
+    uint32_t index;
+    while (midi_ring_read_index(&buffer->ring, &index)) {
+        uint32_t word = buffer->words[index];
+        uint64_t delta = buffer->time_deltas[index];
+
+        if ((word & 0x0F) != 0) {
+            *time = buffer->read_time + delta;
+            return true;
+        }
+
+        uint64_t high = (uint64_t)(word >> 8) << 32;
+        if (word & 0x80000000) {
+            high |= 0xFF00000000000000ULL;
+        }
+        buffer->read_time += high | delta;
+        midi_ring_read_commit(&buffer->ring);
+    }
+
+    return false;
+}
+
+static bool midi_vw_buffer_is_empty(midi_vw_message_buffer_t *buffer)
+{
+    return midi_ring_is_empty(&buffer->ring);
+}
+
+// Empties a ring whose port is going away, dropping the arena references
+// held by queued SysEx.
+static void midi_vw_buffer_discard(midi_vw_message_buffer_t *buffer)
+{
+    midi_message_t message;
+    while (midi_vw_buffer_get(buffer, &message) == MIDI_VW_SUCCESS) {
+        if (midi_vw_is_sysex(&message)) {
+            midi_sysex_arena_release(&midi_vw_system.sysex_arena, midi_vw_sysex_handle(&message));
+        }
+    }
+}
+
+static uint32_t midi_vw_pack_message(const midi_message_t *message)
+{
+    if (midi_vw_is_sysex(message)) {
+        return MIDI_VW_SYSEX_CODE_INDEX | ((uint32_t)(message->cable & 0x0F) << 4) |
+               ((uint32_t)MIDI_MSG_SYSTEM_EXCLUSIVE << 8) |
+               ((uint32_t)message->data[0] << 16) | ((uint32_t)message->data[1] << 24);
+    }
+
+    return midi_pack_message(message);
+}
+
+static bool midi_vw_is_sysex(const midi_message_t *message)
+{
+    return message->status == MIDI_MSG_SYSTEM_EXCLUSIVE;
+}
+
+static uint16_t midi_vw_sysex_handle(const midi_message_t *message)
+{
+    return (uint16_t)(message->data[0] | (message->data[1] << 8));
+}
+
+static uint8_t midi_vw_find_device(uint8_t device_id)
+{
+    return midi_vw_system.device_slots[device_id];
+}
+
+static uint8_t midi_vw_find_connection(uint8_t connection_id)
+{
+    return midi_vw_system.connection_slots[connection_id];
+}
+
+static uint8_t midi_vw_allocate_id(uint8_t *next_id, const uint8_t *slots, uint8_t invalid_slot)
+{
+    for (uint16_t attempt = 0; attempt < 255; attempt++) {
+        uint8_t id = (*next_id)++;
+        if (*next_id == 0) {
+            *next_id = 1;
+        }
+        if (id != 0 && slots[id] == invalid_slot) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+static void midi_vw_reset_connections(void)
+{
+    memset(midi_vw_system.connections, 0, sizeof(midi_vw_system.connections));
+    memset(midi_vw_system.connection_slots, MIDI_VW_MAX_CONNECTIONS, sizeof(midi_vw_system.connection_slots));
+    for (uint8_t i = 0; i < MIDI_VW_MAX_CONNECTIONS; i++) {
+        midi_vw_system.free_connections[i] = MIDI_VW_MAX_CONNECTIONS - 1 - i;
+    }
+    midi_vw_system.free_connection_count = MIDI_VW_MAX_CONNECTIONS;
+    midi_vw_system.connection_count = 0;
+}
+
+static void midi_vw_release_connection(uint8_t slot)
+{
+    midi_vw_connection_t *connection = &midi_vw_system.connections[slot];
+
+    midi_vw_system.connection_slots[connection->connection_id] = MIDI_VW_MAX_CONNECTIONS;
+    connection->connection_id = 0;
+    connection->enabled = false;
+    midi_vw_system.free_connections[midi_vw_system.free_connection_count++] = slot;
+    midi_vw_system.connection_count--;
+}
+
+static void midi_vw_build_filter_mask(midi_vw_connection_t *connection)
+{
+    midi_vw_filter_t filter = connection->filter;
+
+    memset(connection->filter_mask, 0, sizeof(connection->filter_mask));
+
+    for (uint16_t status = 0x80; status <= 0xFF; status++) {
+        midi_vw_filter_t type_filter;
+
+        if (status < 0xF0) {
+            if (connection->source_channel != 0xFF && (status & 0x0F) != connection->source_channel) {
                 continue;
             }
+
+            switch (status & 0xF0) {
+                case MIDI_MSG_NOTE_OFF:
+                case MIDI_MSG_NOTE_ON:
+                    type_filter = MIDI_VW_FILTER_NOTE;
+                    break;
+                case MIDI_MSG_POLY_PRESSURE:
+                    type_filter = MIDI_VW_FILTER_POLY_PRESSURE;
+                    break;
+                case MIDI_MSG_CONTROL_CHANGE:
+                    type_filter = MIDI_VW_FILTER_CONTROL;
+                    break;
+                case MIDI_MSG_PROGRAM_CHANGE:
+                    type_filter = MIDI_VW_FILTER_PROGRAM;
+                    break;
+                case MIDI_MSG_CHANNEL_PRESSURE:
+                    type_filter = MIDI_VW_FILTER_CHANNEL_PRESSURE;
+                    break;
+                default:
+                    type_filter = MIDI_VW_FILTER_PITCH_BEND;
+                    break;
+            }
+        } else if (status == MIDI_MSG_SYSTEM_EXCLUSIVE || status == MIDI_MSG_END_SYSEX) {
+            type_filter = MIDI_VW_FILTER_SYSEX;
+        } else if (status >= MIDI_MSG_TIMING_CLOCK) {
+            type_filter = MIDI_VW_FILTER_REALTIME;
+        } else {
+            // System common messages have no filter bit of their own
+            type_filter = MIDI_VW_FILTER_ALL;
+        }
+
+        if ((filter & type_filter) != type_filter) {
+            connection->filter_mask[status >> 5] |= 1u << (status & 0x1F);
+        }
+    }
+}
+
+static bool midi_vw_should_filter_message(midi_vw_connection_t *connection, midi_message_t *message)
+{
+    uint8_t status = message->status;
+    return (connection->filter_mask[status >> 5] & (1u << (status & 0x1F))) == 0;
+}
+
+static void midi_vw_rebuild_routes(void)
+{
+    uint8_t counts[MIDI_VW_MAX_DEVICES] = {0};
+    uint8_t fill[MIDI_VW_MAX_DEVICES];
+    uint8_t source_slots[MIDI_VW_MAX_CONNECTIONS];
+    uint8_t dest_slots[MIDI_VW_MAX_CONNECTIONS];
+
+    for (uint8_t i = 0; i < MIDI_VW_MAX_CONNECTIONS; i++) {
+        midi_vw_connection_t *connection = &midi_vw_system.connections[i];
+
+        source_slots[i] = MIDI_VW_MAX_DEVICES;
+        if (connection->connection_id == 0 || !connection->enabled) {
+            continue;
         }
 
+        uint8_t source_slot = midi_vw_find_device(connection->source_device_id);
         uint8_t dest_slot = midi_vw_find_device(connection->dest_device_id);
-        if (dest_slot >= MIDI_VW_MAX_DEVICES) {
-            midi_vw_system.total_errors++;
+        if (source_slot >= MIDI_VW_MAX_DEVICES || dest_slot >= MIDI_VW_MAX_DEVICES) {
             continue;
         }
 
-        midi_vw_port_t *dest_port = &midi_vw_system.ports[dest_slot];
+        source_slots[i] = source_slot;
+        dest_slots[i] = dest_slot;
+        counts[source_slot]++;
+    }
+
+    midi_vw_system.route_offsets[0] = 0;
+    for (uint8_t slot = 0; slot < MIDI_VW_MAX_DEVICES; slot++) {
+        fill[slot] = midi_vw_system.route_offsets[slot];
+        midi_vw_system.route_offsets[slot + 1] = midi_vw_system.route_offsets[slot] + counts[slot];
+    }
+
+    for (uint8_t i = 0; i < MIDI_VW_MAX_CONNECTIONS; i++) {
+        if (source_slots[i] >= MIDI_VW_MAX_DEVICES) {
+            continue;
+        }
+
+        midi_vw_connection_t *connection = &midi_vw_system.connections[i];
+        midi_vw_route_t *route = &midi_vw_system.routes[fill[source_slots[i]]++];
+
+        route->connection = connection;
+        route->dest_port = &midi_vw_system.ports[dest_slots[i]];
+        route->latency = &midi_vw_system.connection_latency[i];
+        route->dest_channel = connection->dest_channel;
+        route->cut_through = connection->cut_through;
+    }
+}
+
+static midi_vw_status_t midi_vw_port_send(midi_vw_port_t *port, midi_message_t *message)
+{
+    uint8_t slot = (uint8_t)(port - midi_vw_system.ports);
+
+    midi_vw_tx_lock(slot);
+    uint32_t pending = 0;
+    midi_vw_status_t status;
+    uint32_t delay_us = port->device.output_delay_us;
+    if (delay_us > 0 || !midi_vw_buffer_is_empty(&port->delay_buffer)) {
+        midi_message_t delayed = *message;
+        delayed.timestamp = midi_vw_get_time() + (uint64_t)delay_us * 1000;
+        status = midi_vw_buffer_put(&port->delay_buffer, &delayed, &pending);
+    } else {
+        status = midi_vw_buffer_put(&port->tx_buffer, message, &pending);
+    }
+    if (status == MIDI_VW_SUCCESS) {
+        port->device.messages_sent++;
+        port->device.last_activity = midi_vw_get_time();
+    }
+    midi_vw_tx_unlock(slot);
+
+    if (pending == 1 && midi_vw_system.callbacks.wakeup_callback) {
+        midi_vw_system.callbacks.wakeup_callback();
+    }
+
+    return status;
+}
+
+// Takes over the caller's arena reference. With workers running it passes
+// to the rx ring; otherwise the message is routed here.
+static midi_vw_status_t midi_vw_route_sysex(uint8_t slot, uint16_t handle, uint64_t timestamp)
+{
+    midi_message_t message = {
+        .status = MIDI_MSG_SYSTEM_EXCLUSIVE,
+        .data = {(uint8_t)handle, (uint8_t)(handle >> 8), 0},
+        .length = 1,
+        .timestamp = timestamp ? timestamp : midi_vw_get_time()
+    };
+
+    if (__atomic_load_n(&midi_vw_system.workers_running, __ATOMIC_ACQUIRE)) {
+        uint32_t backlog;
+        midi_vw_status_t status = midi_vw_buffer_put(&midi_vw_system.ports[slot].rx_buffer, &message, &backlog);
+        if (status == MIDI_VW_SUCCESS) {
+            midi_vw_wake_worker(slot, backlog);
+        } else {
+            midi_sysex_arena_release(&midi_vw_system.sysex_arena, handle);
+        }
+        return status;
+    }
+
+    midi_vw_route_message(slot, &message, MIDI_VW_NO_EVENT);
+    midi_sysex_arena_release(&midi_vw_system.sysex_arena, handle);
+
+    return MIDI_VW_SUCCESS;
+}
+
+// Hands an event straight to the port's sink if nothing routed earlier is
+// still waiting there; otherwise it has to be queued behind that. The sink
+// taking it is the event's egress.
+static bool midi_vw_port_forward(midi_vw_port_t *port, uint32_t event, uint64_t timestamp)
+{
+    uint8_t slot = (uint8_t)(port - midi_vw_system.ports);
+    bool forwarded = false;
+
+    midi_vw_tx_lock(slot);
+    if (port->event_sink && port->device.output_delay_us == 0 &&
+        midi_vw_buffer_is_empty(&port->tx_buffer) && midi_vw_buffer_is_empty(&port->delay_buffer)) {
+        forwarded = port->event_sink(port->device.device_id, event, port->event_sink_context);
+    }
+    if (forwarded) {
+        uint64_t now = midi_vw_get_time();
+        port->device.messages_sent++;
+        port->device.last_activity = now;
+        midi_histogram_record(&midi_vw_system.port_latency[slot], now - timestamp);
+        midi_histogram_record(&midi_vw_system.port_wait[slot], 0);
+    }
+    midi_vw_tx_unlock(slot);
+
+    return forwarded;
+}
+
+static void midi_vw_route_message(uint8_t source_slot, midi_message_t *message, uint32_t event)
+{
+    midi_vw_stat_add(&midi_vw_system.total_messages, 1);
+
+    uint8_t source_device_id = midi_vw_system.ports[source_slot].device.device_id;
+    uint64_t now = midi_vw_get_time();
+    midi_vw_route_t *route = &midi_vw_system.routes[midi_vw_system.route_offsets[source_slot]];
+    midi_vw_route_t *route_end = &midi_vw_system.routes[midi_vw_system.route_offsets[source_slot + 1]];
+
+    for (; route < route_end; route++) {
+        midi_vw_connection_t *connection = route->connection;
+
+        if (midi_vw_should_filter_message(connection, message)) {
+            connection->messages_filtered++;
+            midi_vw_stat_add(&midi_vw_system.total_filtered, 1);
+            continue;
+        }
+
+        if (midi_vw_system.callbacks.filter_callback) {
+            if (!midi_vw_system.callbacks.filter_callback(source_device_id, 
+                                                         connection->dest_device_id, message)) {
+                connection->messages_filtered++;
+                midi_vw_stat_add(&midi_vw_system.total_filtered, 1);
+                continue;
+            }
+        }
+
+        midi_vw_port_t *dest_port = route->dest_port;
         if (!dest_port->active || !dest_port->device.is_output) {
-            midi_vw_system.total_errors++;
+            midi_vw_stat_add(&midi_vw_system.total_errors, 1);
+            continue;
+        }
+
+        if (event != MIDI_VW_NO_EVENT && route->cut_through &&
+            midi_vw_port_forward(dest_port, event, message->timestamp)) {
+            connection->messages_routed++;
+            midi_histogram_record(route->latency, now - message->timestamp);
             continue;
         }
 
         midi_message_t routed_message = *message;
         
-        if (connection->dest_channel != 0xFF && 
+        if (route->dest_channel != 0xFF && 
             (routed_message.status & 0xF0) != 0xF0) {
-            routed_message.status = (routed_message.status & 0xF0) | (connection->dest_channel & 0x0F);
+            routed_message.status = (routed_message.status & 0xF0) | (route->dest_channel & 0x0F);
         }
 
-        if (midi_vw_send_message(connection->dest_device_id, &routed_message) == MIDI_VW_SUCCESS) {
+        bool sysex = midi_vw_is_sysex(&routed_message);
+        if (sysex) {
+            midi_sysex_arena_retain(&midi_vw_system.sysex_arena, midi_vw_sysex_handle(&routed_message));
+        }
+
+        if (midi_vw_port_send(dest_port, &routed_message) == MIDI_VW_SUCCESS) {
             connection->messages_routed++;
+            midi_histogram_record(route->latency, now - message->timestamp);
         } else {
-            midi_vw_system.total_errors++;
+            if (sysex) {
+                midi_sysex_arena_release(&midi_vw_system.sysex_arena, midi_vw_sysex_handle(&routed_message));
+            }
+            midi_vw_stat_add(&midi_vw_system.total_errors, 1);
+        }
+    }
+}
+
+static uint32_t midi_vw_drain_source(uint8_t slot, uint32_t budget)
+{
+    midi_vw_port_t *port = &midi_vw_system.ports[slot];
+    uint32_t processed = 0;
+
+    if (!__atomic_load_n(&port->active, __ATOMIC_ACQUIRE) || midi_vw_buffer_is_empty(&port->rx_buffer)) {
+        return 0;
+    }
+
+    if (!midi_vw_source_try_claim(slot)) {
+        return 0;
+    }
+
+    if (port->active && port->device.is_input) {
+        midi_message_t message;
+        while (processed < budget &&
+               midi_vw_buffer_get(&port->rx_buffer, &message) == MIDI_VW_SUCCESS) {
+            port->device.messages_received++;
+            port->device.last_activity = midi_vw_get_time();
+            
+            if (midi_vw_system.callbacks.message_callback) {
+                midi_vw_system.callbacks.message_callback(port->device.device_id, &message);
+            }
+
+            midi_vw_route_message(slot, &message, MIDI_VW_NO_EVENT);
+            if (midi_vw_is_sysex(&message)) {
+                midi_sysex_arena_release(&midi_vw_system.sysex_arena, midi_vw_sysex_handle(&message));
+            }
+            processed++;
         }
     }
+
+    midi_vw_source_release(slot);
+    return processed;
+}
+
+static void midi_vw_collect_scheduled(uint64_t payload, uint64_t delivery_time, void *context)
+{
+    midi_vw_release_batch_t *batch = context;
+
+    batch->entries[batch->count].payload = payload;
+    batch->entries[batch->count].delivery_time = delivery_time;
+    batch->count++;
+}
+
+// Moving due messages under the tx lock keeps midi_vw_port_send from
+// overtaking them while the delay line drains.
+static void midi_vw_release_delayed(void)
+{
+    uint64_t now = midi_vw_get_time();
+
+    for (uint8_t slot = 0; slot < MIDI_VW_MAX_DEVICES; slot++) {
+        midi_vw_port_t *port = &midi_vw_system.ports[slot];
+        if (!__atomic_load_n(&port->active, __ATOMIC_ACQUIRE) || midi_vw_buffer_is_empty(&port->delay_buffer)) {
+            continue;
+        }
+
+        midi_message_t message;
+        uint32_t pending = 0;
+        bool wake = false;
+
+        midi_vw_tx_lock(slot);
+        while (midi_vw_buffer_get_due(&port->delay_buffer, now, &message) == MIDI_VW_SUCCESS) {
+            if (midi_vw_buffer_put(&port->tx_buffer, &message, &pending) != MIDI_VW_SUCCESS) {
+                if (midi_vw_is_sysex(&message)) {
+                    midi_sysex_arena_release(&midi_vw_system.sysex_arena, midi_vw_sysex_handle(&message));
+                }
+                midi_vw_stat_add(&midi_vw_system.total_errors, 1);
+            } else if (pending == 1) {
+                wake = true;
+            }
+        }
+        midi_vw_tx_unlock(slot);
+
+        if (wake && midi_vw_system.callbacks.wakeup_callback) {
+            midi_vw_system.callbacks.wakeup_callback();
+        }
+    }
+}
+
+// Due messages are collected under the scheduler lock and routed after it is
+// dropped, so filter callbacks may schedule further messages.
+static void midi_vw_release_scheduled(void)
+{
+    midi_vw_release_batch_t batch;
+    batch.count = 0;
+
+    midi_vw_lock(&midi_vw_system.scheduler_lock);
+    if (midi_wheel_count(&midi_vw_system.scheduler) > 0) {
+        midi_wheel_advance(&midi_vw_system.scheduler, midi_vw_get_time(), midi_vw_collect_scheduled, &batch);
+        midi_vw_system.scheduler_wake_time = midi_wheel_next_deadline(&midi_vw_system.scheduler);
+    }
+    midi_vw_unlock(&midi_vw_system.scheduler_lock);
+
+    for (uint16_t i = 0; i < batch.count; i++) {
+        uint64_t payload = batch.entries[i].payload;
+        uint8_t slot = (uint8_t)(payload >> 32);
+        uint8_t device_id = (uint8_t)(payload >> 40);
+        midi_vw_port_t *port = &midi_vw_system.ports[slot];
+
+        midi_message_t message;
+        midi_unpack_message((uint32_t)payload, &message);
+        message.timestamp = batch.entries[i].delivery_time;
+
+        midi_vw_source_claim(slot);
+        if (port->active && port->device.device_id == device_id && port->device.is_input) {
+            port->device.messages_received++;
+            port->device.last_activity = midi_vw_get_time();
+
+            if (midi_vw_system.callbacks.message_callback) {
+                midi_vw_system.callbacks.message_callback(device_id, &message);
+            }
+
+            midi_vw_route_message(slot, &message, MIDI_VW_NO_EVENT);
+        }
+        midi_vw_source_release(slot);
+    }
+}
+
+// Source claims only matter while router workers are running; without
+// them every routing call happens on the caller's thread.
+static bool midi_vw_source_try_claim(uint8_t slot)
+{
+    if (!__atomic_load_n(&midi_vw_system.workers_running, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+
+    return !__atomic_test_and_set(&midi_vw_system.source_claims[slot], __ATOMIC_ACQUIRE);
+}
+
+static void midi_vw_source_claim(uint8_t slot)
+{
+    while (!midi_vw_source_try_claim(slot)) {
+        sched_yield();
+    }
+}
+
+static void midi_vw_source_release(uint8_t slot)
+{
+    __atomic_clear(&midi_vw_system.source_claims[slot], __ATOMIC_RELEASE);
+}
+
+static void midi_vw_lock(bool *lock)
+{
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void midi_vw_unlock(bool *lock)
+{
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static void midi_vw_tx_lock(uint8_t slot)
+{
+    midi_vw_lock(&midi_vw_system.tx_locks[slot]);
+}
+
+static void midi_vw_tx_unlock(uint8_t slot)
+{
+    midi_vw_unlock(&midi_vw_system.tx_locks[slot]);
+}
+
+// Holding every source claim keeps workers and injectors out of the
+// routing table while the connection graph is being changed.
+static void midi_vw_pause_routing(void)
+{
+    for (uint8_t slot = 0; slot < MIDI_VW_MAX_DEVICES; slot++) {
+        midi_vw_source_claim(slot);
+    }
+}
+
+static void midi_vw_resume_routing(void)
+{
+    for (uint8_t slot = 0; slot < MIDI_VW_MAX_DEVICES; slot++) {
+        midi_vw_source_release(slot);
+    }
+}
+
+static void midi_vw_stat_add(uint32_t *counter, uint32_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void *midi_vw_worker_main(void *arg)
+{
+    midi_vw_worker_t *worker = (midi_vw_worker_t*)arg;
+    uint64_t last = rtos_time_now_ns();
+
+    while (!__atomic_load_n(&midi_vw_system.workers_stopping, __ATOMIC_ACQUIRE)) {
+        if (!__atomic_load_n(&midi_vw_system.workers_running, __ATOMIC_ACQUIRE)) {
+            rtos_event_wait_until(&worker->wakeup, RTOS_WAIT_FOREVER);
+            last = rtos_time_now_ns();
+            continue;
+        }
+
+        uint8_t worker_count = __atomic_load_n(&midi_vw_system.worker_count, __ATOMIC_ACQUIRE);
+        uint32_t processed = 0;
+
+        for (uint8_t slot = worker->index; slot < MIDI_VW_MAX_DEVICES; slot += worker_count) {
+            processed += midi_vw_drain_source(slot, MIDI_VW_WORKER_BATCH_SIZE);
+        }
+
+        if (processed == 0) {
+            uint8_t victim = MIDI_VW_MAX_DEVICES;
+            uint32_t victim_backlog = MIDI_VW_WORKER_STEAL_THRESHOLD - 1;
+
+            for (uint8_t slot = 0; slot < MIDI_VW_MAX_DEVICES; slot++) {
+                if (slot % worker_count == worker->index || !midi_vw_system.ports[slot].active) {
+                    continue;
+                }
+
+                uint32_t backlog = midi_ring_count(&midi_vw_system.ports[slot].rx_buffer.ring);
+                if (backlog > victim_backlog) {
+                    victim = slot;
+                    victim_backlog = backlog;
+                }
+            }
+
+            if (victim < MIDI_VW_MAX_DEVICES) {
+                processed = midi_vw_drain_source(victim, MIDI_VW_WORKER_BATCH_SIZE);
+                if (processed > 0) {
+                    __atomic_fetch_add(&worker->stats.sources_stolen, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+
+        if (processed == 0) {
+            bool pending = false;
+            for (uint8_t slot = worker->index; slot < MIDI_VW_MAX_DEVICES; slot += worker_count) {
+                if (!midi_vw_buffer_is_empty(&midi_vw_system.ports[slot].rx_buffer)) {
+                    pending = true;
+                    break;
+                }
+            }
+
+            if (!pending) {
+                rtos_event_wait_until(&worker->wakeup, RTOS_WAIT_FOREVER);
+            }
+        }
+
+        uint64_t now = rtos_time_now_ns();
+        if (processed > 0) {
+            __atomic_fetch_add(&worker->stats.messages_processed, processed, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&worker->stats.busy_ns, now - last, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&worker->stats.idle_ns, now - last, __ATOMIC_RELAXED);
+        }
+        last = now;
+    }
+
+    return NULL;
+}
+
+// The owning worker is woken when a source's rx ring becomes non-empty; a
+// neighbour is woken as well once the backlog is deep enough to steal from.
+static void midi_vw_wake_worker(uint8_t slot, uint32_t backlog)
+{
+    uint8_t worker_count = __atomic_load_n(&midi_vw_system.worker_count, __ATOMIC_ACQUIRE);
+    if (worker_count == 0) {
+        return;
+    }
+
+    uint8_t owner = slot % worker_count;
+    if (backlog == 1) {
+        rtos_event_signal(&midi_vw_system.workers[owner].wakeup);
+    }
+
+    if (backlog == MIDI_VW_WORKER_STEAL_THRESHOLD && worker_count > 1) {
+        rtos_event_signal(&midi_vw_system.workers[(owner + 1) % worker_count].wakeup);
+    }
 }
 
-static uint32_t midi_vw_get_time(void)
+static uint64_t midi_vw_get_time(void)
 {
-    return midi_vw_system.system_time;
+    return midi_time_now_ns();
 }
\ No newline at end of file
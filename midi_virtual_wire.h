@@ -1,14 +1,34 @@
 #ifndef MIDI_VIRTUAL_WIRE_H
 #define MIDI_VIRTUAL_WIRE_H
 
+#include "config.h"
 #include "midi.h"
+#include "midi_ring.h"
+#include "midi_histogram.h"
+#include "midi_wheel.h"
+#include "midi_sysex_arena.h"
 #include <stdint.h>
 #include <stdbool.h>
 
-#define MIDI_VW_MAX_DEVICES 8
-#define MIDI_VW_MAX_CONNECTIONS 16
-#define MIDI_VW_MESSAGE_BUFFER_SIZE 128
+// Sized by the hub configuration unless overridden on the command line
+#ifndef MIDI_VW_MAX_DEVICES
+#define MIDI_VW_MAX_DEVICES CONFIG_MAX_VW_DEVICES
+#endif
+#ifndef MIDI_VW_MAX_CONNECTIONS
+#define MIDI_VW_MAX_CONNECTIONS CONFIG_MAX_VW_CONNECTIONS
+#endif
+#ifndef MIDI_VW_MESSAGE_BUFFER_SIZE
+#define MIDI_VW_MESSAGE_BUFFER_SIZE CONFIG_VW_MESSAGE_BUFFER_SIZE
+#endif
 #define MIDI_VW_DEVICE_NAME_LENGTH 32
+#define MIDI_VW_FILTER_MASK_WORDS (256 / 32)
+#define MIDI_VW_MAX_WORKERS 8
+#define MIDI_VW_WORKER_BATCH_SIZE 32
+#define MIDI_VW_WORKER_STEAL_THRESHOLD 16
+#define MIDI_VW_MAX_OUTPUT_DELAY_US 50000
+#define MIDI_VW_MAX_MESSAGE_RATE 4000
+#define MIDI_VW_DELAY_LINE_SIZE \
+    MIDI_RING_ROUND_UP_POW2((MIDI_VW_MAX_OUTPUT_DELAY_US * MIDI_VW_MAX_MESSAGE_RATE + 999999UL) / 1000000UL)
 
 typedef enum {
     MIDI_VW_SUCCESS = 0,
@@ -20,7 +40,8 @@ typedef enum {
     MIDI_VW_ERROR_CONNECTION_EXISTS,
     MIDI_VW_ERROR_CONNECTION_NOT_FOUND,
     MIDI_VW_ERROR_BUFFER_FULL,
-    MIDI_VW_ERROR_NO_DATA
+    MIDI_VW_ERROR_NO_DATA,
+    MIDI_VW_ERROR_WORKER_FAILED
 } midi_vw_status_t;
 
 typedef enum {
@@ -38,6 +59,8 @@ typedef enum {
     MIDI_VW_FILTER_PITCH_BEND = 0x08,
     MIDI_VW_FILTER_SYSEX = 0x10,
     MIDI_VW_FILTER_REALTIME = 0x20,
+    MIDI_VW_FILTER_POLY_PRESSURE = 0x40,
+    MIDI_VW_FILTER_CHANNEL_PRESSURE = 0x80,
     MIDI_VW_FILTER_ALL = 0xFF
 } midi_vw_filter_t;
 
@@ -45,10 +68,11 @@ typedef struct {
     uint8_t device_id;
     char name[MIDI_VW_DEVICE_NAME_LENGTH];
     midi_vw_device_state_t state;
-    uint32_t last_activity;
+    uint64_t last_activity;
     uint32_t messages_received;
     uint32_t messages_sent;
     uint32_t errors;
+    uint32_t output_delay_us;
     bool is_input;
     bool is_output;
     uint8_t active_channels;
@@ -61,34 +85,72 @@ typedef struct {
     uint8_t source_channel;
     uint8_t dest_channel;
     midi_vw_filter_t filter;
+    uint32_t filter_mask[MIDI_VW_FILTER_MASK_WORDS];
     bool enabled;
+    bool cut_through;
     uint32_t messages_routed;
     uint32_t messages_filtered;
 } midi_vw_connection_t;
 
+// Messages are stored as packed USB-MIDI words (see midi_pack_message) with a
+// 32-bit nanosecond delta from the previous entry. Larger or negative deltas
+// are carried by a marker entry with code index 0, whose upper 24 word bits
+// are bits 32-55 of a signed delta. Markers occupy a slot and are included in
+// midi_vw_get_pending_count. SysEx references use code index 1 with 0xF0 in
+// the status byte and the arena handle in the data bytes. A buffer given
+// enqueue_times also stamps each message with the clock when it is put,
+// and read_enqueue_time holds the stamp of the last one taken.
 typedef struct {
-    midi_message_t messages[MIDI_VW_MESSAGE_BUFFER_SIZE];
-    uint16_t head;
-    uint16_t tail;
-    uint16_t count;
+    midi_ring_t ring;
+    uint32_t words[MIDI_VW_MESSAGE_BUFFER_SIZE];
+    uint32_t time_deltas[MIDI_VW_MESSAGE_BUFFER_SIZE];
+    uint64_t *enqueue_times;
+    MIDI_RING_CACHE_ALIGNED uint64_t write_time;
     uint32_t overruns;
+    MIDI_RING_CACHE_ALIGNED uint64_t read_time;
+    uint64_t read_enqueue_time;
 } midi_vw_message_buffer_t;
 
+// Takes a short message routed to the port as a packed event word (see
+// midi_pack_message) whose cable bits are still the source's. Returning
+// false leaves it to be queued on the port instead.
+typedef bool (*midi_vw_event_sink_t)(uint8_t device_id, uint32_t event, void *context);
+
+// delay_buffer holds messages routed to a port with an output delay. Its
+// ring is sized for MIDI_VW_MAX_MESSAGE_RATE over MIDI_VW_MAX_OUTPUT_DELAY_US
+// and its timestamps are release times rather than ingest times.
 typedef struct {
     midi_vw_device_t device;
     midi_vw_message_buffer_t rx_buffer;
     midi_vw_message_buffer_t tx_buffer;
+    midi_vw_message_buffer_t delay_buffer;
+    uint64_t tx_enqueue_times[MIDI_VW_MESSAGE_BUFFER_SIZE];
+    midi_vw_event_sink_t event_sink;
+    void *event_sink_context;
+    uint16_t sysex_in_handle;
+    bool sysex_in_open;
+    bool sysex_in_dropped;
     bool active;
 } midi_vw_port_t;
 
+typedef struct {
+    uint32_t messages_processed;
+    uint32_t sources_stolen;
+    uint64_t busy_ns;
+    uint64_t idle_ns;
+    uint16_t utilisation_permille;
+} midi_vw_worker_stats_t;
+
 typedef void (*midi_vw_device_callback_t)(uint8_t device_id, midi_vw_device_state_t state);
 typedef void (*midi_vw_message_callback_t)(uint8_t device_id, midi_message_t *message);
 typedef bool (*midi_vw_filter_callback_t)(uint8_t source_device_id, uint8_t dest_device_id, midi_message_t *message);
+typedef void (*midi_vw_wakeup_callback_t)(void);
 
 typedef struct {
     midi_vw_device_callback_t device_callback;
     midi_vw_message_callback_t message_callback;
     midi_vw_filter_callback_t filter_callback;
+    midi_vw_wakeup_callback_t wakeup_callback;
 } midi_vw_callbacks_t;
 
 midi_vw_status_t midi_vw_init(midi_vw_callbacks_t *callbacks);
@@ -101,6 +163,11 @@ midi_vw_status_t midi_vw_unregister_device(uint8_t device_id);
 midi_vw_status_t midi_vw_get_device_info(uint8_t device_id, midi_vw_device_t *device_info);
 midi_vw_status_t midi_vw_set_device_state(uint8_t device_id, midi_vw_device_state_t state);
 
+// Holds every message routed to the port for delay_us before it reaches the
+// tx buffer, to line up outputs with different internal latencies. Messages
+// leave the delay line stamped with their release time.
+midi_vw_status_t midi_vw_set_output_delay(uint8_t device_id, uint32_t delay_us);
+
 midi_vw_status_t midi_vw_create_connection(uint8_t source_device_id, uint8_t dest_device_id, 
                                           uint8_t source_channel, uint8_t dest_channel,
                                           midi_vw_filter_t filter, uint8_t *connection_id);
@@ -113,19 +180,78 @@ midi_vw_status_t midi_vw_disconnect_all(void);
 
 midi_vw_status_t midi_vw_send_message(uint8_t device_id, midi_message_t *message);
 midi_vw_status_t midi_vw_receive_message(uint8_t device_id, midi_message_t *message);
+// A zero timestamp is replaced with midi_time_now_ns(); any other value is
+// taken as the ingest time and carried through routing unchanged.
 midi_vw_status_t midi_vw_inject_message(uint8_t source_device_id, midi_message_t *message);
 
+// Cut-through for plain MIDI thru. A connection with MIDI_VW_FILTER_NONE,
+// both channels 0xFF and no filter callback is marked cut_through; over it
+// a received event word goes straight to the destination's event sink,
+// unless the port has an output delay or messages already queued. Other
+// routes get the decoded message as from midi_vw_inject_message. Words that
+// do not hold a whole non-SysEx message are refused with
+// MIDI_VW_ERROR_INVALID_PARAM and have to be decoded and injected.
+midi_vw_status_t midi_vw_set_event_sink(uint8_t device_id, midi_vw_event_sink_t sink, void *context);
+midi_vw_status_t midi_vw_forward_event(uint8_t source_device_id, uint32_t event);
+
+// SysEx is routed as a reference into a shared payload arena: a message with
+// status MIDI_MSG_SYSTEM_EXCLUSIVE whose data[0] and data[1] hold the payload
+// handle. Every ring the message is queued on holds its own reference, so a
+// fan-out copies the payload once. midi_vw_get_sysex exposes the payload of a
+// received message, which must then be handed back with
+// midi_vw_release_sysex. An exhausted arena is backpressure: the injection
+// fails with MIDI_VW_ERROR_BUFFER_FULL and is counted, and nothing is queued.
+midi_vw_status_t midi_vw_inject_sysex(uint8_t source_device_id, const uint8_t *data, uint32_t length,
+                                      uint64_t timestamp);
+// Builds a SysEx payload in the arena as it arrives, for messages longer
+// than a receive buffer: chunks are appended until the one marked last,
+// which routes the whole message like midi_vw_inject_sysex. If the arena
+// runs out, the message is dropped and the rest of its chunks are ignored.
+midi_vw_status_t midi_vw_append_sysex(uint8_t source_device_id, const uint8_t *data, uint32_t length, bool last,
+                                      uint64_t timestamp);
+midi_vw_status_t midi_vw_get_sysex(const midi_message_t *message, const uint8_t **data, uint32_t *length);
+midi_vw_status_t midi_vw_release_sysex(midi_message_t *message);
+midi_vw_status_t midi_vw_get_sysex_statistics(uint32_t *free_blocks, uint32_t *exhausted);
+
+// Holds a message until delivery_time on the midi_time_now_ns() clock, then
+// routes it from the source port stamped with that time. Scheduled and
+// output-delayed messages are released by midi_vw_process_messages;
+// midi_vw_get_next_delivery_time returns when it next needs to run, or
+// UINT64_MAX when nothing is waiting.
+midi_vw_status_t midi_vw_schedule_message(uint8_t source_device_id, midi_message_t *message,
+                                          uint64_t delivery_time);
+uint64_t midi_vw_get_next_delivery_time(void);
+
 bool midi_vw_has_pending_messages(uint8_t device_id);
 uint16_t midi_vw_get_pending_count(uint8_t device_id);
 
 midi_vw_status_t midi_vw_process_messages(void);
 
+// Router workers drain source ports on their own threads. While they run,
+// midi_vw_inject_message queues into the source's rx ring instead of routing
+// inline, each source must be fed from a single thread, and message/filter
+// callbacks are invoked on worker threads and must not change the graph.
+midi_vw_status_t midi_vw_start_workers(uint8_t worker_count);
+midi_vw_status_t midi_vw_stop_workers(void);
+uint8_t midi_vw_get_worker_count(void);
+midi_vw_status_t midi_vw_get_worker_statistics(uint8_t worker_index, midi_vw_worker_stats_t *stats);
+
 uint8_t midi_vw_get_device_count(void);
 uint8_t midi_vw_get_connection_count(void);
 midi_vw_status_t midi_vw_list_devices(uint8_t *device_ids, uint8_t max_devices, uint8_t *count);
 midi_vw_status_t midi_vw_list_connections(uint8_t *connection_ids, uint8_t max_connections, uint8_t *count);
 
 midi_vw_status_t midi_vw_get_statistics(uint32_t *total_messages, uint32_t *total_errors, uint32_t *total_filtered);
+
+// Latencies are in nanoseconds from the message's ingest timestamp. A
+// connection records it when the message is queued on the destination port;
+// a port records it when midi_vw_receive_message hands the message out, or,
+// for an event cut through to the port's event sink, when the sink takes
+// it. The port wait is measured on its own, from the message being queued
+// in the port's tx buffer to it being handed out (0 for cut-through).
+midi_vw_status_t midi_vw_get_connection_latency(uint8_t connection_id, midi_histogram_summary_t *summary);
+midi_vw_status_t midi_vw_get_port_latency(uint8_t device_id, midi_histogram_summary_t *summary);
+midi_vw_status_t midi_vw_get_port_wait(uint8_t device_id, midi_histogram_summary_t *summary);
 midi_vw_status_t midi_vw_reset_statistics(void);
 
 #endif
\ No newline at end of file
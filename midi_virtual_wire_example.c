@@ -128,7 +128,7 @@ static void simulate_piano_input(void)
         message.data[0] = note_sequence[sequence_index];
         message.data[1] = 100;
         message.length = 3;
-        message.timestamp = current_time;
+        message.timestamp = 0;
         
         printf("Piano playing note %d\n", note_sequence[sequence_index]);
         midi_vw_inject_message(piano_device_id, &message);
@@ -141,9 +141,7 @@ static void simulate_piano_input(void)
 static void simulate_sequencer_patterns(void)
 {
     static uint32_t beat_counter = 0;
-    static uint32_t current_time = 0;
     
-    current_time++;
     beat_counter++;
     
     if (beat_counter % 500 == 0) {
@@ -153,7 +151,7 @@ static void simulate_sequencer_patterns(void)
         message.data[0] = 36;
         message.data[1] = 127;
         message.length = 3;
-        message.timestamp = current_time;
+        message.timestamp = 0;
         
         printf("Sequencer: Kick drum\n");
         midi_vw_inject_message(sequencer_device_id, &message);
@@ -166,7 +164,7 @@ static void simulate_sequencer_patterns(void)
         message.data[0] = 38;
         message.data[1] = 100;
         message.length = 3;
-        message.timestamp = current_time;
+        message.timestamp = 0;
         
         printf("Sequencer: Snare drum\n");
         midi_vw_inject_message(sequencer_device_id, &message);
@@ -0,0 +1,244 @@
+#include "midi_wheel.h"
+#include <string.h>
+
+#define MIDI_WHEEL_SLOT_MASK (MIDI_WHEEL_SLOTS - 1)
+
+static void midi_wheel_file(midi_wheel_t *wheel, uint16_t node);
+static void midi_wheel_append(midi_wheel_t *wheel, uint8_t level, uint32_t slot, uint16_t node);
+static void midi_wheel_cascade(midi_wheel_t *wheel, uint8_t level, uint32_t slot);
+static void midi_wheel_cascade_base(midi_wheel_t *wheel);
+static uint64_t midi_wheel_next_tick(midi_wheel_t *wheel, uint64_t target);
+static uint32_t midi_wheel_release_slot(midi_wheel_t *wheel, uint64_t now, midi_wheel_expire_t expire, void *context);
+
+void midi_wheel_init(midi_wheel_t *wheel, uint64_t now)
+{
+    memset(wheel->heads, 0xFF, sizeof(wheel->heads));
+    memset(wheel->tails, 0xFF, sizeof(wheel->tails));
+    memset(wheel->level_counts, 0, sizeof(wheel->level_counts));
+
+    for (uint16_t i = 0; i < MIDI_WHEEL_CAPACITY; i++) {
+        wheel->nodes[i].next = (i + 1 < MIDI_WHEEL_CAPACITY) ? i + 1 : MIDI_WHEEL_NIL;
+    }
+
+    wheel->free_head = 0;
+    wheel->count = 0;
+    wheel->base_tick = now >> MIDI_WHEEL_TICK_SHIFT;
+    wheel->base_cascaded = false;
+}
+
+bool midi_wheel_insert(midi_wheel_t *wheel, uint64_t deadline, uint64_t payload)
+{
+    uint16_t node = wheel->free_head;
+    if (node == MIDI_WHEEL_NIL) {
+        return false;
+    }
+
+    wheel->free_head = wheel->nodes[node].next;
+    wheel->nodes[node].deadline = deadline;
+    wheel->nodes[node].payload = payload;
+    wheel->count++;
+
+    midi_wheel_file(wheel, node);
+    return true;
+}
+
+uint32_t midi_wheel_advance(midi_wheel_t *wheel, uint64_t now, midi_wheel_expire_t expire, void *context)
+{
+    uint64_t target = now >> MIDI_WHEEL_TICK_SHIFT;
+    uint32_t released = 0;
+
+    while (true) {
+        if (!wheel->base_cascaded) {
+            midi_wheel_cascade_base(wheel);
+            wheel->base_cascaded = true;
+        }
+
+        if (wheel->base_tick >= target) {
+            break;
+        }
+
+        released += midi_wheel_release_slot(wheel, UINT64_MAX, expire, context);
+        wheel->base_tick = midi_wheel_next_tick(wheel, target);
+        wheel->base_cascaded = false;
+    }
+
+    released += midi_wheel_release_slot(wheel, now, expire, context);
+    return released;
+}
+
+// Returns the earliest pending deadline, or for entries still on an upper
+// level the time they cascade, which is never later than their deadline.
+uint64_t midi_wheel_next_deadline(midi_wheel_t *wheel)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (wheel->count == 0) {
+        return next;
+    }
+
+    if (wheel->level_counts[0] > 0) {
+        for (uint32_t i = 0; i < MIDI_WHEEL_SLOTS; i++) {
+            uint16_t node = wheel->heads[0][(wheel->base_tick + i) & MIDI_WHEEL_SLOT_MASK];
+            if (node == MIDI_WHEEL_NIL) {
+                continue;
+            }
+
+            for (; node != MIDI_WHEEL_NIL; node = wheel->nodes[node].next) {
+                if (wheel->nodes[node].deadline < next) {
+                    next = wheel->nodes[node].deadline;
+                }
+            }
+            break;
+        }
+    }
+
+    for (uint8_t level = 1; level < MIDI_WHEEL_LEVELS; level++) {
+        if (wheel->level_counts[level] == 0) {
+            continue;
+        }
+
+        uint32_t shift = MIDI_WHEEL_SLOT_BITS * level;
+        uint64_t span = 1ULL << (shift + MIDI_WHEEL_SLOT_BITS);
+        uint64_t round = wheel->base_tick & ~(span - 1);
+
+        for (uint32_t slot = 0; slot < MIDI_WHEEL_SLOTS; slot++) {
+            if (wheel->heads[level][slot] == MIDI_WHEEL_NIL) {
+                continue;
+            }
+
+            uint64_t tick = round + ((uint64_t)slot << shift);
+            if (tick < wheel->base_tick || (tick == wheel->base_tick && wheel->base_cascaded)) {
+                tick += span;
+            }
+
+            if ((tick << MIDI_WHEEL_TICK_SHIFT) < next) {
+                next = tick << MIDI_WHEEL_TICK_SHIFT;
+            }
+        }
+    }
+
+    return next;
+}
+
+uint16_t midi_wheel_count(midi_wheel_t *wheel)
+{
+    return wheel->count;
+}
+
+static void midi_wheel_file(midi_wheel_t *wheel, uint16_t node)
+{
+    uint64_t tick = wheel->nodes[node].deadline >> MIDI_WHEEL_TICK_SHIFT;
+    if (tick < wheel->base_tick) {
+        tick = wheel->base_tick;
+    }
+
+    // The level is picked by the highest tick bits that differ from the base,
+    // so all entries for one tick share a list and keep their insertion order
+    // through every cascade
+    uint64_t differ = tick ^ wheel->base_tick;
+    for (uint8_t level = 0; level < MIDI_WHEEL_LEVELS; level++) {
+        uint32_t shift = MIDI_WHEEL_SLOT_BITS * level;
+        if (differ < (1ULL << (shift + MIDI_WHEEL_SLOT_BITS))) {
+            midi_wheel_append(wheel, level, (tick >> shift) & MIDI_WHEEL_SLOT_MASK, node);
+            return;
+        }
+    }
+
+    uint32_t top_shift = MIDI_WHEEL_SLOT_BITS * (MIDI_WHEEL_LEVELS - 1);
+    midi_wheel_append(wheel, MIDI_WHEEL_LEVELS - 1, (tick >> top_shift) & MIDI_WHEEL_SLOT_MASK, node);
+}
+
+static void midi_wheel_append(midi_wheel_t *wheel, uint8_t level, uint32_t slot, uint16_t node)
+{
+    wheel->nodes[node].next = MIDI_WHEEL_NIL;
+
+    if (wheel->tails[level][slot] == MIDI_WHEEL_NIL) {
+        wheel->heads[level][slot] = node;
+    } else {
+        wheel->nodes[wheel->tails[level][slot]].next = node;
+    }
+
+    wheel->tails[level][slot] = node;
+    wheel->level_counts[level]++;
+}
+
+static void midi_wheel_cascade(midi_wheel_t *wheel, uint8_t level, uint32_t slot)
+{
+    uint16_t node = wheel->heads[level][slot];
+
+    wheel->heads[level][slot] = MIDI_WHEEL_NIL;
+    wheel->tails[level][slot] = MIDI_WHEEL_NIL;
+
+    while (node != MIDI_WHEEL_NIL) {
+        uint16_t next = wheel->nodes[node].next;
+        wheel->level_counts[level]--;
+        midi_wheel_file(wheel, node);
+        node = next;
+    }
+}
+
+static void midi_wheel_cascade_base(midi_wheel_t *wheel)
+{
+    for (uint8_t level = 1; level < MIDI_WHEEL_LEVELS; level++) {
+        uint32_t shift = MIDI_WHEEL_SLOT_BITS * level;
+        if (wheel->base_tick & ((1ULL << shift) - 1)) {
+            break;
+        }
+
+        midi_wheel_cascade(wheel, level, (wheel->base_tick >> shift) & MIDI_WHEEL_SLOT_MASK);
+    }
+}
+
+// Ticks on which nothing can be released or cascaded are skipped: with the
+// lowest occupied level at L, the next interesting tick is the next multiple
+// of the level-L slot width.
+static uint64_t midi_wheel_next_tick(midi_wheel_t *wheel, uint64_t target)
+{
+    uint64_t next = target;
+
+    for (uint8_t level = 0; level < MIDI_WHEEL_LEVELS; level++) {
+        if (wheel->level_counts[level] > 0) {
+            uint64_t step = 1ULL << (MIDI_WHEEL_SLOT_BITS * level);
+            next = (wheel->base_tick | (step - 1)) + 1;
+            break;
+        }
+    }
+
+    return next < target ? next : target;
+}
+
+// Due entries are released in list order, which is insertion order for the
+// tick; entries not yet due go back on the slot in the same order.
+static uint32_t midi_wheel_release_slot(midi_wheel_t *wheel, uint64_t now, midi_wheel_expire_t expire, void *context)
+{
+    uint32_t slot = wheel->base_tick & MIDI_WHEEL_SLOT_MASK;
+    uint16_t node = wheel->heads[0][slot];
+    uint32_t released = 0;
+
+    if (node == MIDI_WHEEL_NIL) {
+        return 0;
+    }
+
+    wheel->heads[0][slot] = MIDI_WHEEL_NIL;
+    wheel->tails[0][slot] = MIDI_WHEEL_NIL;
+
+    while (node != MIDI_WHEEL_NIL) {
+        midi_wheel_node_t entry = wheel->nodes[node];
+        wheel->level_counts[0]--;
+
+        if (entry.deadline > now) {
+            midi_wheel_append(wheel, 0, slot, node);
+        } else {
+            wheel->nodes[node].next = wheel->free_head;
+            wheel->free_head = node;
+            wheel->count--;
+            released++;
+
+            expire(entry.payload, entry.deadline, context);
+        }
+
+        node = entry.next;
+    }
+
+    return released;
+}
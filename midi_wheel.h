@@ -0,0 +1,47 @@
+#ifndef MIDI_WHEEL_H
+#define MIDI_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MIDI_WHEEL_TICK_SHIFT 16
+#define MIDI_WHEEL_LEVELS 4
+#define MIDI_WHEEL_SLOT_BITS 6
+#define MIDI_WHEEL_SLOTS (1 << MIDI_WHEEL_SLOT_BITS)
+#define MIDI_WHEEL_CAPACITY 256
+#define MIDI_WHEEL_NIL 0xFFFF
+
+typedef struct {
+    uint64_t deadline;
+    uint64_t payload;
+    uint16_t next;
+} midi_wheel_node_t;
+
+// Hierarchical timing wheel over a fixed node pool. Deadlines are in
+// nanoseconds and bucketed into ticks of 2^MIDI_WHEEL_TICK_SHIFT ns; each
+// level covers MIDI_WHEEL_SLOT_BITS more tick bits, and entries cascade down
+// a level when the level below wraps. Entries are only released once their
+// exact deadline has passed, tick by tick; within a tick they come out in
+// insertion order rather than deadline order, so equal deadlines keep
+// insertion order. Deadlines past the top level are parked in its slot for the
+// deadline and re-filed each time that slot cascades.
+typedef struct {
+    midi_wheel_node_t nodes[MIDI_WHEEL_CAPACITY];
+    uint16_t heads[MIDI_WHEEL_LEVELS][MIDI_WHEEL_SLOTS];
+    uint16_t tails[MIDI_WHEEL_LEVELS][MIDI_WHEEL_SLOTS];
+    uint16_t level_counts[MIDI_WHEEL_LEVELS];
+    uint16_t free_head;
+    uint16_t count;
+    uint64_t base_tick;
+    bool base_cascaded;
+} midi_wheel_t;
+
+typedef void (*midi_wheel_expire_t)(uint64_t payload, uint64_t deadline, void *context);
+
+void midi_wheel_init(midi_wheel_t *wheel, uint64_t now);
+bool midi_wheel_insert(midi_wheel_t *wheel, uint64_t deadline, uint64_t payload);
+uint32_t midi_wheel_advance(midi_wheel_t *wheel, uint64_t now, midi_wheel_expire_t expire, void *context);
+uint64_t midi_wheel_next_deadline(midi_wheel_t *wheel);
+uint16_t midi_wheel_count(midi_wheel_t *wheel);
+
+#endif
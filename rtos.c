@@ -0,0 +1,82 @@
+#include "rtos.h"
+#include "midi_time.h"
+#include <time.h>
+
+static struct timespec rtos_deadline_to_timespec(uint64_t deadline_ns);
+
+void rtos_event_init(rtos_event_t *event)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&event->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_init(&event->mutex, NULL);
+    event->signaled = false;
+}
+
+void rtos_event_destroy(rtos_event_t *event)
+{
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+}
+
+void rtos_event_signal(rtos_event_t *event)
+{
+    pthread_mutex_lock(&event->mutex);
+    event->signaled = true;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+}
+
+bool rtos_event_wait_until(rtos_event_t *event, uint64_t deadline_ns)
+{
+    struct timespec deadline = rtos_deadline_to_timespec(deadline_ns);
+    bool signaled;
+
+    pthread_mutex_lock(&event->mutex);
+    while (!event->signaled) {
+        int result;
+        if (deadline_ns == RTOS_WAIT_FOREVER) {
+            result = pthread_cond_wait(&event->cond, &event->mutex);
+        } else {
+            result = pthread_cond_timedwait(&event->cond, &event->mutex, &deadline);
+        }
+        if (result != 0) {
+            break;
+        }
+    }
+    signaled = event->signaled;
+    event->signaled = false;
+    pthread_mutex_unlock(&event->mutex);
+
+    return signaled;
+}
+
+// One clock for the whole system: the MIDI timestamp clock
+uint64_t rtos_time_now_ns(void)
+{
+    return midi_time_now_ns();
+}
+
+// Deadlines are on rtos_time_now_ns, which need not be CLOCK_MONOTONIC
+// (midi_time_set_source), so the wait is converted to the condition
+// variable's clock by its remaining time
+static struct timespec rtos_deadline_to_timespec(uint64_t deadline_ns)
+{
+    struct timespec ts = {0, 0};
+    if (deadline_ns == RTOS_WAIT_FOREVER) {
+        return ts;
+    }
+
+    uint64_t now = rtos_time_now_ns();
+    uint64_t remaining = deadline_ns > now ? deadline_ns - now : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t target = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec + remaining;
+    ts.tv_sec = (time_t)(target / 1000000000ULL);
+    ts.tv_nsec = (long)(target % 1000000000ULL);
+    return ts;
+}
@@ -0,0 +1,23 @@
+#ifndef RTOS_H
+#define RTOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define RTOS_WAIT_FOREVER UINT64_MAX
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool signaled;
+} rtos_event_t;
+
+void rtos_event_init(rtos_event_t *event);
+void rtos_event_destroy(rtos_event_t *event);
+void rtos_event_signal(rtos_event_t *event);
+bool rtos_event_wait_until(rtos_event_t *event, uint64_t deadline_ns);
+
+uint64_t rtos_time_now_ns(void);
+
+#endif
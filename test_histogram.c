@@ -0,0 +1,130 @@
+// Checks the histogram's bucket layout and percentiles against exact values.
+// The source is built in so the bucket helpers can be driven directly.
+#include "midi_histogram.c"
+#include <stdbool.h>
+#include <stdio.h>
+
+static int failures;
+
+static void check(bool condition, const char *what, uint64_t value)
+{
+    if (!condition) {
+        printf("FAIL: %s (%llu)\n", what, (unsigned long long)value);
+        failures++;
+    }
+}
+
+// Reported values may overshoot by one sub-bucket, never undershoot
+static bool within_error(uint64_t reported, uint64_t exact)
+{
+    return reported >= exact && reported - exact <= exact / MIDI_HISTOGRAM_SUB_BUCKETS;
+}
+
+static const uint64_t bucket_values[] = {
+    0, 1, 7, 8, 9, 15, 16, 17, 100, 1000, 65535, 65536, 1000000, 123456789, 1000000000,
+    (1ULL << 36) - 1, 1ULL << 36, (1ULL << 37) - 1,
+};
+
+static const uint64_t overflow_values[] = {
+    1ULL << 37, (1ULL << 37) + 1, 1ULL << 40, 1ULL << 63, UINT64_MAX,
+};
+
+// Each case records count values base, base + step, ...
+static const struct {
+    uint64_t base;
+    uint64_t step;
+    uint32_t count;
+} percentile_cases[] = {
+    {0, 1, 1000},
+    {1, 1, 10000},
+    {1000, 997, 5000},
+    {20000, 0, 3},
+    {1000000000, 1000000, 2000},
+    {(1ULL << 36) - 4096, 1, 4096},
+};
+
+static const uint32_t percentiles[] = {1, 500, 900, 990, 999, 1000};
+
+static void test_bucket_index(void)
+{
+    for (size_t i = 0; i < sizeof(bucket_values) / sizeof(bucket_values[0]); i++) {
+        uint64_t value = bucket_values[i];
+        uint32_t index = midi_histogram_bucket_index(value);
+        uint64_t upper = midi_histogram_bucket_upper(index);
+
+        check(index < MIDI_HISTOGRAM_BUCKETS, "bucket index in range", value);
+        check(within_error(upper, value), "bucket upper bound within 1/8", value);
+        check(midi_histogram_bucket_index(upper) == index, "bucket upper bound in its bucket", value);
+        if (index + 1 < MIDI_HISTOGRAM_BUCKETS) {
+            check(midi_histogram_bucket_index(upper + 1) == index + 1, "next value in next bucket", value);
+        }
+    }
+}
+
+static void test_overflow(void)
+{
+    midi_histogram_t histogram;
+    midi_histogram_summary_t summary;
+
+    for (size_t i = 0; i < sizeof(overflow_values) / sizeof(overflow_values[0]); i++) {
+        uint64_t value = overflow_values[i];
+        check(midi_histogram_bucket_index(value) == MIDI_HISTOGRAM_BUCKETS - 1, "overflow in last bucket", value);
+
+        midi_histogram_reset(&histogram);
+        midi_histogram_record(&histogram, 10);
+        midi_histogram_record(&histogram, value);
+        midi_histogram_summarize(&histogram, &summary);
+
+        check(histogram.counts[MIDI_HISTOGRAM_BUCKETS - 1] == 1, "overflow counted in last bucket", value);
+        check(summary.count == 2 && summary.max == value, "overflow max exact", value);
+        check(midi_histogram_bucket_index(summary.p999) == MIDI_HISTOGRAM_BUCKETS - 1,
+              "overflow percentile from last bucket", value);
+    }
+}
+
+static void test_percentiles(void)
+{
+    static midi_histogram_t histogram;
+
+    for (size_t c = 0; c < sizeof(percentile_cases) / sizeof(percentile_cases[0]); c++) {
+        uint64_t base = percentile_cases[c].base;
+        uint64_t step = percentile_cases[c].step;
+        uint32_t count = percentile_cases[c].count;
+
+        midi_histogram_reset(&histogram);
+        for (uint32_t i = 0; i < count; i++) {
+            midi_histogram_record(&histogram, base + i * step);
+        }
+
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+            uint64_t rank = ((uint64_t)count * percentiles[p] + 999) / 1000;
+            uint64_t exact = base + (rank - 1) * step;
+            check(within_error(midi_histogram_percentile(&histogram, percentiles[p]), exact),
+                  "percentile within 1/8", base);
+        }
+
+        midi_histogram_summary_t summary;
+        midi_histogram_summarize(&histogram, &summary);
+        uint64_t max = base + (uint64_t)(count - 1) * step;
+        check(summary.count == count && summary.max == max, "summary count and max exact", base);
+        check(summary.p50 <= summary.p99 && summary.p99 <= summary.p999 && summary.p999 <= summary.max,
+              "summary percentiles ordered", base);
+    }
+}
+
+int main(void)
+{
+    printf("MIDI Histogram Test\n");
+
+    test_bucket_index();
+    test_overflow();
+    test_percentiles();
+
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("Test completed successfully\n");
+    return 0;
+}
@@ -0,0 +1,381 @@
+// Drives the USB MIDI driver through its endpoints, standing in for the
+// controller: the driver sources are built in so the test can fill OUT
+// packets and complete IN transfers the way the interrupt would.
+#include "usb.c"
+#include "midi.c"
+#include "midi_virtual_wire.h"
+#include <stdio.h>
+
+#define TEST_SYSEX_LENGTH 1000
+
+static midi_dev_t *device_a;
+static midi_dev_t *device_b;
+static uint8_t port_a;
+static uint8_t port_b;
+static int failures;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void sysex_chunk_handler(midi_dev_t *dev, uint8_t cable, uint8_t *data, uint32_t length, bool last)
+{
+    (void)dev;
+    (void)cable;
+    midi_vw_append_sysex(port_a, data, length, last, 0);
+}
+
+// Packs bytes as USB-MIDI SysEx events on cable 0 and hands them to the OUT
+// endpoint a packet at a time, decoding each before the next arrives
+static void receive_sysex(midi_dev_t *dev, const uint8_t *data, uint32_t length)
+{
+    usb_endpoint_t *ep = &usb_device.endpoints[dev->endpoint_out];
+    uint32_t offset = 0;
+
+    while (offset < length) {
+        uint16_t packet_length = 0;
+
+        while (offset < length && packet_length + 4 <= ep->buffer_size) {
+            uint32_t remaining = length - offset;
+            uint8_t *event = ep->buffer + packet_length;
+
+            memset(event, 0, 4);
+            if (remaining > 3 || (remaining == 3 && data[offset + 2] != MIDI_MSG_END_SYSEX)) {
+                event[0] = 0x04;
+                remaining = 3;
+            } else {
+                event[0] = (uint8_t)(0x04 + remaining);
+            }
+            memcpy(event + 1, data + offset, remaining);
+            offset += remaining;
+            packet_length += 4;
+        }
+
+        ep->data_length = packet_length;
+        usb_handle_transfer_complete(dev->endpoint_out, USB_SUCCESS);
+        midi_process_rx(dev);
+    }
+}
+
+// Completes IN transfers until the device has nothing more to send,
+// unpacking the SysEx bytes that went out
+static uint32_t transmit_sysex(midi_dev_t *dev, uint8_t *data, uint32_t max_length)
+{
+    usb_tx_queue_t *queue = &usb_device.tx_queues[dev->endpoint_in];
+    uint32_t length = 0;
+
+    for (int spins = 0; spins < 10000 && (midi_is_sending_sysex(dev) || queue->active); spins++) {
+        midi_flush(dev);
+        if (!__atomic_load_n(&queue->active, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        usb_tx_transfer_t *transfer = &queue->transfers[queue->head & (USB_TX_QUEUE_DEPTH - 1)];
+        const uint8_t *event = transfer->data + transfer->offset;
+        for (uint16_t i = 0; i + 4 <= transfer->chunk; i += 4, event += 4) {
+            uint8_t cin = event[0] & 0x0F;
+            uint8_t count = cin == 0x04 ? 3 : (cin >= 0x05 && cin <= 0x07) ? cin - 0x04 : 0;
+            for (uint8_t j = 0; j < count && length < max_length; j++) {
+                data[length++] = event[1 + j];
+            }
+        }
+        usb_handle_transfer_complete(dev->endpoint_in, USB_SUCCESS);
+    }
+
+    return length;
+}
+
+// Fills the OUT endpoint with a whole packet of note-ons numbered from
+// first, and completes it; returns the number after the last
+static uint16_t receive_notes(midi_dev_t *dev, uint16_t first)
+{
+    usb_endpoint_t *ep = &usb_device.endpoints[dev->endpoint_out];
+
+    for (uint16_t i = 0; i < ep->buffer_size / 4; i++, first++) {
+        uint8_t *event = ep->buffer + 4 * i;
+        event[0] = 0x09;
+        event[1] = 0x90;
+        event[2] = (uint8_t)(first & 0x7F);
+        event[3] = (uint8_t)((first >> 7) & 0x7F);
+    }
+    ep->data_length = ep->buffer_size;
+    usb_handle_transfer_complete(dev->endpoint_out, USB_SUCCESS);
+
+    return first;
+}
+
+// Takes queued note-ons off the device, checking they carry the numbers
+// from *next on in order; returns how many there were
+static uint16_t drain_notes(midi_dev_t *dev, uint16_t *next)
+{
+    midi_message_t message;
+    uint16_t received = 0;
+
+    while (midi_receive_message(dev, &message) == MIDI_SUCCESS) {
+        uint16_t number = message.data[0] | (message.data[1] << 7);
+        check(message.status == 0x90 && number == *next, "queued events in order");
+        (*next)++;
+        received++;
+    }
+
+    return received;
+}
+
+// A high-speed packet carries 128 events; every one must reach the queue
+static void test_full_packet_queued(void)
+{
+    uint16_t next = 0;
+    uint16_t events = receive_notes(device_b, 0);
+    midi_process_rx(device_b);
+
+    check(events == USB_MAX_PACKET_SIZE / 4, "endpoint sized for high speed");
+    check(midi_get_pending_count(device_b) == events, "every event of a full packet queued");
+    check(drain_notes(device_b, &next) == events, "every queued event received");
+
+    midi_rx_stats_t stats;
+    check(midi_get_rx_stats(device_b, &stats) == MIDI_SUCCESS && stats.drops == 0, "no receive drops");
+}
+
+// With the queue too full for another packet, decoding waits for the
+// reader instead of dropping, and picks up where it left off
+static void test_rx_backpressure(void)
+{
+    uint16_t sent = 0;
+    uint16_t next = 0;
+
+    for (uint8_t i = 0; i < MIDI_RX_QUEUE_DEPTH; i++) {
+        sent = receive_notes(device_b, sent);
+    }
+    check(midi_process_rx(device_b) == MIDI_SUCCESS, "a full receive queue decoded");
+
+    sent = receive_notes(device_b, sent);
+    check(midi_process_rx(device_b) == MIDI_ERROR_BUFFER_FULL, "decoding waits for room in the queue");
+
+    midi_rx_stats_t stats;
+    check(midi_get_rx_stats(device_b, &stats) == MIDI_SUCCESS && stats.pending == 1, "packet left waiting");
+
+    uint16_t received = drain_notes(device_b, &next);
+    check(midi_process_rx(device_b) == MIDI_SUCCESS, "waiting packet decoded");
+    received += drain_notes(device_b, &next);
+
+    check(received == sent, "every event received after backpressure");
+    check(midi_get_rx_stats(device_b, &stats) == MIDI_SUCCESS && stats.drops == 0, "no drops under backpressure");
+}
+
+// A bus reset in the middle of a transfer must leave the device able to
+// send and receive once the host configures it again
+static void test_reset_mid_transfer(void)
+{
+    usb_tx_queue_t *queue = &usb_device.tx_queues[device_b->endpoint_in];
+
+    check(midi_send_note_on(device_b, 0, 60, 100) == MIDI_SUCCESS && midi_flush(device_b) == MIDI_SUCCESS,
+          "note sent before reset");
+    check(queue->active, "IN transfer in progress at reset");
+
+    usb_handle_bus_reset();
+
+    check(usb_get_state() == USB_DEVICE_STATE_DEFAULT, "reset returns to the default state");
+    check(!queue->active && queue->head == queue->tail, "reset flushes the IN queue");
+    check(__builtin_popcountll(usb_packet_pool.free_mask) == USB_PACKET_POOL_SIZE, "reset returns every packet");
+
+    usb_device.state = USB_DEVICE_STATE_ADDRESS;
+    usb_set_state(USB_DEVICE_STATE_CONFIGURED);
+
+    check(midi_send_note_on(device_b, 0, 61, 100) == MIDI_SUCCESS && midi_flush(device_b) == MIDI_SUCCESS,
+          "note sent after reset");
+    check(queue->active, "IN transfer started after reset");
+    if (queue->active) {
+        usb_tx_transfer_t *transfer = &queue->transfers[queue->head & (USB_TX_QUEUE_DEPTH - 1)];
+        check(transfer->chunk == 4 && transfer->data[1] == 0x90 && transfer->data[2] == 61,
+              "only the new note goes out after reset");
+        usb_handle_transfer_complete(device_b->endpoint_in, USB_SUCCESS);
+    }
+
+    // The reset renegotiated the speed, so the packet size follows it
+    uint16_t first = 1000;
+    uint16_t next = first;
+    uint16_t sent = receive_notes(device_b, first);
+    check(midi_process_rx(device_b) == MIDI_SUCCESS, "packet received after reset");
+    check(drain_notes(device_b, &next) == sent - first && next == sent, "events received after reset");
+}
+
+static void test_long_sysex_routing(void)
+{
+    static uint8_t message[TEST_SYSEX_LENGTH];
+    static uint8_t sent[TEST_SYSEX_LENGTH + 16];
+
+    message[0] = MIDI_MSG_SYSTEM_EXCLUSIVE;
+    for (uint32_t i = 1; i < TEST_SYSEX_LENGTH - 1; i++) {
+        message[i] = (uint8_t)(i * 7) & 0x7F;
+    }
+    message[TEST_SYSEX_LENGTH - 1] = MIDI_MSG_END_SYSEX;
+
+    receive_sysex(device_a, message, TEST_SYSEX_LENGTH);
+
+    midi_message_t routed;
+    check(midi_vw_receive_message(port_b, &routed) == MIDI_VW_SUCCESS, "SysEx routed to the destination port");
+
+    const uint8_t *payload = NULL;
+    uint32_t payload_length = 0;
+    check(midi_vw_get_sysex(&routed, &payload, &payload_length) == MIDI_VW_SUCCESS, "routed SysEx has a payload");
+    check(payload_length == TEST_SYSEX_LENGTH - 2, "routed SysEx payload length");
+    check(payload != NULL && memcmp(payload, message + 1, TEST_SYSEX_LENGTH - 2) == 0, "routed SysEx payload bytes");
+
+    check(midi_send_sysex_buffer(device_b, 0, payload, payload_length) == MIDI_SUCCESS, "SysEx send started");
+    uint32_t sent_length = transmit_sysex(device_b, sent, sizeof(sent));
+    check(sent_length == TEST_SYSEX_LENGTH, "sent SysEx length");
+    check(memcmp(sent, message, TEST_SYSEX_LENGTH) == 0, "sent SysEx bytes");
+
+    midi_vw_release_sysex(&routed);
+
+    uint32_t free_blocks;
+    uint32_t exhausted;
+    midi_vw_get_sysex_statistics(&free_blocks, &exhausted);
+    check(free_blocks == MIDI_SYSEX_ARENA_BLOCKS && exhausted == 0, "SysEx arena blocks returned");
+}
+
+static bool counting_sink(uint8_t device_id, uint32_t event, void *context)
+{
+    (void)device_id;
+    (void)event;
+    (*(uint32_t *)context)++;
+    return true;
+}
+
+// An event cut through to a port's sink counts toward the port's egress
+// latency like one handed out by midi_vw_receive_message
+static void test_cut_through_latency(void)
+{
+    uint8_t port_c;
+    uint8_t connection_id;
+    uint32_t sunk = 0;
+
+    check(midi_vw_register_device("C", false, true, &port_c) == MIDI_VW_SUCCESS &&
+          midi_vw_set_event_sink(port_c, counting_sink, &sunk) == MIDI_VW_SUCCESS &&
+          midi_vw_create_connection(port_a, port_c, 0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id) == MIDI_VW_SUCCESS,
+          "cut-through port connected");
+
+    midi_vw_forward_event(port_a, 0x643C9009u);
+
+    midi_histogram_summary_t latency;
+    check(sunk == 1, "event taken by the sink");
+    check(midi_vw_get_port_latency(port_c, &latency) == MIDI_VW_SUCCESS && latency.count == 1,
+          "cut-through event recorded in port latency");
+    check(midi_vw_get_connection_latency(connection_id, &latency) == MIDI_VW_SUCCESS && latency.count == 1,
+          "cut-through event recorded in connection latency");
+
+    midi_message_t message;
+    while (midi_vw_receive_message(port_b, &message) == MIDI_VW_SUCCESS) {
+    }
+    midi_vw_unregister_device(port_c);
+}
+
+// The port wait runs from the message being queued on the port to it being
+// handed out, so it sees time spent in the tx buffer and nothing before
+static void test_port_wait(void)
+{
+    midi_message_t message = {.status = 0x90, .data = {60, 100, 0}, .length = 3};
+    midi_histogram_summary_t wait;
+    midi_histogram_summary_t latency;
+
+    midi_vw_reset_statistics();
+    message.timestamp = midi_time_now_ns() - 50000000;
+    check(midi_vw_inject_message(port_a, &message) == MIDI_VW_SUCCESS, "message routed for the wait");
+
+    uint64_t queued = midi_time_now_ns();
+    while (midi_time_now_ns() - queued < 2000000) {
+    }
+    check(midi_vw_receive_message(port_b, &message) == MIDI_VW_SUCCESS, "waiting message received");
+
+    check(midi_vw_get_port_wait(port_b, &wait) == MIDI_VW_SUCCESS && wait.count == 1, "port wait recorded");
+    check(wait.max >= 2000000 && wait.max < 50000000, "port wait covers the tx buffer only");
+    check(midi_vw_get_port_latency(port_b, &latency) == MIDI_VW_SUCCESS && latency.max >= 52000000,
+          "port latency runs from ingest");
+}
+
+// midi_send_sysex queues the whole message or none of it, even when the
+// packet pool holds fewer packets than the message spans
+static void test_sysex_pool_exhaustion(void)
+{
+    static usb_packet_t *held[USB_PACKET_POOL_SIZE];
+    uint8_t data[100];
+    uint8_t sent[sizeof(data) + 16];
+    uint32_t held_count = 0;
+
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+
+    while (__builtin_popcountll(usb_packet_pool.free_mask) > 1) {
+        held[held_count++] = usb_packet_alloc();
+    }
+
+    check(midi_send_sysex(device_b, data, sizeof(data)) == MIDI_ERROR_BUFFER_FULL, "SysEx refused while the pool is short");
+    check(device_b->tx.packet == NULL && device_b->tx.length == 0, "nothing of a refused SysEx assembled");
+    check(!usb_device.tx_queues[device_b->endpoint_in].active, "nothing of a refused SysEx queued");
+    check(__builtin_popcountll(usb_packet_pool.free_mask) == 1, "packets taken for a refused SysEx returned");
+
+    while (held_count > 0) {
+        usb_packet_unref(held[--held_count]);
+    }
+
+    check(midi_send_sysex(device_b, data, sizeof(data)) == MIDI_SUCCESS, "SysEx sent once the pool recovers");
+    uint32_t sent_length = transmit_sysex(device_b, sent, sizeof(sent));
+    check(sent_length == sizeof(data) + 2 && sent[0] == MIDI_MSG_SYSTEM_EXCLUSIVE &&
+          memcmp(sent + 1, data, sizeof(data)) == 0 && sent[sizeof(data) + 1] == MIDI_MSG_END_SYSEX,
+          "whole SysEx sent");
+}
+
+int main(void)
+{
+    printf("USB MIDI Driver Test\n");
+
+    midi_callbacks_t callbacks_a = {0};
+    midi_callbacks_t callbacks_b = {0};
+    callbacks_a.sysex_chunk_callback = sysex_chunk_handler;
+
+    if (midi_init(&callbacks_a, &device_a) != MIDI_SUCCESS || midi_init(&callbacks_b, &device_b) != MIDI_SUCCESS ||
+        midi_start(device_a) != MIDI_SUCCESS || midi_start(device_b) != MIDI_SUCCESS) {
+        printf("Failed to start MIDI devices\n");
+        return 1;
+    }
+
+    // Enumeration at high speed, as the host would drive it
+    usb_device.speed = USB_SPEED_HIGH;
+    usb_device.state = USB_DEVICE_STATE_ADDRESS;
+    usb_set_state(USB_DEVICE_STATE_CONFIGURED);
+
+    midi_vw_callbacks_t vw_callbacks = {0};
+    uint8_t connection_id;
+    if (midi_vw_init(&vw_callbacks) != MIDI_VW_SUCCESS || midi_vw_start() != MIDI_VW_SUCCESS ||
+        midi_vw_register_device("A", true, false, &port_a) != MIDI_VW_SUCCESS ||
+        midi_vw_register_device("B", false, true, &port_b) != MIDI_VW_SUCCESS ||
+        midi_vw_create_connection(port_a, port_b, 0xFF, 0xFF, MIDI_VW_FILTER_NONE, &connection_id) != MIDI_VW_SUCCESS) {
+        printf("Failed to start virtual wire\n");
+        return 1;
+    }
+
+    test_full_packet_queued();
+    test_rx_backpressure();
+    test_reset_mid_transfer();
+    test_long_sysex_routing();
+    test_sysex_pool_exhaustion();
+    test_cut_through_latency();
+    test_port_wait();
+
+    midi_vw_deinit();
+    midi_deinit(device_b);
+    midi_deinit(device_a);
+
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("Test completed successfully\n");
+    return 0;
+}
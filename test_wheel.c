@@ -0,0 +1,162 @@
+// Drives the timing wheel across its level boundaries, past its top level and
+// over long idle gaps, checking what is released and in which order.
+#include "midi_wheel.h"
+#include <stdio.h>
+
+#define TICK(t) ((uint64_t)(t) << MIDI_WHEEL_TICK_SHIFT)
+#define MAX_RELEASED 16
+
+static midi_wheel_t wheel;
+static uint64_t released_payloads[MAX_RELEASED];
+static uint64_t released_deadlines[MAX_RELEASED];
+static uint32_t released_count;
+static int failures;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void record_expired(uint64_t payload, uint64_t deadline, void *context)
+{
+    (void)context;
+
+    if (released_count < MAX_RELEASED) {
+        released_payloads[released_count] = payload;
+        released_deadlines[released_count] = deadline;
+    }
+    released_count++;
+}
+
+static uint32_t advance(uint64_t now)
+{
+    released_count = 0;
+    return midi_wheel_advance(&wheel, now, record_expired, NULL);
+}
+
+// Entries land on the level their tick differs from the base at, and each is
+// released on its own deadline and not a tick before
+static void test_level_boundaries(void)
+{
+    static const struct {
+        uint64_t tick;
+        uint8_t level;
+    } entries[] = {
+        {63, 0}, {64, 1}, {4095, 1}, {4096, 2}, {262143, 2}, {262144, 3},
+    };
+    const uint32_t entry_count = sizeof(entries) / sizeof(entries[0]);
+
+    midi_wheel_init(&wheel, 0);
+    for (uint32_t i = 0; i < entry_count; i++) {
+        uint16_t before = wheel.level_counts[entries[i].level];
+        check(midi_wheel_insert(&wheel, TICK(entries[i].tick), i), "boundary entry inserted");
+        check(wheel.level_counts[entries[i].level] == before + 1, "boundary entry on its level");
+    }
+
+    for (uint32_t i = 0; i < entry_count; i++) {
+        uint64_t deadline = TICK(entries[i].tick);
+        check(midi_wheel_next_deadline(&wheel) <= deadline, "next deadline not after the entry");
+        check(advance(deadline - 1) == 0, "boundary entry held until its deadline");
+        check(advance(deadline) == 1 && released_payloads[0] == i, "boundary entry released on its deadline");
+    }
+
+    // From a base just short of a level-1 boundary, the next slot over is
+    // already level 1 and cascades down as the base crosses it
+    midi_wheel_init(&wheel, TICK(60));
+    check(midi_wheel_insert(&wheel, TICK(70), 0) && wheel.level_counts[1] == 1, "crossing entry on level 1");
+    check(advance(TICK(64)) == 0 && wheel.level_counts[0] == 1, "crossing entry cascaded to level 0");
+    check(advance(TICK(70)) == 1, "crossing entry released");
+    check(midi_wheel_count(&wheel) == 0, "wheel empty after boundaries");
+}
+
+// Deadlines past the top level are parked and re-filed as the wheel turns
+static void test_parked_deadlines(void)
+{
+    uint64_t range = 1ULL << (MIDI_WHEEL_SLOT_BITS * MIDI_WHEEL_LEVELS);
+    uint64_t near = TICK(range + 5);
+    uint64_t far = TICK(3 * range + 12345) + 777;
+
+    midi_wheel_init(&wheel, 0);
+    check(midi_wheel_insert(&wheel, far, 1) && midi_wheel_insert(&wheel, near, 0), "parked entries inserted");
+    check(wheel.level_counts[MIDI_WHEEL_LEVELS - 1] == 2, "parked entries on the top level");
+    check(midi_wheel_next_deadline(&wheel) <= near, "parked entry wakes before its deadline");
+
+    check(advance(near - 1) == 0, "parked entry held until its deadline");
+    check(advance(near) == 1 && released_payloads[0] == 0, "near parked entry released");
+    check(advance(far - 1) == 0, "far parked entry held until its exact deadline");
+    check(advance(far) == 1 && released_payloads[0] == 1 && released_deadlines[0] == far, "far parked entry released");
+}
+
+// A single advance across a long gap releases everything in deadline order,
+// and leaves the base where later inserts file against it
+static void test_idle_gap(void)
+{
+    static const uint64_t ticks[] = {300000, 5, 70000, 4100, 64};
+    const uint32_t tick_count = sizeof(ticks) / sizeof(ticks[0]);
+
+    midi_wheel_init(&wheel, 0);
+    for (uint32_t i = 0; i < tick_count; i++) {
+        midi_wheel_insert(&wheel, TICK(ticks[i]), ticks[i]);
+    }
+
+    uint64_t now = TICK(1ULL << 30);
+    check(advance(now) == tick_count, "all entries released across the gap");
+    for (uint32_t i = 1; i < tick_count; i++) {
+        check(released_payloads[i - 1] < released_payloads[i], "gap releases in deadline order");
+    }
+
+    check(midi_wheel_next_deadline(&wheel) == UINT64_MAX, "nothing pending after the gap");
+    check(advance(now + TICK(1ULL << 32)) == 0, "empty wheel crosses a gap");
+
+    now += TICK(1ULL << 32);
+    check(midi_wheel_insert(&wheel, now + TICK(100), 7) && wheel.level_counts[1] == 1, "insert after the gap");
+    check(advance(now + TICK(99)) == 0, "entry after the gap held");
+    check(advance(now + TICK(100)) == 1 && released_payloads[0] == 7, "entry after the gap released");
+}
+
+// Equal deadlines come out in insertion order, however they reached level 0;
+// inside a tick, insertion order wins over deadline order
+static void test_tie_order(void)
+{
+    midi_wheel_init(&wheel, 0);
+    midi_wheel_insert(&wheel, TICK(70), 0);
+    advance(TICK(10));
+    midi_wheel_insert(&wheel, TICK(70), 1);
+    advance(TICK(65));
+    midi_wheel_insert(&wheel, TICK(70), 2);
+    midi_wheel_insert(&wheel, TICK(70) + 100, 3);
+    midi_wheel_insert(&wheel, TICK(70) + 50, 4);
+
+    check(advance(TICK(70) + 100) == 5, "tied entries released");
+    for (uint32_t i = 0; i < 5; i++) {
+        check(released_payloads[i] == i, "tied entries in insertion order");
+    }
+
+    midi_wheel_insert(&wheel, TICK(71) + 10, 0);
+    midi_wheel_insert(&wheel, TICK(71) + 20, 1);
+    midi_wheel_insert(&wheel, TICK(71) + 10, 2);
+    check(advance(TICK(71) + 15) == 2 && released_payloads[0] == 0 && released_payloads[1] == 2,
+          "due entries released from a partly due tick");
+    check(advance(TICK(71) + 20) == 1 && released_payloads[0] == 1, "rest of the tick released");
+}
+
+int main(void)
+{
+    printf("MIDI Timing Wheel Test\n");
+
+    test_level_boundaries();
+    test_parked_deadlines();
+    test_idle_gap();
+    test_tie_order();
+
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("Test completed successfully\n");
+    return 0;
+}
@@ -2,19 +2,96 @@
 #include <string.h>
 #include <stddef.h>
 
+typedef char usb_tx_queue_depth_check[(USB_TX_QUEUE_DEPTH & (USB_TX_QUEUE_DEPTH - 1)) == 0 ? 1 : -1];
+typedef char usb_max_packet_size_check[USB_MAX_PACKET_SIZE >= USB_FS_MAX_PACKET_SIZE ? 1 : -1];
+typedef char usb_packet_pool_size_check[USB_PACKET_POOL_SIZE > 0 && USB_PACKET_POOL_SIZE <= 64 ? 1 : -1];
+
+// A queued transfer either points at the caller's buffer or holds a
+// reference to a pool packet, dropped when it retires. It goes out in
+// max-packet chunks; chunk is the size of the one on the wire. A
+// zero-length chunk follows when the data ends on a packet boundary and
+// zlp is set.
+typedef struct {
+    usb_packet_t *packet;
+    uint8_t *data;
+    uint32_t length;
+    uint32_t offset;
+    uint16_t chunk;
+    bool zlp;
+} usb_tx_transfer_t;
+
+// Single producer (usb_transmit) and single consumer (the completion
+// handler). Whoever sets active owns starting transfers, so a packet queued
+// just as the previous one completes is never left behind.
+typedef struct {
+    usb_tx_transfer_t transfers[USB_TX_QUEUE_DEPTH];
+    uint32_t head;
+    uint32_t tail;
+    bool active;
+    uint8_t high_water;
+    uint32_t drops;
+} usb_tx_queue_t;
+
+// Receive packets rotated on an OUT endpoint. filled is advanced by the
+// completion handler and taken by the consumer; a slot is empty once its
+// packet is taken and gets a fresh one when next armed. armed is owned the
+// same way as the tx queue's active, so whichever side finds the endpoint
+// idle with room re-arms it exactly once.
+typedef struct {
+    usb_packet_t *packets[USB_RX_POOL_MAX_BUFFERS];
+    uint8_t count;
+    uint32_t filled;
+    uint32_t taken;
+    bool armed;
+    uint8_t high_water;
+    uint32_t overruns;
+} usb_rx_pool_t;
+
+// Free packets are a bitmap, so allocation is one compare-and-swap and
+// cannot suffer ABA. starved marks OUT endpoints waiting for a free packet.
+static struct {
+    usb_packet_t packets[USB_PACKET_POOL_SIZE];
+    uint64_t free_mask;
+    uint32_t starved;
+} usb_packet_pool;
+
+// What the controller reports from its interrupt, one event at a time
+typedef enum {
+    USB_HW_EVENT_RESET = 0,
+    USB_HW_EVENT_SUSPEND,
+    USB_HW_EVENT_RESUME,
+    USB_HW_EVENT_SETUP,
+    USB_HW_EVENT_TRANSFER_COMPLETE
+} usb_hw_event_type_t;
+
+typedef struct {
+    usb_hw_event_type_t type;
+    uint8_t endpoint_num;
+    usb_status_t status;
+    uint16_t length;
+    usb_setup_packet_t setup;
+} usb_hw_event_t;
+
 static struct {
     bool initialized;
     usb_device_state_t state;
+    usb_device_state_t resume_state;
+    usb_speed_t speed;
     usb_config_t *config;
     usb_endpoint_t endpoints[USB_MAX_ENDPOINTS];
+    usb_tx_queue_t tx_queues[USB_MAX_ENDPOINTS];
+    usb_rx_pool_t rx_pools[USB_MAX_ENDPOINTS];
     uint8_t device_address;
     uint8_t current_configuration;
+    uint16_t control_request_length;
 } usb_device;
 
 static usb_status_t usb_hw_init(void);
 static usb_status_t usb_hw_deinit(void);
 static usb_status_t usb_hw_start(void);
 static usb_status_t usb_hw_stop(void);
+static usb_speed_t usb_hw_get_speed(void);
+static bool usb_hw_poll_event(usb_hw_event_t *event);
 static usb_status_t usb_hw_endpoint_configure(uint8_t endpoint_num, 
                                              usb_endpoint_type_t type,
                                              usb_direction_t direction,
@@ -25,6 +102,18 @@ static usb_status_t usb_hw_endpoint_stall(uint8_t endpoint_num);
 static usb_status_t usb_hw_endpoint_clear_stall(uint8_t endpoint_num);
 static usb_status_t usb_hw_transmit(uint8_t endpoint_num, uint8_t *data, uint16_t length);
 static usb_status_t usb_hw_receive(uint8_t endpoint_num, uint8_t *buffer, uint16_t max_length);
+static usb_status_t usb_tx_queue_put(uint8_t endpoint_num, uint8_t *data, uint32_t length,
+                                     usb_packet_t *packet, bool zlp);
+static void usb_tx_queue_flush(uint8_t endpoint_num);
+static void usb_tx_queue_kick(uint8_t endpoint_num);
+static usb_status_t usb_tx_send_chunk(uint8_t endpoint_num, usb_tx_transfer_t *transfer);
+static void usb_tx_retire(uint8_t endpoint_num, usb_status_t status);
+static void usb_rx_pool_arm(uint8_t endpoint_num);
+static void usb_rx_pool_kick_starved(void);
+static void usb_handle_setup_packet(usb_setup_packet_t *setup);
+static void usb_handle_transfer_complete(uint8_t endpoint_num, usb_status_t status);
+static void usb_handle_bus_reset(void);
+static void usb_set_state(usb_device_state_t new_state);
 
 usb_status_t usb_init(usb_config_t *config)
 {
@@ -40,6 +129,7 @@ usb_status_t usb_init(usb_config_t *config)
     
     usb_device.config = config;
     usb_device.state = USB_DEVICE_STATE_DETACHED;
+    usb_device.speed = USB_SPEED_FULL;
     usb_device.device_address = 0;
     usb_device.current_configuration = 0;
 
@@ -54,6 +144,11 @@ usb_status_t usb_init(usb_config_t *config)
         return status;
     }
 
+    __atomic_store_n(&usb_packet_pool.free_mask,
+                     USB_PACKET_POOL_SIZE == 64 ? UINT64_MAX : (1ULL << USB_PACKET_POOL_SIZE) - 1,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&usb_packet_pool.starved, 0, __ATOMIC_RELEASE);
+
     usb_device.initialized = true;
     return USB_SUCCESS;
 }
@@ -99,6 +194,13 @@ usb_status_t usb_stop(void)
 
     usb_hw_stop();
     usb_device.state = USB_DEVICE_STATE_DETACHED;
+
+    // Nothing queued will complete once off the bus
+    for (int i = 0; i < USB_MAX_ENDPOINTS; i++) {
+        usb_tx_queue_flush(i);
+        usb_device.rx_pools[i].armed = false;
+        usb_device.endpoints[i].transfer_complete = true;
+    }
     
     if (usb_device.config->state_callback) {
         usb_device.config->state_callback(usb_device.state);
@@ -112,6 +214,28 @@ usb_device_state_t usb_get_state(void)
     return usb_device.state;
 }
 
+usb_speed_t usb_get_speed(void)
+{
+    return usb_device.speed;
+}
+
+uint16_t usb_get_max_packet_size(usb_endpoint_type_t type)
+{
+    uint16_t size = USB_FS_MAX_PACKET_SIZE;
+
+    if (usb_device.speed == USB_SPEED_HIGH) {
+        if (type == USB_ENDPOINT_TYPE_BULK) {
+            size = USB_HS_BULK_MAX_PACKET_SIZE;
+        } else if (type != USB_ENDPOINT_TYPE_CONTROL) {
+            size = 1024;
+        }
+    } else if (type == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+        size = 1023;
+    }
+
+    return size < USB_MAX_PACKET_SIZE ? size : USB_MAX_PACKET_SIZE;
+}
+
 usb_status_t usb_endpoint_configure(uint8_t endpoint_num, 
                                    usb_endpoint_type_t type,
                                    usb_direction_t direction,
@@ -125,7 +249,7 @@ usb_status_t usb_endpoint_configure(uint8_t endpoint_num,
         return USB_ERROR_INVALID_PARAM;
     }
 
-    if (max_packet_size > USB_MAX_PACKET_SIZE) {
+    if (max_packet_size > usb_get_max_packet_size(type)) {
         return USB_ERROR_INVALID_PARAM;
     }
 
@@ -162,6 +286,12 @@ usb_status_t usb_endpoint_disable(uint8_t endpoint_num)
     }
 
     usb_device.endpoints[endpoint_num].enabled = false;
+
+    // As in usb_stop, nothing queued on a disabled endpoint will complete
+    usb_tx_queue_flush(endpoint_num);
+    usb_device.rx_pools[endpoint_num].armed = false;
+    usb_device.endpoints[endpoint_num].transfer_complete = true;
+
     return usb_hw_endpoint_disable(endpoint_num);
 }
 
@@ -197,7 +327,7 @@ usb_status_t usb_transmit(uint8_t endpoint_num, uint8_t *data, uint16_t length)
         return USB_ERROR_NOT_INITIALIZED;
     }
 
-    if (endpoint_num >= USB_MAX_ENDPOINTS || data == NULL) {
+    if (endpoint_num >= USB_MAX_ENDPOINTS || (data == NULL && length > 0)) {
         return USB_ERROR_INVALID_PARAM;
     }
 
@@ -211,18 +341,141 @@ usb_status_t usb_transmit(uint8_t endpoint_num, uint8_t *data, uint16_t length)
         return USB_ERROR_INVALID_PARAM;
     }
 
-    if (!ep->transfer_complete) {
-        return USB_ERROR_BUSY;
+    if (length > ep->max_packet_size) {
+        return USB_ERROR_BUFFER_OVERFLOW;
     }
 
-    if (length > ep->max_packet_size) {
+    usb_packet_t *packet = NULL;
+    if (length > 0) {
+        packet = usb_packet_alloc();
+        if (packet == NULL) {
+            __atomic_fetch_add(&usb_device.tx_queues[endpoint_num].drops, 1, __ATOMIC_RELAXED);
+            return USB_ERROR_BUSY;
+        }
+        memcpy(packet->data, data, length);
+        packet->length = length;
+    }
+
+    usb_status_t status = usb_tx_queue_put(endpoint_num, data, length, packet, false);
+    if (status != USB_SUCCESS && packet != NULL) {
+        usb_packet_unref(packet);
+    }
+
+    return status;
+}
+
+usb_status_t usb_transmit_packet(uint8_t endpoint_num, usb_packet_t *packet)
+{
+    if (!usb_device.initialized) {
+        return USB_ERROR_NOT_INITIALIZED;
+    }
+
+    if (endpoint_num >= USB_MAX_ENDPOINTS || packet == NULL) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    usb_endpoint_t *ep = &usb_device.endpoints[endpoint_num];
+
+    if (!ep->enabled) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    if (ep->direction != USB_DIRECTION_IN && endpoint_num != USB_CONTROL_ENDPOINT) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    if (packet->length > ep->max_packet_size) {
         return USB_ERROR_BUFFER_OVERFLOW;
     }
 
-    ep->transfer_complete = false;
-    ep->data_length = length;
+    usb_packet_ref(packet);
+    usb_status_t status = usb_tx_queue_put(endpoint_num, packet->data, packet->length, packet, false);
+    if (status != USB_SUCCESS) {
+        usb_packet_unref(packet);
+    }
+
+    return status;
+}
+
+usb_packet_t *usb_packet_alloc(void)
+{
+    uint64_t mask = __atomic_load_n(&usb_packet_pool.free_mask, __ATOMIC_ACQUIRE);
+
+    while (mask != 0) {
+        uint64_t bit = mask & (~mask + 1);
+        if (__atomic_compare_exchange_n(&usb_packet_pool.free_mask, &mask, mask & ~bit, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            usb_packet_t *packet = &usb_packet_pool.packets[__builtin_ctzll(bit)];
+            packet->length = 0;
+            __atomic_store_n(&packet->refs, 1, __ATOMIC_RELAXED);
+            return packet;
+        }
+    }
+
+    return NULL;
+}
 
-    return usb_hw_transmit(endpoint_num, data, length);
+void usb_packet_ref(usb_packet_t *packet)
+{
+    __atomic_add_fetch(&packet->refs, 1, __ATOMIC_RELAXED);
+}
+
+void usb_packet_unref(usb_packet_t *packet)
+{
+    if (packet == NULL || __atomic_sub_fetch(&packet->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    uint64_t bit = 1ULL << (packet - usb_packet_pool.packets);
+    __atomic_fetch_or(&usb_packet_pool.free_mask, bit, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&usb_packet_pool.starved, __ATOMIC_ACQUIRE) != 0) {
+        usb_rx_pool_kick_starved();
+    }
+}
+
+usb_status_t usb_transmit_transfer(uint8_t endpoint_num, uint8_t *data, uint32_t length, bool zlp)
+{
+    if (!usb_device.initialized) {
+        return USB_ERROR_NOT_INITIALIZED;
+    }
+
+    if (endpoint_num >= USB_MAX_ENDPOINTS || (data == NULL && length > 0)) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    usb_endpoint_t *ep = &usb_device.endpoints[endpoint_num];
+
+    if (!ep->enabled || ep->max_packet_size == 0) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    if (ep->direction != USB_DIRECTION_IN && endpoint_num != USB_CONTROL_ENDPOINT) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    return usb_tx_queue_put(endpoint_num, data, length, NULL, zlp);
+}
+
+usb_status_t usb_get_tx_stats(uint8_t endpoint_num, usb_tx_stats_t *stats)
+{
+    if (!usb_device.initialized) {
+        return USB_ERROR_NOT_INITIALIZED;
+    }
+
+    if (endpoint_num >= USB_MAX_ENDPOINTS || stats == NULL) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    usb_tx_queue_t *queue = &usb_device.tx_queues[endpoint_num];
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+    stats->queued = (uint8_t)(tail - head);
+    stats->high_water = queue->high_water;
+    stats->drops = __atomic_load_n(&queue->drops, __ATOMIC_RELAXED);
+
+    return USB_SUCCESS;
 }
 
 usb_status_t usb_receive(uint8_t endpoint_num, uint8_t *buffer, uint16_t max_length)
@@ -256,6 +509,100 @@ usb_status_t usb_receive(uint8_t endpoint_num, uint8_t *buffer, uint16_t max_len
     return usb_hw_receive(endpoint_num, buffer, max_length);
 }
 
+usb_status_t usb_receive_pool(uint8_t endpoint_num, uint8_t count)
+{
+    if (!usb_device.initialized) {
+        return USB_ERROR_NOT_INITIALIZED;
+    }
+
+    if (endpoint_num >= USB_MAX_ENDPOINTS || endpoint_num == USB_CONTROL_ENDPOINT ||
+        count == 0 || count > USB_RX_POOL_MAX_BUFFERS || (count & (count - 1)) != 0) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    usb_endpoint_t *ep = &usb_device.endpoints[endpoint_num];
+    if (!ep->enabled || ep->direction != USB_DIRECTION_OUT) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    if (!ep->transfer_complete) {
+        return USB_ERROR_BUSY;
+    }
+
+    usb_rx_pool_t *pool = &usb_device.rx_pools[endpoint_num];
+    for (uint8_t i = 0; i < USB_RX_POOL_MAX_BUFFERS; i++) {
+        usb_packet_unref(pool->packets[i]);
+        pool->packets[i] = NULL;
+    }
+    pool->count = count;
+    pool->filled = 0;
+    __atomic_store_n(&pool->taken, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool->armed, true, __ATOMIC_RELEASE);
+
+    usb_rx_pool_arm(endpoint_num);
+    return USB_SUCCESS;
+}
+
+usb_status_t usb_receive_acquire(uint8_t endpoint_num, usb_packet_t **packet)
+{
+    if (endpoint_num >= USB_MAX_ENDPOINTS || packet == NULL) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    usb_rx_pool_t *pool = &usb_device.rx_pools[endpoint_num];
+    if (pool->count == 0) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    uint32_t taken = pool->taken;
+    if (__atomic_load_n(&pool->filled, __ATOMIC_ACQUIRE) == taken) {
+        return USB_ERROR_NO_DATA;
+    }
+
+    uint32_t slot = taken & (pool->count - 1);
+    *packet = pool->packets[slot];
+    pool->packets[slot] = NULL;
+    __atomic_store_n(&pool->taken, taken + 1, __ATOMIC_RELEASE);
+
+    // The endpoint went idle with every slot full; this one frees it
+    if (!__atomic_load_n(&pool->armed, __ATOMIC_ACQUIRE) &&
+        !__atomic_test_and_set(&pool->armed, __ATOMIC_ACQUIRE)) {
+        usb_rx_pool_arm(endpoint_num);
+    }
+
+    return USB_SUCCESS;
+}
+
+usb_status_t usb_get_rx_stats(uint8_t endpoint_num, usb_rx_stats_t *stats)
+{
+    if (!usb_device.initialized) {
+        return USB_ERROR_NOT_INITIALIZED;
+    }
+
+    if (endpoint_num >= USB_MAX_ENDPOINTS || stats == NULL) {
+        return USB_ERROR_INVALID_PARAM;
+    }
+
+    usb_rx_pool_t *pool = &usb_device.rx_pools[endpoint_num];
+    uint32_t taken = __atomic_load_n(&pool->taken, __ATOMIC_ACQUIRE);
+    uint32_t filled = __atomic_load_n(&pool->filled, __ATOMIC_ACQUIRE);
+
+    stats->filled = (uint8_t)(filled - taken);
+    stats->high_water = pool->high_water;
+    stats->overruns = __atomic_load_n(&pool->overruns, __ATOMIC_RELAXED);
+
+    return USB_SUCCESS;
+}
+
+uint16_t usb_get_received_length(uint8_t endpoint_num)
+{
+    if (endpoint_num >= USB_MAX_ENDPOINTS) {
+        return 0;
+    }
+
+    return usb_device.endpoints[endpoint_num].data_length;
+}
+
 usb_status_t usb_control_send_status(void)
 {
     return usb_transmit(USB_CONTROL_ENDPOINT, NULL, 0);
@@ -263,7 +610,14 @@ usb_status_t usb_control_send_status(void)
 
 usb_status_t usb_control_send_data(uint8_t *data, uint16_t length)
 {
-    return usb_transmit(USB_CONTROL_ENDPOINT, data, length);
+    // The host never takes more than it asked for in wLength; a shorter
+    // reply that ends on a packet boundary needs a ZLP to end the data stage
+    uint16_t requested = usb_device.control_request_length;
+    if (length > requested) {
+        length = requested;
+    }
+
+    return usb_transmit_transfer(USB_CONTROL_ENDPOINT, data, length, length < requested);
 }
 
 usb_status_t usb_control_receive_data(uint8_t *buffer, uint16_t max_length)
@@ -271,8 +625,76 @@ usb_status_t usb_control_receive_data(uint8_t *buffer, uint16_t max_length)
     return usb_receive(USB_CONTROL_ENDPOINT, buffer, max_length);
 }
 
+// Called by the owner of armed: starts a receive into the next slot's
+// packet, or gives up ownership while the slots are full or the packet pool
+// is empty. The re-check after letting go catches a take or free that found
+// armed still set. A disabled endpoint or a refused receive also lets go;
+// the next take or pool setup retries.
+static void usb_rx_pool_arm(uint8_t endpoint_num)
+{
+    usb_rx_pool_t *pool = &usb_device.rx_pools[endpoint_num];
+    usb_endpoint_t *ep = &usb_device.endpoints[endpoint_num];
+
+    for (;;) {
+        uint32_t filled = pool->filled;
+
+        if (!ep->enabled) {
+            __atomic_clear(&pool->armed, __ATOMIC_RELEASE);
+            return;
+        }
+
+        if (filled - __atomic_load_n(&pool->taken, __ATOMIC_ACQUIRE) < pool->count) {
+            uint32_t slot = filled & (pool->count - 1);
+            if (pool->packets[slot] == NULL) {
+                pool->packets[slot] = usb_packet_alloc();
+            }
+
+            usb_packet_t *packet = pool->packets[slot];
+            if (packet != NULL) {
+                uint16_t max_length = ep->max_packet_size < USB_MAX_PACKET_SIZE ? ep->max_packet_size : USB_MAX_PACKET_SIZE;
+
+                ep->transfer_complete = false;
+                ep->buffer = packet->data;
+                ep->buffer_size = max_length;
+                if (usb_hw_receive(endpoint_num, packet->data, max_length) != USB_SUCCESS) {
+                    ep->transfer_complete = true;
+                    __atomic_clear(&pool->armed, __ATOMIC_RELEASE);
+                }
+                return;
+            }
+
+            __atomic_fetch_or(&usb_packet_pool.starved, 1u << endpoint_num, __ATOMIC_ACQ_REL);
+        }
+
+        __atomic_fetch_add(&pool->overruns, 1, __ATOMIC_RELAXED);
+        __atomic_clear(&pool->armed, __ATOMIC_RELEASE);
+
+        if (filled - __atomic_load_n(&pool->taken, __ATOMIC_ACQUIRE) >= pool->count ||
+            __atomic_load_n(&usb_packet_pool.free_mask, __ATOMIC_ACQUIRE) == 0 ||
+            __atomic_test_and_set(&pool->armed, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+    }
+}
+
+// A packet was freed while OUT endpoints sat idle for want of one
+static void usb_rx_pool_kick_starved(void)
+{
+    uint32_t starved = __atomic_exchange_n(&usb_packet_pool.starved, 0, __ATOMIC_ACQ_REL);
+
+    for (uint8_t endpoint_num = 0; starved != 0; endpoint_num++, starved >>= 1) {
+        usb_rx_pool_t *pool = &usb_device.rx_pools[endpoint_num];
+        if ((starved & 1) && pool->count > 0 && !__atomic_load_n(&pool->armed, __ATOMIC_ACQUIRE) &&
+            !__atomic_test_and_set(&pool->armed, __ATOMIC_ACQUIRE)) {
+            usb_rx_pool_arm(endpoint_num);
+        }
+    }
+}
+
 static void usb_handle_setup_packet(usb_setup_packet_t *setup)
 {
+    usb_device.control_request_length = setup->wLength;
+
     if (usb_device.config->setup_callback) {
         usb_device.config->setup_callback(setup);
     }
@@ -282,6 +704,41 @@ static void usb_handle_transfer_complete(uint8_t endpoint_num, usb_status_t stat
 {
     if (endpoint_num < USB_MAX_ENDPOINTS) {
         usb_device.endpoints[endpoint_num].transfer_complete = true;
+
+        // The filled buffer is published and the next armed before anyone
+        // is told, so the endpoint is never idle while a buffer is free
+        usb_rx_pool_t *pool = &usb_device.rx_pools[endpoint_num];
+        if (pool->count > 0 && __atomic_load_n(&pool->armed, __ATOMIC_ACQUIRE)) {
+            if (status == USB_SUCCESS) {
+                pool->packets[pool->filled & (pool->count - 1)]->length = usb_device.endpoints[endpoint_num].data_length;
+                __atomic_store_n(&pool->filled, pool->filled + 1, __ATOMIC_RELEASE);
+
+                uint32_t depth = pool->filled - __atomic_load_n(&pool->taken, __ATOMIC_ACQUIRE);
+                if (depth > pool->high_water) {
+                    pool->high_water = (uint8_t)depth;
+                }
+            }
+            usb_rx_pool_arm(endpoint_num);
+        }
+
+        // A queued transfer reports once, after its last chunk
+        usb_tx_queue_t *queue = &usb_device.tx_queues[endpoint_num];
+        if (__atomic_load_n(&queue->active, __ATOMIC_ACQUIRE)) {
+            usb_tx_transfer_t *transfer = &queue->transfers[queue->head & (USB_TX_QUEUE_DEPTH - 1)];
+            transfer->offset += transfer->chunk;
+
+            bool more = transfer->offset < transfer->length ||
+                        (transfer->zlp && transfer->chunk == usb_device.endpoints[endpoint_num].max_packet_size);
+            if (status == USB_SUCCESS && more) {
+                status = usb_tx_send_chunk(endpoint_num, transfer);
+                if (status == USB_SUCCESS) {
+                    return;
+                }
+            }
+
+            usb_tx_retire(endpoint_num, status);
+            return;
+        }
     }
 
     if (usb_device.config->transfer_callback) {
@@ -289,9 +746,54 @@ static void usb_handle_transfer_complete(uint8_t endpoint_num, usb_status_t stat
     }
 }
 
+// The controller drops its configuration, so the teardown is usb_stop's
+// for every endpoint but control. Dropped transfers are still reported, so
+// whoever counts them in flight stays in step, and a packet armed for a
+// receive that will never complete goes back to the pool. Packets already
+// filled wait for their consumer; the pool is set up afresh when the host
+// configures the device.
+static void usb_handle_bus_reset(void)
+{
+    for (uint8_t i = 0; i < USB_MAX_ENDPOINTS; i++) {
+        usb_endpoint_t *ep = &usb_device.endpoints[i];
+        usb_tx_queue_t *queue = &usb_device.tx_queues[i];
+        usb_rx_pool_t *pool = &usb_device.rx_pools[i];
+
+        if (i != USB_CONTROL_ENDPOINT) {
+            ep->enabled = false;
+        }
+
+        uint32_t dropped = queue->tail - queue->head;
+        usb_tx_queue_flush(i);
+
+        if (pool->count > 0 && !ep->transfer_complete &&
+            pool->filled - __atomic_load_n(&pool->taken, __ATOMIC_ACQUIRE) < pool->count) {
+            uint32_t slot = pool->filled & (pool->count - 1);
+            usb_packet_unref(pool->packets[slot]);
+            pool->packets[slot] = NULL;
+        }
+        __atomic_clear(&pool->armed, __ATOMIC_RELEASE);
+        ep->transfer_complete = true;
+
+        while (dropped-- > 0 && usb_device.config->transfer_callback) {
+            usb_device.config->transfer_callback(i, USB_ERROR_RESET);
+        }
+    }
+
+    usb_device.device_address = 0;
+    usb_device.current_configuration = 0;
+    usb_set_state(USB_DEVICE_STATE_DEFAULT);
+}
+
 static void usb_set_state(usb_device_state_t new_state)
 {
     if (usb_device.state != new_state) {
+        // A bus reset renegotiates the speed; endpoints are sized for it
+        // once the host configures the device
+        if (new_state == USB_DEVICE_STATE_DEFAULT) {
+            usb_device.speed = usb_hw_get_speed();
+        }
+
         usb_device.state = new_state;
         
         if (usb_device.config->state_callback) {
@@ -302,8 +804,43 @@ static void usb_set_state(usb_device_state_t new_state)
 
 void usb_interrupt_handler(void)
 {
-    // This function will be implemented by hardware-specific code
-    // It should call the appropriate handlers above based on interrupt status
+    if (!usb_device.initialized) {
+        return;
+    }
+
+    usb_hw_event_t event;
+    while (usb_hw_poll_event(&event)) {
+        switch (event.type) {
+            case USB_HW_EVENT_RESET:
+                usb_handle_bus_reset();
+                break;
+
+            case USB_HW_EVENT_SUSPEND:
+                if (usb_device.state != USB_DEVICE_STATE_SUSPENDED) {
+                    usb_device.resume_state = usb_device.state;
+                    usb_set_state(USB_DEVICE_STATE_SUSPENDED);
+                }
+                break;
+
+            case USB_HW_EVENT_RESUME:
+                if (usb_device.state == USB_DEVICE_STATE_SUSPENDED) {
+                    usb_set_state(usb_device.resume_state);
+                }
+                break;
+
+            case USB_HW_EVENT_SETUP:
+                usb_handle_setup_packet(&event.setup);
+                break;
+
+            case USB_HW_EVENT_TRANSFER_COMPLETE:
+                if (event.endpoint_num < USB_MAX_ENDPOINTS &&
+                    usb_device.endpoints[event.endpoint_num].direction == USB_DIRECTION_OUT) {
+                    usb_device.endpoints[event.endpoint_num].data_length = event.length;
+                }
+                usb_handle_transfer_complete(event.endpoint_num, event.status);
+                break;
+        }
+    }
 }
 
 void usb_handle_standard_setup(usb_setup_packet_t *setup)
@@ -313,6 +850,118 @@ void usb_handle_standard_setup(usb_setup_packet_t *setup)
     usb_control_send_status();
 }
 
+static usb_status_t usb_tx_queue_put(uint8_t endpoint_num, uint8_t *data, uint32_t length,
+                                     usb_packet_t *packet, bool zlp)
+{
+    usb_tx_queue_t *queue = &usb_device.tx_queues[endpoint_num];
+    uint32_t tail = queue->tail;
+    uint32_t depth = tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+    if (depth >= USB_TX_QUEUE_DEPTH) {
+        __atomic_fetch_add(&queue->drops, 1, __ATOMIC_RELAXED);
+        return USB_ERROR_BUSY;
+    }
+
+    usb_tx_transfer_t *transfer = &queue->transfers[tail & (USB_TX_QUEUE_DEPTH - 1)];
+    transfer->packet = packet;
+    transfer->data = packet != NULL ? packet->data : data;
+    transfer->length = length;
+    transfer->offset = 0;
+    transfer->chunk = 0;
+    transfer->zlp = zlp;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (depth + 1 > queue->high_water) {
+        queue->high_water = (uint8_t)(depth + 1);
+    }
+
+    usb_tx_queue_kick(endpoint_num);
+    return USB_SUCCESS;
+}
+
+static void usb_tx_queue_kick(uint8_t endpoint_num)
+{
+    usb_tx_queue_t *queue = &usb_device.tx_queues[endpoint_num];
+
+    while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        if (__atomic_test_and_set(&queue->active, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+
+        // Re-check under ownership: the head may have been sent meanwhile
+        uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == head) {
+            __atomic_clear(&queue->active, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        usb_tx_transfer_t *transfer = &queue->transfers[head & (USB_TX_QUEUE_DEPTH - 1)];
+        usb_status_t status = usb_tx_send_chunk(endpoint_num, transfer);
+        if (status == USB_SUCCESS) {
+            return;
+        }
+
+        // The hardware refused it; fail the transfer rather than wedge the queue
+        usb_tx_retire(endpoint_num, status);
+        return;
+    }
+}
+
+static usb_status_t usb_tx_send_chunk(uint8_t endpoint_num, usb_tx_transfer_t *transfer)
+{
+    usb_endpoint_t *ep = &usb_device.endpoints[endpoint_num];
+    uint32_t remaining = transfer->length - transfer->offset;
+
+    transfer->chunk = (uint16_t)(remaining < ep->max_packet_size ? remaining : ep->max_packet_size);
+    ep->transfer_complete = false;
+    ep->data_length = transfer->chunk;
+
+    usb_status_t status = usb_hw_transmit(endpoint_num, transfer->data + transfer->offset, transfer->chunk);
+    if (status != USB_SUCCESS) {
+        ep->transfer_complete = true;
+    }
+
+    return status;
+}
+
+// Drops every queued transfer and gives back the packets they held
+static void usb_tx_queue_flush(uint8_t endpoint_num)
+{
+    usb_tx_queue_t *queue = &usb_device.tx_queues[endpoint_num];
+
+    while (queue->head != queue->tail) {
+        usb_tx_transfer_t *transfer = &queue->transfers[queue->head & (USB_TX_QUEUE_DEPTH - 1)];
+        usb_packet_unref(transfer->packet);
+        transfer->packet = NULL;
+        queue->head++;
+    }
+    queue->active = false;
+}
+
+// Called by the owner of active: drops the head, reports it and starts
+// whatever queued up behind it.
+static void usb_tx_retire(uint8_t endpoint_num, usb_status_t status)
+{
+    usb_tx_queue_t *queue = &usb_device.tx_queues[endpoint_num];
+
+    if (status != USB_SUCCESS) {
+        __atomic_fetch_add(&queue->drops, 1, __ATOMIC_RELAXED);
+    }
+
+    usb_tx_transfer_t *transfer = &queue->transfers[queue->head & (USB_TX_QUEUE_DEPTH - 1)];
+    usb_packet_unref(transfer->packet);
+    transfer->packet = NULL;
+
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+    __atomic_clear(&queue->active, __ATOMIC_RELEASE);
+
+    if (usb_device.config->transfer_callback) {
+        usb_device.config->transfer_callback(endpoint_num, status);
+    }
+
+    usb_tx_queue_kick(endpoint_num);
+}
+
 // Hardware abstraction layer - these functions need to be implemented
 // for the specific microcontroller being used
 
@@ -341,6 +990,20 @@ static usb_status_t usb_hw_stop(void)
     return USB_SUCCESS;
 }
 
+static usb_speed_t usb_hw_get_speed(void)
+{
+    // Read the speed the controller settled on during reset signalling
+    return USB_SPEED_FULL;
+}
+
+static bool usb_hw_poll_event(usb_hw_event_t *event)
+{
+    // Read and acknowledge the next pending interrupt source, filling in
+    // event; return false once none are left
+    (void)event;
+    return false;
+}
+
 static usb_status_t usb_hw_endpoint_configure(uint8_t endpoint_num, 
                                              usb_endpoint_type_t type,
                                              usb_direction_t direction,
@@ -382,6 +1045,7 @@ static usb_status_t usb_hw_transmit(uint8_t endpoint_num, uint8_t *data, uint16_
 
 static usb_status_t usb_hw_receive(uint8_t endpoint_num, uint8_t *buffer, uint16_t max_length)
 {
-    // Prepare to receive data on endpoint
+    // Prepare to receive data on endpoint. Pool receives pass a packet's
+    // data, aligned to USB_PACKET_ALIGN, which DMA can target directly.
     return USB_SUCCESS;
 }
\ No newline at end of file
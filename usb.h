@@ -5,9 +5,41 @@
 #include <stdbool.h>
 
 #define USB_MAX_ENDPOINTS 16
-#define USB_MAX_PACKET_SIZE 64
+// Largest packet any endpoint may use, which sizes the transmit queue
+// slots. 512 allows high-speed bulk; a full-speed-only build can set 64.
+#ifndef USB_MAX_PACKET_SIZE
+#define USB_MAX_PACKET_SIZE 512
+#endif
+#define USB_FS_MAX_PACKET_SIZE 64
+#define USB_HS_BULK_MAX_PACKET_SIZE 512
 #define USB_CONTROL_ENDPOINT 0
 
+// Packets usb_transmit can hold per IN endpoint, including the one in flight
+#ifndef USB_TX_QUEUE_DEPTH
+#define USB_TX_QUEUE_DEPTH 4
+#endif
+
+// Packet buffers shared by all endpoints (at most 64), each aligned for
+// DMA and cache maintenance
+#ifndef USB_PACKET_POOL_SIZE
+#define USB_PACKET_POOL_SIZE 48
+#endif
+
+#ifndef USB_PACKET_ALIGN
+#define USB_PACKET_ALIGN 64
+#endif
+
+#if defined(__GNUC__)
+#define USB_PACKET_ALIGNED __attribute__((aligned(USB_PACKET_ALIGN)))
+#else
+#define USB_PACKET_ALIGNED
+#endif
+
+// Most buffers usb_receive_pool can rotate on one OUT endpoint
+#ifndef USB_RX_POOL_MAX_BUFFERS
+#define USB_RX_POOL_MAX_BUFFERS 8
+#endif
+
 typedef enum {
     USB_SUCCESS = 0,
     USB_ERROR_INVALID_PARAM,
@@ -15,7 +47,9 @@ typedef enum {
     USB_ERROR_BUSY,
     USB_ERROR_TIMEOUT,
     USB_ERROR_STALL,
-    USB_ERROR_BUFFER_OVERFLOW
+    USB_ERROR_BUFFER_OVERFLOW,
+    USB_ERROR_NO_DATA,
+    USB_ERROR_RESET
 } usb_status_t;
 
 typedef enum {
@@ -30,6 +64,11 @@ typedef enum {
     USB_DIRECTION_IN = 1
 } usb_direction_t;
 
+typedef enum {
+    USB_SPEED_FULL = 0,
+    USB_SPEED_HIGH
+} usb_speed_t;
+
 typedef enum {
     USB_DEVICE_STATE_DETACHED = 0,
     USB_DEVICE_STATE_ATTACHED,
@@ -60,6 +99,26 @@ typedef struct {
     bool transfer_complete;
 } usb_endpoint_t;
 
+typedef struct {
+    uint8_t queued;
+    uint8_t high_water;
+    uint32_t drops;
+} usb_tx_stats_t;
+
+typedef struct {
+    uint8_t filled;
+    uint8_t high_water;
+    uint32_t overruns;
+} usb_rx_stats_t;
+
+// A pool packet. Whoever holds a reference may read data; only the sole
+// holder should write it. length is the bytes in use.
+typedef struct {
+    uint8_t data[USB_MAX_PACKET_SIZE];
+    uint16_t length;
+    uint16_t refs;
+} USB_PACKET_ALIGNED usb_packet_t;
+
 typedef struct {
     uint8_t bLength;
     uint8_t bDescriptorType;
@@ -108,6 +167,12 @@ usb_status_t usb_start(void);
 usb_status_t usb_stop(void);
 usb_device_state_t usb_get_state(void);
 
+// Speed negotiated at the last bus reset (full speed until then), and the
+// largest packet an endpoint of the given type may use at that speed and
+// within USB_MAX_PACKET_SIZE. Endpoints configured larger are refused.
+usb_speed_t usb_get_speed(void);
+uint16_t usb_get_max_packet_size(usb_endpoint_type_t type);
+
 usb_status_t usb_endpoint_configure(uint8_t endpoint_num, 
                                    usb_endpoint_type_t type,
                                    usb_direction_t direction,
@@ -117,12 +182,56 @@ usb_status_t usb_endpoint_disable(uint8_t endpoint_num);
 usb_status_t usb_endpoint_stall(uint8_t endpoint_num);
 usb_status_t usb_endpoint_clear_stall(uint8_t endpoint_num);
 
+// Packets come from the pool with one reference (NULL when it is empty)
+// and go back when the last is dropped. Safe from interrupt context.
+usb_packet_t *usb_packet_alloc(void);
+void usb_packet_ref(usb_packet_t *packet);
+void usb_packet_unref(usb_packet_t *packet);
+
+// The packet (at most one, NULL for zero length) is copied into a pool
+// packet in the endpoint's transmit queue and sent after the ones ahead of
+// it; USB_ERROR_BUSY means the queue or pool is full and it was not taken.
 usb_status_t usb_transmit(uint8_t endpoint_num, uint8_t *data, uint16_t length);
+
+// Queues packet->length bytes of packet without copying. The queue takes
+// its own reference for the transfer, so the caller keeps theirs and must
+// not write the packet until the queue has dropped it.
+usb_status_t usb_transmit_packet(uint8_t endpoint_num, usb_packet_t *packet);
+
+// Zero-copy transfer of any length, sent in max-packet chunks behind what is
+// already queued. data must stay valid until the endpoint's transfer
+// callback, which fires once for the whole transfer. zlp appends a
+// zero-length packet when length is a multiple of the max packet size.
+usb_status_t usb_transmit_transfer(uint8_t endpoint_num, uint8_t *data, uint32_t length, bool zlp);
+usb_status_t usb_get_tx_stats(uint8_t endpoint_num, usb_tx_stats_t *stats);
 usb_status_t usb_receive(uint8_t endpoint_num, uint8_t *buffer, uint16_t max_length);
+
+// Rotating receive into pool packets: up to count (a power of two up to
+// USB_RX_POOL_MAX_BUFFERS) filled packets can wait, and the next packet is
+// armed as each completes, before its transfer callback runs, so packets
+// arrive back to back while earlier ones wait. usb_receive_acquire hands
+// the oldest filled packet over with its reference, in order, to one
+// consumer, who drops it with usb_packet_unref or passes it on (to
+// usb_transmit_packet, say). With count packets waiting, or the pool
+// empty, the endpoint NAKs until one is taken or freed, which counts an
+// overrun. Setting up a pool discards what it held.
+usb_status_t usb_receive_pool(uint8_t endpoint_num, uint8_t count);
+usb_status_t usb_receive_acquire(uint8_t endpoint_num, usb_packet_t **packet);
+usb_status_t usb_get_rx_stats(uint8_t endpoint_num, usb_rx_stats_t *stats);
+
+// Bytes the last completed receive on an OUT endpoint delivered; valid in
+// its transfer callback and until the endpoint is re-armed.
+uint16_t usb_get_received_length(uint8_t endpoint_num);
 usb_status_t usb_control_send_status(void);
 usb_status_t usb_control_send_data(uint8_t *data, uint16_t length);
 usb_status_t usb_control_receive_data(uint8_t *buffer, uint16_t max_length);
 
+// Drains the controller's pending events: bus reset, suspend/resume, SETUP
+// packets and transfer completions, whose callbacks run from here. Called
+// from the USB interrupt; the work per event is bounded, so callbacks
+// should hand anything heavier to a task. A bus reset disables every
+// endpoint but control until the host configures the device again; each
+// transfer queued on them is dropped and reported with USB_ERROR_RESET.
 void usb_interrupt_handler(void);
 
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "usb.h"
+#include <string.h>
 
 #define USB_AUDIO_CLASS 0x01
 #define USB_AUDIO_SUBCLASS_AUDIOCONTROL 0x01
@@ -37,36 +38,101 @@ usb_device_descriptor_t midi_device_descriptor = {
     .bNumConfigurations = 1
 };
 
-static uint8_t midi_config_descriptor_data[] = {
-    0x09, 0x02, 0x65, 0x00, 0x02, 0x01, 0x00, 0x80, 0x32,
-    
-    0x09, 0x04, 0x00, 0x00, 0x00, USB_AUDIO_CLASS, USB_AUDIO_SUBCLASS_AUDIOCONTROL, 0x00, 0x00,
-    
-    0x09, USB_AUDIO_CS_INTERFACE, USB_AUDIO_AC_HEADER, 0x00, 0x01, 0x09, 0x00, 0x01, 0x01,
-    
-    0x09, 0x04, 0x01, 0x00, 0x02, USB_AUDIO_CLASS, USB_AUDIO_SUBCLASS_MIDISTREAMING, 0x00, 0x00,
-    
-    0x07, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_HEADER, 0x00, 0x01, 0x41, 0x00,
-    
-    0x06, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_IN_JACK, USB_AUDIO_JACK_TYPE_EMBEDDED, 0x01, 0x00,
-    
-    0x06, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_IN_JACK, USB_AUDIO_JACK_TYPE_EXTERNAL, 0x02, 0x00,
-    
-    0x09, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_OUT_JACK, USB_AUDIO_JACK_TYPE_EMBEDDED, 0x03, 0x01, 0x02, 0x01, 0x00,
-    
-    0x09, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_OUT_JACK, USB_AUDIO_JACK_TYPE_EXTERNAL, 0x04, 0x01, 0x01, 0x01, 0x00,
-    
-    0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
-    
-    0x05, USB_AUDIO_CS_ENDPOINT, USB_AUDIO_MS_GENERAL, 0x01, 0x01,
-    
-    0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
-    
-    0x05, USB_AUDIO_CS_ENDPOINT, USB_AUDIO_MS_GENERAL, 0x01, 0x03
-};
+#define MIDI_DESCRIPTOR_MAX_CABLES 16
+
+#define USB_MIDI_JACKS_SIZE (6 + 6 + 9 + 9)
+#define USB_MIDI_MS_LENGTH(cables) (7 + (cables) * USB_MIDI_JACKS_SIZE + 2 * (9 + 4 + (cables)))
+#define USB_MIDI_CONFIG_LENGTH(cables) (9 + 9 + 9 + 9 + USB_MIDI_MS_LENGTH(cables))
+
+static uint8_t midi_config_descriptor_data[USB_MIDI_CONFIG_LENGTH(MIDI_DESCRIPTOR_MAX_CABLES)];
 
 usb_config_descriptor_t *midi_config_descriptor = (usb_config_descriptor_t*)midi_config_descriptor_data;
 
+uint16_t midi_build_config_descriptor(uint8_t cable_count, uint8_t endpoint_out, uint8_t endpoint_in,
+                                      uint16_t max_packet_size);
+
+static uint8_t *midi_descriptor_put(uint8_t *p, const uint8_t *bytes, uint8_t length);
+
+// Builds the configuration with a MIDIStreaming interface exposing one
+// embedded and one external jack per direction for each cable. Cable n is
+// the nth jack listed on an endpoint, so jack IDs run 4n+1 (embedded IN),
+// 4n+2 (external IN), 4n+3 (embedded OUT), 4n+4 (external OUT). Both bulk
+// endpoints advertise max_packet_size, which has to match the bus speed, so
+// the configuration is rebuilt after each reset. Returns wTotalLength, or 0
+// if cable_count is out of range.
+uint16_t midi_build_config_descriptor(uint8_t cable_count, uint8_t endpoint_out, uint8_t endpoint_in,
+                                      uint16_t max_packet_size)
+{
+    if (cable_count == 0 || cable_count > MIDI_DESCRIPTOR_MAX_CABLES) {
+        return 0;
+    }
+
+    uint16_t ms_length = USB_MIDI_MS_LENGTH(cable_count);
+    uint16_t total_length = USB_MIDI_CONFIG_LENGTH(cable_count);
+    uint8_t *p = midi_config_descriptor_data;
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        0x09, 0x02, total_length & 0xFF, total_length >> 8, 0x02, 0x01, 0x00, 0x80, 0x32}, 9);
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        0x09, 0x04, 0x00, 0x00, 0x00, USB_AUDIO_CLASS, USB_AUDIO_SUBCLASS_AUDIOCONTROL, 0x00, 0x00}, 9);
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        0x09, USB_AUDIO_CS_INTERFACE, USB_AUDIO_AC_HEADER, 0x00, 0x01, 0x09, 0x00, 0x01, 0x01}, 9);
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        0x09, 0x04, 0x01, 0x00, 0x02, USB_AUDIO_CLASS, USB_AUDIO_SUBCLASS_MIDISTREAMING, 0x00, 0x00}, 9);
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        0x07, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_HEADER, 0x00, 0x01, ms_length & 0xFF, ms_length >> 8}, 7);
+
+    for (uint8_t cable = 0; cable < cable_count; cable++) {
+        uint8_t jack = cable * 4;
+
+        p = midi_descriptor_put(p, (const uint8_t[]){
+            0x06, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_IN_JACK, USB_AUDIO_JACK_TYPE_EMBEDDED, jack + 1, 0x00}, 6);
+
+        p = midi_descriptor_put(p, (const uint8_t[]){
+            0x06, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_IN_JACK, USB_AUDIO_JACK_TYPE_EXTERNAL, jack + 2, 0x00}, 6);
+
+        p = midi_descriptor_put(p, (const uint8_t[]){
+            0x09, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_OUT_JACK, USB_AUDIO_JACK_TYPE_EMBEDDED, jack + 3,
+            0x01, jack + 2, 0x01, 0x00}, 9);
+
+        p = midi_descriptor_put(p, (const uint8_t[]){
+            0x09, USB_AUDIO_CS_INTERFACE, USB_AUDIO_MS_MIDI_OUT_JACK, USB_AUDIO_JACK_TYPE_EXTERNAL, jack + 4,
+            0x01, jack + 1, 0x01, 0x00}, 9);
+    }
+
+    // Host-to-device data enters through the embedded IN jacks and leaves
+    // through the embedded OUT jacks, one jack per cable on each endpoint
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        0x09, 0x05, endpoint_out, 0x02, max_packet_size & 0xFF, max_packet_size >> 8, 0x00, 0x00, 0x00}, 9);
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        4 + cable_count, USB_AUDIO_CS_ENDPOINT, USB_AUDIO_MS_GENERAL, cable_count}, 4);
+    for (uint8_t cable = 0; cable < cable_count; cable++) {
+        *p++ = cable * 4 + 1;
+    }
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        0x09, 0x05, endpoint_in, 0x02, max_packet_size & 0xFF, max_packet_size >> 8, 0x00, 0x00, 0x00}, 9);
+
+    p = midi_descriptor_put(p, (const uint8_t[]){
+        4 + cable_count, USB_AUDIO_CS_ENDPOINT, USB_AUDIO_MS_GENERAL, cable_count}, 4);
+    for (uint8_t cable = 0; cable < cable_count; cable++) {
+        *p++ = cable * 4 + 3;
+    }
+
+    return total_length;
+}
+
+static uint8_t *midi_descriptor_put(uint8_t *p, const uint8_t *bytes, uint8_t length)
+{
+    memcpy(p, bytes, length);
+    return p + length;
+}
+
 char* midi_string_descriptors[] = {
     "RTOS MIDI",
     "USB MIDI Device", 